@@ -698,12 +698,17 @@ int Bmi160::writeRegister(uint8_t reg, uint8_t val) {
         return ret;
     }
     else if (type_ == InterfaceType::BMI_SPI) {
-        spi_->beginTransaction(spiSettings_);
-        digitalWrite(csPin_, LOW);
-        spi_->transfer(reg & 0x7f);
-        spi_->transfer(val);
-        digitalWrite(csPin_, HIGH);
-        spi_->endTransaction();
+        if (spiHook_) {
+            CHECK(spiHook_(reg & 0x7f, &val, nullptr, 1));
+        }
+        else {
+            spi_->beginTransaction(spiSettings_);
+            digitalWrite(csPin_, LOW);
+            spi_->transfer(reg & 0x7f);
+            spi_->transfer(val);
+            digitalWrite(csPin_, HIGH);
+            spi_->endTransaction();
+        }
         if ((accelPmu_ == PMU_STATUS_ACC_LOW) ||
             (accelPmu_ == PMU_STATUS_ACC_SUSPEND) ||
             (gyroPmu_ == PMU_STATUS_GYRO_SUSPEND) ||
@@ -742,6 +747,10 @@ int Bmi160::readRegister(uint8_t reg, uint8_t* val, int length) {
         return SYSTEM_ERROR_NONE;
     }
     else if (type_ == InterfaceType::BMI_SPI) {
+        if (spiHook_) {
+            return spiHook_(reg | 0x80, nullptr, val, length);
+        }
+
         spi_->beginTransaction(spiSettings_);
         digitalWrite(csPin_, LOW);
         spi_->transfer(reg | 0x80);
@@ -758,4 +767,9 @@ int Bmi160::readRegister(uint8_t reg, uint8_t* val, int length) {
     return SYSTEM_ERROR_INVALID_STATE;
 }
 
+void Bmi160::setSpiTransferHook(SpiTransferHook hook) {
+    const std::lock_guard<RecursiveMutex> lock(mutex_);
+    spiHook_ = hook;
+}
+
 RecursiveMutex Bmi160::mutex_;
@@ -173,6 +173,12 @@ public:
     bool isMotionDetect(uint32_t val);
     bool isHighGDetect(uint32_t val);
 
+    // Replaces the built-in SPI transaction, for example to share the bus through an arbiter.
+    // The hook owns chip select and sends header followed by length bytes of tx (or 0xff),
+    // storing the bytes clocked in after the header to rx when it is not null.
+    using SpiTransferHook = std::function<int(uint8_t header, const uint8_t* tx, uint8_t* rx, size_t length)>;
+    void setSpiTransferHook(SpiTransferHook hook);
+
     static Bmi160& getInstance();
 
 private:
@@ -211,6 +217,7 @@ private:
     SPIClass* spi_;
     pin_t csPin_;
     const __SPISettings spiSettings_;
+    SpiTransferHook spiHook_;
     pin_t intPin_;
     bool initialized_;
     Bmi160PmuAccel accelPmu_;
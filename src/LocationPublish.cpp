@@ -17,12 +17,16 @@
 #include "LocationPublish.h"
 #include "tracker_location.h"
 #include "tracker.h"
+#include "json_sizing.h"
+#include "compact_encoding.h"
+#include "publish_latency.h"
 
 constexpr int HIGH_PRIORITY = 0;
 constexpr int LOW_PRIORITY = 1;
 const int DEFAULT_DISK_LIMIT = 64;//In KB
 const size_t KILOBYTE_CONSTANT = 1024;
 const char STORE_QUEUE_FILE_PATH[] = "/usr/store_queue";
+const char STORE_PRIORITY_QUEUE_FILE_PATH[] = "/usr/store_queue_pri";
 
 uint8_t store_msg_buffer[particle::protocol::MAX_EVENT_DATA_LENGTH + 1] = {0};
 
@@ -33,9 +37,11 @@ void LocationPublish::init() {
     static ConfigObject store_forward("store", {
         ConfigBool("enable", &store_config.enable),
         ConfigInt("quota", &store_config.quota),
+        ConfigInt("merge", &store_config.merge, 1, LOCATION_PUBLISH_MERGE_MAX),
         ConfigStringEnum("policy", {
                 {"drop_old", (int32_t) DiskQueuePolicy::FifoDeleteOld},
-                {"drop_new", (int32_t) DiskQueuePolicy::FifoDeleteNew}
+                {"drop_new", (int32_t) DiskQueuePolicy::FifoDeleteNew},
+                {"compact", STORE_POLICY_COMPACT}
             }, &store_config.policy)
     });
 
@@ -49,11 +55,21 @@ void LocationPublish::init() {
 }
 
 void LocationPublish::start() {
+    //compaction needs a full queue to refuse the new message rather than lose an old one
+    auto policy = ((int32_t)store_config.policy == STORE_POLICY_COMPACT) ?
+        DiskQueuePolicy::FifoDeleteNew : store_config.policy;
+    size_t quota = store_config.quota*KILOBYTE_CONSTANT;
+    size_t priority_quota = quota*LOCATION_PUBLISH_PRIORITY_QUOTA_PERCENT/100;
     if(store_msg_queue.start(STORE_QUEUE_FILE_PATH,
-                        store_config.quota*KILOBYTE_CONSTANT,
-                        store_config.policy) != SYSTEM_ERROR_NONE) {
+                        quota - priority_quota,
+                        policy) != SYSTEM_ERROR_NONE) {
         Log.error("Failed to start location publish disk queue");
     }
+    if(priority_msg_queue.start(STORE_PRIORITY_QUEUE_FILE_PATH,
+                        priority_quota,
+                        policy) != SYSTEM_ERROR_NONE) {
+        Log.error("Failed to start location publish priority disk queue");
+    }
 }
 
 void LocationPublish::tick() {
@@ -71,77 +87,549 @@ void LocationPublish::tick() {
         current_config = store_config;
     }
 
-    //check if DiskQueue has messages to retry
-    if(!store_msg_queue.isEmpty() && isStoreEnabled() && Particle.connected()) {
+    //keep a window of stored messages in flight until the DiskQueue is empty
+    while(hasStored() && isStoreEnabled() && Particle.connected()) {
+        DrainSlot* slot = nullptr;
+        size_t in_flight = 0;
+        for(auto& candidate : _drain) {
+            if(candidate.used) {
+                in_flight++;
+            }
+            else if(!slot) {
+                slot = &candidate;
+            }
+        }
+        if(!slot || (in_flight >= _drainWindow)) {
+            break;
+        }
+
+        bool priority = false;
+        if(!takeStored(priority)) {
+            break;
+        }
+
         CloudServicePublishFlags cloud_flags =
             (TrackerLocation::instance().isProcessAckEnabled()) ?
                 CloudServicePublishFlags::FULL_ACK : CloudServicePublishFlags::NONE;
 
-        auto size = store_msg_queue.peekFrontSize();
-        store_msg_queue.peekFront(store_msg_buffer, size);
-        store_msg_queue.popFront(); //ok to pop, disk_queue_cb will throw it back
-        //on if it fails again and there's space in the disk queue
-
-        //Priority level set to normal. don't want these to be high priority
-        regPendingLocPubCallback(); //use the pending callback for this since
-        //the exchange between pending vs the current hasn't occured yet
+        //Priority level set to normal for periodic locations. don't want these
+        //to be high priority
+        slot->used = true;
+        slot->sentMs = millis();
         auto send_rval =
             CloudService::instance().send((const char*)store_msg_buffer,
                 WITH_ACK,
                 cloud_flags,
-                &LocationPublish::loc_store_cb_wrapper,
+                &LocationPublish::drain_cb,
                 this,
-                CLOUD_DEFAULT_TIMEOUT_MS, nullptr, "loc", 0, 1);
+                CLOUD_DEFAULT_TIMEOUT_MS, slot, "loc", 0,
+                priority ? HIGH_PRIORITY : LOW_PRIORITY);
         if(send_rval) {
-            Tracker::instance().location.
-                issue_location_publish_callbacks(CloudServiceStatus::FAILURE,
-                                                nullptr,
-                                                (const char*)store_msg_buffer);
+            slot->used = false;
+            disk_queue_cb(CloudServiceStatus::FAILURE, nullptr,
+                (const char*)store_msg_buffer, nullptr);
+            break;
+        }
+        _stats.drained++;
+        if(priority) {
+            _stats.drainedPriority++;
         }
     }
 }
 
+// Triggers of periodic locations, a location published for any other trigger goes to the
+// priority lane
+static const char* const periodic_triggers[] = {"time", "radius", "lock", "crumbs", "distance", "turn"};
+
+static bool isPriority(const char* msg, size_t size) {
+    auto root = JSONValue::parseCopy(msg, size);
+    JSONObjectIterator item(root);
+    while(item.next()) {
+        if(item.name() == "trig") {
+            JSONArrayIterator trig(item.value());
+            while(trig.next()) {
+                auto name = trig.value().toString();
+                bool periodic = false;
+                for(auto trigger : periodic_triggers) {
+                    if(name == trigger) {
+                        periodic = true;
+                        break;
+                    }
+                }
+                if(!periodic) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Stored location that can become a breadcrumb of a later one, with coordinates in
+// millionths of a degree
+struct StoredPoint {
+    uint32_t epoch;
+    int32_t latitude;
+    int32_t longitude;
+    double tripStart;       // UTC start of the trip the location belongs to, 0 outside of trips
+};
+
+// Most breadcrumbs of one stored message that compaction can thin
+constexpr size_t STORE_COMPACT_MAX_CRUMBS {64};
+
+// Longest encoding of one breadcrumb, three 32-bit values and their separators
+constexpr size_t STORE_COMPACT_CRUMB_SIZE {36};
+
+// ,"crumbs":[]
+constexpr size_t STORE_CRUMBS_HEADER_SIZE {12};
+
+// Mergeable locations stored since the last pass before another pass over the periodic lane
+// is worth its flash writes, or a quarter of the lane when that is more
+constexpr size_t STORE_COMPACT_MIN_MERGEABLE {8};
+
+// Marks where a compaction pass started, stored messages always hold at least "{}" and a null
+static const uint8_t compact_sentinel[] = {0};
+
+static uint8_t merge_msg_buffer[sizeof(store_msg_buffer)];
+static uint8_t compact_msg_buffer[sizeof(store_msg_buffer)];
+static uint8_t record_buffer[sizeof(store_msg_buffer)];
+static StoredPoint compact_crumbs[STORE_COMPACT_MAX_CRUMBS];
+
+// Store a message as a compact record, or as text when it cannot be encoded
+static bool pushStored(DiskQueue& queue, const char* msg, size_t size) {
+    auto record_size = compactJson(msg, size, record_buffer, sizeof(record_buffer));
+    if(record_size) {
+        return queue.pushBack(record_buffer, record_size);
+    }
+    return queue.pushBack((const uint8_t*)msg, size + 1);
+}
+
+// Read the front of the queue as JSON text without popping it, returns the length of the
+// message, 0 if there is none this buffer can hold
+static size_t peekStored(DiskQueue& queue, uint8_t* buffer, size_t capacity) {
+    auto size = queue.peekFrontSize();
+    if(!size || (size > sizeof(record_buffer))) {
+        return 0;
+    }
+    queue.peekFront(record_buffer, size);
+    if(isCompactJson(record_buffer, size)) {
+        return expandJson(record_buffer, size, (char*)buffer, capacity);
+    }
+
+    //written as text, by older firmware or because it could not be encoded
+    size = strnlen((const char*)record_buffer, size);
+    if(size >= capacity) {
+        return 0;
+    }
+    memcpy(buffer, record_buffer, size);
+    buffer[size] = '\0';
+    return size;
+}
+
+// Only locked, JSON encoded periodic locations are merged so that triggers, unlocked
+// publishes and publishes already carrying breadcrumbs are always kept whole
+static bool parseMergeable(const char* msg, size_t size, StoredPoint& point) {
+    auto root = JSONValue::parseCopy(msg, size);
+    if(!root.isObject()) {
+        return false;
+    }
+
+    bool locked = false;
+    unsigned fields = 0;
+    point.tripStart = 0.0;
+    JSONObjectIterator item(root);
+    while(item.next()) {
+        auto name = item.name();
+        if(name == "loc") {
+            JSONObjectIterator loc(item.value());
+            while(loc.next()) {
+                auto field = loc.name();
+                if(field == "lck") {
+                    locked = (loc.value().toInt() == 1);
+                }
+                else if(field == "time") {
+                    point.epoch = (uint32_t)loc.value().toDouble();
+                    fields |= 0x1;
+                }
+                else if(field == "lat") {
+                    point.latitude = (int32_t)lround(loc.value().toDouble() * 1e6);
+                    fields |= 0x2;
+                }
+                else if(field == "lon") {
+                    point.longitude = (int32_t)lround(loc.value().toDouble() * 1e6);
+                    fields |= 0x4;
+                }
+                else if(field == "tripStart") {
+                    point.tripStart = loc.value().toDouble();
+                }
+            }
+        }
+        else if(name == "trig") {
+            JSONArrayIterator trig(item.value());
+            while(trig.next()) {
+                if(!(trig.value().toString() == "time")) {
+                    return false;
+                }
+            }
+        }
+        else if(name == "crumbs") {
+            return false;
+        }
+    }
+
+    return locked && (fields == 0x7);
+}
+
+// Breadcrumb values of a point, the first absolute and the rest relative to the one before
+static void crumbValues(const StoredPoint& point, const StoredPoint* last, int32_t (&values)[3]) {
+    values[0] = last ? (int32_t)(point.epoch - last->epoch) : (int32_t)point.epoch;
+    values[1] = last ? point.latitude - last->latitude : point.latitude;
+    values[2] = last ? point.longitude - last->longitude : point.longitude;
+}
+
+// Write breadcrumbs as a JSON array, returns the length written
+static size_t writeCrumbs(char* out, size_t size, const StoredPoint* points, size_t count) {
+    JSONBufferWriter writer(out, size);
+    writer.beginArray();
+    for(size_t i = 0; i < count; i++) {
+        int32_t values[3];
+        crumbValues(points[i], i ? &points[i - 1] : nullptr, values);
+        if(!i) {
+            writer.value((unsigned int)points[i].epoch);
+        }
+        else {
+            writer.value((int)values[0]);
+        }
+        writer.value((int)values[1]);
+        writer.value((int)values[2]);
+    }
+    writer.endArray();
+    return std::min(writer.dataSize(), size);
+}
+
+// Insert breadcrumbs before the closing brace of a message, returns the new length
+static size_t appendCrumbs(uint8_t* msg, size_t size, size_t capacity, const StoredPoint* points, size_t count) {
+    auto end = strrchr((char*)msg, '}');
+    if(!end) {
+        return size;
+    }
+    size_t pos = end - (char*)msg;
+    pos += snprintf((char*)msg + pos, capacity - pos, ",\"crumbs\":");
+    pos += writeCrumbs((char*)msg + pos, capacity - pos - 1, points, count);
+    pos += snprintf((char*)msg + pos, capacity - pos, "}");
+    return pos;
+}
+
+// Keep the first and last points and every other one in between, returns the points kept
+static size_t thinPoints(StoredPoint* points, size_t count) {
+    size_t kept = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(!i || (i == count - 1) || !(i % 2)) {
+            points[kept++] = points[i];
+        }
+    }
+    return kept;
+}
+
+// Thin the breadcrumbs of a message in place, returns the breadcrumbs dropped
+static size_t thinCrumbs(uint8_t* msg, size_t& size) {
+    auto text = (char*)msg;
+    auto begin = strstr(text, "\"crumbs\":[");
+    if(!begin) {
+        return 0;
+    }
+    begin += sizeof("\"crumbs\":") - 1;
+    auto end = strchr(begin, ']');
+    if(!end) {
+        return 0;
+    }
+
+    size_t count = 0;
+    int32_t values[3];
+    size_t value = 0;
+    auto p = begin + 1;
+    while((p < end) && (count < STORE_COMPACT_MAX_CRUMBS)) {
+        char* next;
+        values[value++] = (int32_t)strtol(p, &next, 10);
+        if(next == p) {
+            return 0;
+        }
+        if(value == 3) {
+            auto& point = compact_crumbs[count];
+            auto last = count ? &compact_crumbs[count - 1] : nullptr;
+            point.epoch = last ? last->epoch + values[0] : (uint32_t)values[0];
+            point.latitude = last ? last->latitude + values[1] : values[1];
+            point.longitude = last ? last->longitude + values[2] : values[2];
+            count++;
+            value = 0;
+        }
+        p = (*next == ',') ? next + 1 : next;
+    }
+    if(value || (p < end) || (count < 3)) {
+        //partial, longer than can be thinned here or too short to thin
+        return 0;
+    }
+
+    auto kept = thinPoints(compact_crumbs, count);
+    //the thinned array is never longer than the original so it is written in place
+    size_t old_length = end + 1 - begin;
+    size_t new_length = writeCrumbs(begin, old_length, compact_crumbs, kept);
+    memmove(begin + new_length, end + 1, size - (end + 1 - text) + 1);
+    size -= old_length - new_length;
+    return count - kept;
+}
+
+size_t LocationPublish::takeStored(bool& priority) {
+    priority = !priority_msg_queue.isEmpty();
+    auto& queue = priority ? priority_msg_queue : store_msg_queue;
+    auto& depth = priority ? _priorityDepth : _periodicDepth;
+    auto size = peekStored(queue, store_msg_buffer, sizeof(store_msg_buffer));
+    queue.popFront(); //ok to pop, drain_cb will throw it back
+    //on if it fails again and there's space in the disk queue
+    depth = depth ? depth - 1 : 0;
+    if(!size) {
+        //nothing this buffer could ever send or the marker of an interrupted compaction
+        return 0;
+    }
+
+    StoredPoint points[LOCATION_PUBLISH_MERGE_MAX];
+    size_t count = 0;
+    size_t crumbs_size = STORE_CRUMBS_HEADER_SIZE;
+    StoredPoint newest {};
+    if(priority || (store_config.merge <= 1) ||
+        !parseMergeable((const char*)store_msg_buffer, size, newest)) {
+        return size;
+    }
+
+    //fold the newest message so far into the breadcrumbs while the next one can be merged
+    while((count + 1 < (size_t)store_config.merge) && !store_msg_queue.isEmpty()) {
+        auto next_size = peekStored(store_msg_queue, merge_msg_buffer, sizeof(merge_msg_buffer));
+        if(!next_size) {
+            break;
+        }
+
+        StoredPoint next {};
+        if(!parseMergeable((const char*)merge_msg_buffer, next_size, next) ||
+            (next.tripStart != newest.tripStart)) {
+            break;
+        }
+
+        int32_t values[3];
+        crumbValues(newest, count ? &points[count - 1] : nullptr, values);
+        size_t crumb_size = 0;
+        for(auto value : values) {
+            crumb_size += jsonElementSize([value](JSONWriter& writer) {writer.value((int)value);});
+        }
+        if(next_size + crumbs_size + crumb_size > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+            break;
+        }
+
+        store_msg_queue.popFront();
+        _periodicDepth = _periodicDepth ? _periodicDepth - 1 : 0;
+        points[count++] = newest;
+        crumbs_size += crumb_size;
+        newest = next;
+        memcpy(store_msg_buffer, merge_msg_buffer, next_size);
+        store_msg_buffer[next_size] = '\0';
+        size = next_size;
+    }
+
+    if(!count) {
+        return size;
+    }
+
+    _stats.merged += count;
+    return appendCrumbs(store_msg_buffer, size, sizeof(store_msg_buffer), points, count);
+}
+
+// Read the front of the queue into a buffer and pop it, returns the length of the message
+static size_t takeFront(DiskQueue& queue, uint8_t* buffer, size_t capacity) {
+    auto size = peekStored(queue, buffer, capacity);
+    queue.popFront();
+    return size;
+}
+
+// Consecutive periodic locations of one trip collected during compaction, the newest is held
+// in merge_msg_buffer
+struct CompactRun {
+    bool active;
+    size_t size;
+    StoredPoint newest;
+    StoredPoint points[LOCATION_PUBLISH_MERGE_MAX];
+    size_t count;
+};
+
+// Store a run as its newest message carrying the older ones as breadcrumbs, returns the
+// breadcrumbs dropped
+static size_t flushRun(DiskQueue& queue, CompactRun& run) {
+    if(!run.active) {
+        return 0;
+    }
+    run.active = false;
+
+    auto size = run.size;
+    size_t thinned = 0;
+    if(run.count) {
+        auto kept = thinPoints(run.points, run.count);
+        thinned = run.count - kept;
+        size = appendCrumbs(merge_msg_buffer, size, sizeof(merge_msg_buffer), run.points, kept);
+        run.count = 0;
+    }
+    if(!pushStored(queue, (const char*)merge_msg_buffer, size)) {
+        Log.warn("Unable to write compacted location message to DiskQueue, discarding");
+    }
+    return thinned;
+}
+
+bool LocationPublish::compact() {
+    auto thinned = _stats.thinned;
+
+    //the first message makes room for the marker that ends the pass
+    auto size = takeFront(store_msg_queue, compact_msg_buffer, sizeof(compact_msg_buffer));
+    if(!store_msg_queue.pushBack(compact_sentinel, sizeof(compact_sentinel))) {
+        if(size) {
+            pushStored(store_msg_queue, (const char*)compact_msg_buffer, size);
+        }
+        return false;
+    }
+
+    CompactRun run {};
+    size_t merged = 0;
+    while(true) {
+        StoredPoint point {};
+        if(!size) {
+            //nothing to keep
+        }
+        else if(parseMergeable((const char*)compact_msg_buffer, size, point)) {
+            //periodic locations of one trip are collected into a run
+            if(run.active && (point.tripStart == run.newest.tripStart) &&
+                (run.count < ARRAY_SIZE(run.points)) &&
+                (size + STORE_CRUMBS_HEADER_SIZE + (run.count + 1) * STORE_COMPACT_CRUMB_SIZE <=
+                    particle::protocol::MAX_EVENT_DATA_LENGTH)) {
+                run.points[run.count++] = run.newest;
+                merged++;
+            }
+            else {
+                _stats.thinned += flushRun(store_msg_queue, run);
+            }
+            run.active = true;
+            run.newest = point;
+            run.size = size;
+            memcpy(merge_msg_buffer, compact_msg_buffer, size + 1);
+        }
+        else {
+            //triggers and unlocked locations are kept, older breadcrumbs are thinned again
+            _stats.thinned += flushRun(store_msg_queue, run);
+            _stats.thinned += thinCrumbs(compact_msg_buffer, size);
+            if(!pushStored(store_msg_queue, (const char*)compact_msg_buffer, size)) {
+                Log.warn("Unable to write compacted location message to DiskQueue, discarding");
+            }
+        }
+
+        if(store_msg_queue.isEmpty()) {
+            break;
+        }
+        if(store_msg_queue.peekFrontSize() == sizeof(compact_sentinel)) {
+            store_msg_queue.popFront();
+            break;
+        }
+        size = takeFront(store_msg_queue, compact_msg_buffer, sizeof(compact_msg_buffer));
+    }
+    _stats.thinned += flushRun(store_msg_queue, run);
+
+    _periodicDepth = (_periodicDepth > merged) ? _periodicDepth - merged : 0;
+    _stats.compactions++;
+    return merged || (_stats.thinned != thinned);
+}
+
 bool LocationPublish::publish(const char *name,
                             const char *data,
                             PublishFlags flags,
                             int level,
                             const void *context) {
 
-    //copy name and data to heap location
-    char* event_name = new char[strlen(name)+1]; //+1 for null terminator
-    strcpy((char*)event_name, name);
+    auto name_len = strlen(name);
+    auto data_len = strlen(data);
+    if((name_len >= sizeof(_slots[0].name)) || (data_len >= sizeof(_slots[0].data))) {
+        _stats.tooLarge++;
+        return false;
+    }
+
+    //claim a free slot, it is held until publish_cb
+    PublishSlot* slot = nullptr;
+    for(auto& candidate : _slots) {
+        bool expected = false;
+        if(candidate.used.compare_exchange_strong(expected, true)) {
+            slot = &candidate;
+            break;
+        }
+    }
+    if(!slot) {
+        _stats.noSlot++;
+        return false;
+    }
+    auto in_use = ++_slotsUsed;
+    if(in_use > _stats.peakSlots) {
+        _stats.peakSlots = in_use;
+    }
 
-    char* event_data = new char[strlen(data)+1]; //+1 for null terminator
-    strcpy((char*)event_data, data);
+    //copy name and data into the slot
+    memcpy(slot->name, name, name_len + 1); //+1 for null terminator
+    memcpy(slot->data, data, data_len + 1);
 
-    return BackgroundPublish::instance().publish(event_name,
-                                                event_data,
+    auto accepted = BackgroundPublish::instance().publish(slot->name,
+                                                slot->data,
                                                 flags,
                                                 level,
                                                 &LocationPublish::publish_cb,
                                                 this,
                                                 context);
+    if(accepted) {
+        _stats.publishes++;
+    }
+    else {
+        --_slotsUsed;
+        slot->used = false;
+    }
+    return accepted;
+}
+
+void LocationPublish::getStats(LocationPublishStats& stats, bool reset) {
+    stats = _stats;
+    stats.ackMs = _ackMs;
+    stats.window = _drainWindow;
+    stats.priorityDepth = _priorityDepth;
+    stats.periodicDepth = _periodicDepth;
+    if(reset) {
+        _stats = {};
+        _stats.peakSlots = _slotsUsed;
+    }
 }
 
 void LocationPublish::publish_cb(publishStatus status,
                         const char *event_name,
                         const char *event_data,
                         const void *event_context) {
+    //release the slot, name and data are not used anywhere else after this
+    //since event_context contains a String copy of event_data. The event_context
+    //is deleted later in the CloudService::send_cb_wrapper() function
+    for(auto& slot : _slots) {
+        if(slot.used && (event_name == slot.name)) {
+            --_slotsUsed;
+            slot.used = false;
+            break;
+        }
+    }
+
     if(!event_context) {
         return;
     }
 
-    //delete event_name, not used anywhere else after this
-    //delete event_data, not used anywhere else since event_context is allocated
-    //from the heap and contains a String copy of event_data. The event_context
-    //is deleted later in the CloudService::send_cb_wrapper() function
-    delete[] event_name;
-    delete[] event_data;
-
     auto send_handler {static_cast<const cloud_service_send_handler_t *>(event_context)};
     auto &base_handler {send_handler->base_handler};
 
     if(status == publishStatus::PUBLISH_COMPLETE) {
+        PublishLatency::instance().published(base_handler.context);
         if(base_handler.cloud_flags & CloudServicePublishFlags::FULL_ACK) {
             // expecting full end-to-end acknowledgement so set up handler waiting for the ACK
             CloudService::instance().regCommandCallback(base_handler.cmd,
@@ -163,14 +651,27 @@ void LocationPublish::publish_cb(publishStatus status,
     }
 }
 
-int LocationPublish::loc_store_cb_wrapper(CloudServiceStatus status,
-                                        JSONValue *rsp_root,
-                                        const char *req_event,
-                                        const void *context) {
-    return TrackerLocation::instance().location_publish_cb(status,
-                                                    rsp_root,
-                                                    req_event,
-                                                    context);
+int LocationPublish::drain_cb(CloudServiceStatus status,
+                            JSONValue *rsp_root,
+                            const char *req_event,
+                            const void *context) {
+    auto slot = (DrainSlot*)context;
+    auto latency = millis() - slot->sentMs;
+    slot->used = false;
+
+    if(status == CloudServiceStatus::SUCCESS) {
+        _ackMs = _ackMs ? (_ackMs * 7 + latency) / 8 : latency;
+        if((latency < LOCATION_PUBLISH_DRAIN_SLOW_ACK_MS) &&
+            (_drainWindow < LOCATION_PUBLISH_DRAIN_WINDOW)) {
+            _drainWindow++;
+        }
+    }
+    else {
+        //back off to one message at a time and keep this one for later
+        _drainWindow = 1;
+        disk_queue_cb(status, rsp_root, req_event, context);
+    }
+    return 0;
 }
 
 void LocationPublish::regLocPubCallback() {
@@ -188,7 +689,41 @@ int LocationPublish::disk_queue_cb(CloudServiceStatus status,
                                     const char * req_event,
                                     const void *context) {
     if(req_event && (status != SUCCESS) && store_config.enable) {
-        if(!store_msg_queue.pushBack((const uint8_t*)req_event, strlen(req_event)+1)) {
+        auto length = strlen(req_event);
+        bool stored = false;
+        if(isPriority(req_event, length)) {
+            stored = pushStored(priority_msg_queue, req_event, length);
+            if(stored) {
+                _priorityDepth++;
+            }
+        }
+        //a full priority lane overflows into the periodic lane
+        if(!stored) {
+            stored = pushStored(store_msg_queue, req_event, length);
+            bool compacting = ((int32_t)store_config.policy == STORE_POLICY_COMPACT);
+            if(!stored && compacting) {
+                //passes wait for enough new locations to merge, the oldest make room meanwhile
+                auto due = std::max<size_t>(STORE_COMPACT_MIN_MERGEABLE, _periodicDepth / 4);
+                if(_mergeable >= due) {
+                    _mergeable = 0;
+                    stored = compact() && pushStored(store_msg_queue, req_event, length);
+                }
+                while(!stored && !store_msg_queue.isEmpty()) {
+                    store_msg_queue.popFront();
+                    _periodicDepth = _periodicDepth ? _periodicDepth - 1 : 0;
+                    _stats.thinned++;
+                    stored = pushStored(store_msg_queue, req_event, length);
+                }
+            }
+            if(stored) {
+                _periodicDepth++;
+                StoredPoint point;
+                if(compacting && parseMergeable(req_event, length, point)) {
+                    _mergeable++;
+                }
+            }
+        }
+        if(!stored) {
             Log.warn("Unable to write location message to DiskQueue, discarding");
         }
     }
@@ -23,10 +23,52 @@
 extern const int DEFAULT_DISK_LIMIT; //in KB
 extern const size_t KILOBYTE_CONSTANT;
 
+// Publishes that can be waiting in BackgroundPublish at once
+constexpr size_t LOCATION_PUBLISH_SLOTS {4};
+
+// Stored messages in flight at once while draining, one slot is left for live publishes
+constexpr size_t LOCATION_PUBLISH_DRAIN_WINDOW {LOCATION_PUBLISH_SLOTS - 1};
+
+// Acknowledgements slower than this stop the drain window from growing
+constexpr system_tick_t LOCATION_PUBLISH_DRAIN_SLOW_ACK_MS {5000};
+
+// Most stored locations merged into one publish
+constexpr int LOCATION_PUBLISH_MERGE_MAX {20};
+
+// Share of the store quota for the lane of locations published for events other than the
+// periodic triggers
+constexpr size_t LOCATION_PUBLISH_PRIORITY_QUOTA_PERCENT {25};
+
+// Store policy that thins older periodic locations instead of dropping messages when the
+// store is full, alongside the DiskQueuePolicy values.  A pass rewrites the whole periodic
+// lane, so between passes the oldest message is dropped as with drop_old.
+constexpr int32_t STORE_POLICY_COMPACT {2};
+
+/**
+ * @brief Usage of the publish slots
+ *
+ */
+struct LocationPublishStats {
+    uint32_t publishes;     /**< Publishes handed to BackgroundPublish */
+    uint32_t noSlot;        /**< Publishes refused because every slot was in use */
+    uint32_t tooLarge;      /**< Publishes refused because the name or data does not fit a slot */
+    size_t peakSlots;       /**< Most slots in use at once */
+    uint32_t drained;       /**< Stored messages sent */
+    uint32_t merged;        /**< Stored locations sent as breadcrumbs of a later one */
+    uint32_t ackMs;         /**< Smoothed acknowledgement latency of stored messages */
+    size_t window;          /**< Stored messages currently allowed in flight */
+    uint32_t compactions;   /**< Passes over a full store to make room */
+    uint32_t thinned;       /**< Stored locations dropped by the compact policy */
+    uint32_t drainedPriority; /**< Stored messages sent from the priority lane */
+    size_t priorityDepth;   /**< Messages waiting in the priority lane */
+    size_t periodicDepth;   /**< Messages waiting in the periodic lane */
+};
+
 struct StoreConfig {
     int quota{DEFAULT_DISK_LIMIT};
     DiskQueuePolicy policy {DiskQueuePolicy::FifoDeleteOld};
     bool enable{false};
+    int merge{1};
 
     bool operator!=(const StoreConfig& other) const {
         if((quota != other.quota) || (policy != other.policy) ||
@@ -53,9 +95,11 @@ public:
     /**
      * @brief Start the DiskQueue
      *
-     * @details Calls DiskQueue::start() for store_msg_queue. This will get
-     * the DiskQueue started with the quota and policy desired. Can be called
-     * again if there is a change to the policy or size.
+     * @details Calls DiskQueue::start() for store_msg_queue and
+     * priority_msg_queue. This will get the DiskQueues started with the quota
+     * and policy desired, LOCATION_PUBLISH_PRIORITY_QUOTA_PERCENT of the quota
+     * going to the priority lane. Can be called again if there is a change to
+     * the policy or size.
      */
     void start();
 
@@ -64,7 +108,11 @@ public:
      * is data to send
      *
      * @details Call this function once a second to consume messages saved in the
-     * store_msg_queue. This setsup the the entire callback system to run again
+     * store_msg_queue. Up to a window of stored messages are kept in flight; the
+     * window grows by one for every prompt acknowledgement and falls back to one
+     * on a failure. The priority lane is drained first and at high priority.
+     * With store.merge above one, consecutive periodic locations are sent as
+     * breadcrumbs of the newest of them.
      */
     void tick();
 
@@ -72,7 +120,9 @@ public:
      * @brief Request to publish a message
      *
      * @details Calls the BackgroundPublish::publish() function to request
-     * a publish in the BackgroundPublish::thread_f thread.
+     * a publish in the BackgroundPublish::thread_f thread. The name and data
+     * are copied into one of LOCATION_PUBLISH_SLOTS fixed slots that is held
+     * until the publish completes, so no heap is used.
      *
      * @param[in] name name of event to be sent
      * @param[in] data pointer to string of data to send out
@@ -89,6 +139,14 @@ public:
             int level = 0,
             const void *context = nullptr);
 
+    /**
+     * @brief Get the usage of the publish slots
+     *
+     * @param[out] stats Slot usage
+     * @param[in] reset Clear the counters after reading them
+     */
+    void getStats(LocationPublishStats& stats, bool reset = false);
+
     /**
      * @brief Register the callback to be called from every generated location
      * publish
@@ -113,7 +171,10 @@ public:
      *
      * @details Checks to see if the status of the message publish is not
      * SUCCESS. If the store forward feature is enabled, and there is data,
-     * push the message on to the store_msg_queue
+     * push the message on to the store_msg_queue, or on to the
+     * priority_msg_queue when it was published for a trigger other than the
+     * periodic ones.  Messages are stored as compact binary records and
+     * rendered back to JSON when they are sent.
      *
      * @param[in] status of the message that was published
      * @param[in] rsp_root JSON root of the message
@@ -144,13 +205,18 @@ public:
      * queues. Is called if you disable the store forward feature, or reset the
      * device to factory
      *
-     * @details Flushes, Closes out, and deletes the store_msg_queue files, and
-     * cleans up the BackgroundPublish queue
+     * @details Flushes, Closes out, and deletes the store_msg_queue and
+     * priority_msg_queue files, and cleans up the BackgroundPublish queue
      */
     void factoryReset() {
         BackgroundPublish::instance().cleanup();
         store_msg_queue.unlinkFiles(); //unlink the files first
         store_msg_queue.stop(); //then clear the files from _fileList
+        priority_msg_queue.unlinkFiles();
+        priority_msg_queue.stop();
+        _priorityDepth = 0;
+        _periodicDepth = 0;
+        _mergeable = 0;
     }
 
     //remove copy and assignment operators
@@ -158,10 +224,66 @@ public:
     void operator=(LocationPublish const&)  = delete;
 
 private:
-    LocationPublish() : store_msg_queue () {}
+    LocationPublish() : store_msg_queue (), priority_msg_queue (), _stats{}, _drain{}, _drainWindow(1), _ackMs(0),
+        _priorityDepth(0), _periodicDepth(0), _mergeable(0) {}
+
+    struct PublishSlot {
+        std::atomic<bool> used {false};
+        char name[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+        char data[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    };
 
     DiskQueue store_msg_queue;
+    DiskQueue priority_msg_queue;
     StoreConfig store_config;
+    PublishSlot _slots[LOCATION_PUBLISH_SLOTS];
+    std::atomic<size_t> _slotsUsed {0};
+    LocationPublishStats _stats;
+
+    struct DrainSlot {
+        bool used;
+        system_tick_t sentMs;
+    };
+
+    DrainSlot _drain[LOCATION_PUBLISH_DRAIN_WINDOW];
+    size_t _drainWindow;
+    uint32_t _ackMs;
+
+    // Messages pushed less those taken since the store started.  Messages left from before
+    // a restart or dropped by the drop_old policy are not counted.
+    size_t _priorityDepth;
+    size_t _periodicDepth;
+
+    // Periodic locations a compaction pass could merge, stored since the last pass
+    size_t _mergeable;
+
+    bool hasStored() {
+        return !priority_msg_queue.isEmpty() || !store_msg_queue.isEmpty();
+    }
+
+    /**
+     * @brief Take the next stored message into store_msg_buffer
+     *
+     * @details Takes from the priority lane while it has messages.  Merges
+     * following periodic locations into it when enabled
+     *
+     * @param[out] priority true if the message came from the priority lane
+     *
+     * @return Length of the message, 0 if there is none to send
+     */
+    size_t takeStored(bool& priority);
+
+    /**
+     * @brief Make room in a full store
+     *
+     * @details Makes one pass over the stored messages. Runs of periodic locations from
+     * the same trip collapse into the newest of them, the older ones becoming its
+     * breadcrumbs, and every other breadcrumb is dropped from messages that already
+     * carry them.  Trigger locations are kept as they are.
+     *
+     * @return true if the pass made room
+     */
+    bool compact();
 
     /**
      * @brief Callback to be called on every publish
@@ -182,22 +304,20 @@ private:
                         const void *event_context);
 
     /**
-     * @brief Wrapper that is used to call the
-     * TrackerLocation::location_publish_cb, on every publish
+     * @brief Callback for every stored message that is resent
      *
-     * @details This is a callback that is used when we resend a stored message.
-     * This is just a convenience wrapper to be able to call the
-     * TrackerLocation::location_publish_cb outside of it's class
+     * @details Frees the drain slot, adapts the drain window to the measured
+     * acknowledgement latency and stores the message again on failure
      *
      * @param[in] status of the message that was published
      * @param[in] rsp_root JSON root of the message
      * @param[in] req_event data containing the message in JSON format
-     * @param[in] context of the callback
+     * @param[in] context the DrainSlot of the message
      *
      * @return 0 for success
      */
-    int loc_store_cb_wrapper(CloudServiceStatus status,
-                                        JSONValue *rsp_root,
-                                        const char *req_event,
-                                        const void *context);
+    int drain_cb(CloudServiceStatus status,
+                JSONValue *rsp_root,
+                const char *req_event,
+                const void *context);
 };
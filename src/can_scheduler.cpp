@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "can_scheduler.h"
+
+Logger canSchedLog("app.can");
+
+CanScheduler *CanScheduler::_instance = nullptr;
+
+// ISO-TP protocol control information, upper nibble of the first byte
+constexpr uint8_t IsoTpSingleFrame = 0x0;
+constexpr uint8_t IsoTpFirstFrame = 0x1;
+constexpr uint8_t IsoTpConsecutiveFrame = 0x2;
+constexpr uint8_t IsoTpFlowControl = 0x3;
+
+// Service identifiers
+constexpr uint8_t ServiceObdCurrentData = 0x01;
+constexpr uint8_t ServiceObdVehicleInfo = 0x09;
+constexpr uint8_t ServiceUdsReadDataById = 0x22;
+constexpr uint8_t ServicePositiveResponse = 0x40;
+constexpr uint8_t ServiceNegativeResponse = 0x7F;
+
+// Negative response code for requestCorrectlyReceived-ResponsePending
+constexpr uint8_t NrcResponsePending = 0x78;
+
+// Padding for unused frame bytes
+constexpr uint8_t FramePadding = 0x55;
+
+CanScheduler::CanScheduler() :
+    _send(nullptr),
+    _requests{},
+    _used{},
+    _channels{},
+    _active(false),
+    _sendError(false) {
+
+    for (auto& channel : _channels) {
+        channel.handle = -1;
+    }
+}
+
+void CanScheduler::begin(CanSendFunction send) {
+    _send = send;
+}
+
+int CanScheduler::add(const CanRequest& request) {
+    for (size_t i = 0; i < CAN_SCHEDULER_MAX_REQUESTS; i++) {
+        if (!_used[i]) {
+            _requests[i] = request;
+            // Make the request due immediately
+            _requests[i].lastRequest = millis() - request.period;
+            _requests[i].responses = 0;
+            _requests[i].timeouts = 0;
+            _requests[i].negatives = 0;
+            _used[i] = true;
+            return (int)i;
+        }
+    }
+
+    return SYSTEM_ERROR_NO_MEMORY;
+}
+
+void CanScheduler::remove(CanRequestType type) {
+    for (auto& channel : _channels) {
+        if ((channel.handle >= 0) && (_requests[channel.handle].type == type)) {
+            release(channel);
+        }
+    }
+
+    for (size_t i = 0; i < CAN_SCHEDULER_MAX_REQUESTS; i++) {
+        if (_used[i] && (_requests[i].type == type)) {
+            _used[i] = false;
+            _requests[i] = {};
+        }
+    }
+}
+
+void CanScheduler::setEnabled(int handle, bool enable) {
+    if ((handle < 0) || (handle >= (int)CAN_SCHEDULER_MAX_REQUESTS) || !_used[handle]) {
+        return;
+    }
+    _requests[handle].enabled = enable;
+}
+
+const CanRequest* CanScheduler::get(int handle) const {
+    if ((handle < 0) || (handle >= (int)CAN_SCHEDULER_MAX_REQUESTS) || !_used[handle]) {
+        return nullptr;
+    }
+    return &_requests[handle];
+}
+
+void CanScheduler::setActive(bool active) {
+    if (_active && !active) {
+        // Responses will not arrive while the bus is asleep so drop anything outstanding
+        for (auto& channel : _channels) {
+            release(channel);
+        }
+    }
+    _active = active;
+}
+
+void CanScheduler::release(Channel& channel) {
+    channel.handle = -1;
+    channel.expected = 0;
+    channel.received = 0;
+    channel.sequence = 0;
+}
+
+bool CanScheduler::isResponderBusy(const CanRequest& request) const {
+    for (auto& channel : _channels) {
+        if ((channel.handle >= 0) &&
+            (_requests[channel.handle].rxId == request.rxId) &&
+            (_requests[channel.handle].extended == request.extended)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int CanScheduler::sendRequest(int handle, Channel& channel) {
+    auto& request = _requests[handle];
+    uint8_t frame[8];
+    memset(frame, FramePadding, sizeof(frame));
+
+    switch (request.type) {
+        case CanRequestType::OBD_PID:
+            frame[0] = 0x02;
+            frame[1] = ServiceObdCurrentData;
+            frame[2] = (uint8_t)request.id;
+            channel.timeout = CAN_SCHEDULER_OBD_TIMEOUT_MS;
+            break;
+
+        case CanRequestType::OBD_VEHICLE_INFO:
+            frame[0] = 0x02;
+            frame[1] = ServiceObdVehicleInfo;
+            frame[2] = (uint8_t)request.id;
+            channel.timeout = CAN_SCHEDULER_OBD_TIMEOUT_MS;
+            break;
+
+        case CanRequestType::UDS_DID:
+            frame[0] = 0x03;
+            frame[1] = ServiceUdsReadDataById;
+            frame[2] = (uint8_t)(request.id >> 8);
+            frame[3] = (uint8_t)request.id;
+            channel.timeout = CAN_SCHEDULER_UDS_TIMEOUT_MS;
+            break;
+    }
+
+    request.lastRequest = millis();
+
+    int ret = _send(request.txId, request.extended, frame, sizeof(frame));
+    if (ret) {
+        // This flag prevents the error log from overflowing from thousands of error
+        // messages when the vehicle is off
+        if (!_sendError) {
+            canSchedLog.error("Error Sending Message %d", ret);
+            _sendError = true;
+        }
+        return ret;
+    }
+    _sendError = false;
+
+    channel.handle = handle;
+    channel.sentAt = request.lastRequest;
+    channel.expected = 0;
+    channel.received = 0;
+    channel.sequence = 0;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int CanScheduler::sendFlowControl(const CanRequest& request) {
+    uint32_t id = request.txId;
+
+    // Flow control always goes to the physical address of the responder, never to the
+    // functional broadcast address
+    if (!request.extended && (request.txId == CAN_SCHEDULER_OBD_FUNCTIONAL_ID)) {
+        id = request.rxId - 8;
+    }
+    else if (request.extended && ((request.txId & 0xFFFF0000) == 0x18DB0000)) {
+        id = 0x18DA0000 | ((request.rxId & 0xFF) << 8) | ((request.rxId >> 8) & 0xFF);
+    }
+
+    // Continue to send, no block size limit, no separation time
+    uint8_t frame[8];
+    memset(frame, FramePadding, sizeof(frame));
+    frame[0] = IsoTpFlowControl << 4;
+    frame[1] = 0;
+    frame[2] = 0;
+
+    return _send(id, request.extended, frame, sizeof(frame));
+}
+
+void CanScheduler::complete(Channel& channel, uint64_t timestamp) {
+    auto& request = _requests[channel.handle];
+    const uint8_t* payload = channel.payload;
+    size_t len = channel.received;
+
+    if ((len >= 3) && (payload[0] == ServiceNegativeResponse)) {
+        if (payload[2] == NrcResponsePending) {
+            // The ECU needs more time, keep waiting with the extended timeout
+            channel.sentAt = millis();
+            channel.timeout = CAN_SCHEDULER_UDS_PENDING_TIMEOUT_MS;
+            channel.expected = 0;
+            channel.received = 0;
+            channel.sequence = 0;
+            return;
+        }
+        canSchedLog.trace("request %04x negative response %02x", request.id, payload[2]);
+        request.negatives++;
+        release(channel);
+        return;
+    }
+
+    size_t header = 0;
+    switch (request.type) {
+        case CanRequestType::OBD_PID:
+            if ((len >= 2) &&
+                (payload[0] == (ServiceObdCurrentData | ServicePositiveResponse)) &&
+                (payload[1] == (uint8_t)request.id)) {
+                header = 2;
+            }
+            break;
+
+        case CanRequestType::OBD_VEHICLE_INFO:
+            if ((len >= 2) &&
+                (payload[0] == (ServiceObdVehicleInfo | ServicePositiveResponse)) &&
+                (payload[1] == (uint8_t)request.id)) {
+                header = 2;
+            }
+            break;
+
+        case CanRequestType::UDS_DID:
+            if ((len >= 3) &&
+                (payload[0] == (ServiceUdsReadDataById | ServicePositiveResponse)) &&
+                (payload[1] == (uint8_t)(request.id >> 8)) &&
+                (payload[2] == (uint8_t)request.id)) {
+                header = 3;
+            }
+            break;
+    }
+
+    if (!header) {
+        // Unrelated response from the same responder, keep waiting for ours
+        channel.expected = 0;
+        channel.received = 0;
+        channel.sequence = 0;
+        return;
+    }
+
+    request.responses++;
+    auto callback = request.callback;
+    // Free the channel first so that the callback may change the schedule
+    release(channel);
+    if (callback) {
+        callback(request, payload + header, len - header, timestamp);
+    }
+}
+
+bool CanScheduler::onFrame(uint32_t id, bool extended, const uint8_t* data, uint8_t len, uint64_t timestamp) {
+    if (len < 1) {
+        return false;
+    }
+
+    for (auto& channel : _channels) {
+        if ((channel.handle < 0) ||
+            (_requests[channel.handle].rxId != id) ||
+            (_requests[channel.handle].extended != extended)) {
+            continue;
+        }
+
+        switch (data[0] >> 4) {
+            case IsoTpSingleFrame: {
+                size_t size = data[0] & 0x0F;
+                if ((size == 0) || (size > (size_t)(len - 1))) {
+                    return true;
+                }
+                memcpy(channel.payload, data + 1, size);
+                channel.expected = channel.received = size;
+                complete(channel, timestamp);
+                return true;
+            }
+
+            case IsoTpFirstFrame: {
+                if (len < 8) {
+                    return true;
+                }
+                size_t size = ((data[0] & 0x0F) << 8) | data[1];
+                if (size > CAN_SCHEDULER_MAX_PAYLOAD) {
+                    canSchedLog.error("response of %u bytes too large", size);
+                    _requests[channel.handle].negatives++;
+                    release(channel);
+                    return true;
+                }
+                memcpy(channel.payload, data + 2, 6);
+                channel.expected = size;
+                channel.received = 6;
+                channel.sequence = 1;
+                // Restart the timeout for the remainder of the response
+                channel.sentAt = millis();
+                sendFlowControl(_requests[channel.handle]);
+                return true;
+            }
+
+            case IsoTpConsecutiveFrame: {
+                if (!channel.expected || (channel.received >= channel.expected)) {
+                    return true;
+                }
+                if ((data[0] & 0x0F) != channel.sequence) {
+                    canSchedLog.error("consecutive frame out of sequence");
+                    _requests[channel.handle].negatives++;
+                    release(channel);
+                    return true;
+                }
+                size_t size = std::min((size_t)(len - 1), channel.expected - channel.received);
+                memcpy(channel.payload + channel.received, data + 1, size);
+                channel.received += size;
+                channel.sequence = (channel.sequence + 1) & 0x0F;
+                if (channel.received >= channel.expected) {
+                    complete(channel, timestamp);
+                }
+                return true;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+void CanScheduler::loop() {
+    auto now = millis();
+
+    for (auto& channel : _channels) {
+        if ((channel.handle >= 0) && (now - channel.sentAt >= channel.timeout)) {
+            _requests[channel.handle].timeouts++;
+            release(channel);
+        }
+    }
+
+    if (!_active || !_send) {
+        return;
+    }
+
+    for (auto& channel : _channels) {
+        if (channel.handle >= 0) {
+            continue;
+        }
+
+        // Pick the most overdue request whose responder is idle
+        int best = -1;
+        int32_t bestLate = 0;
+        for (size_t i = 0; i < CAN_SCHEDULER_MAX_REQUESTS; i++) {
+            auto& request = _requests[i];
+            if (!_used[i] || !request.enabled) {
+                continue;
+            }
+            int32_t late = (int32_t)(now - request.lastRequest - request.period);
+            if ((late >= 0) && ((best < 0) || (late > bestLate)) && !isResponderBusy(request)) {
+                best = (int)i;
+                bestLate = late;
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        if (sendRequest(best, channel)) {
+            // The controller is not accepting frames, try again on the next loop
+            break;
+        }
+    }
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Maximum number of periodic requests that can be registered
+constexpr size_t CAN_SCHEDULER_MAX_REQUESTS {24};
+
+// Maximum number of requests in flight at the same time, each to a different responder
+constexpr size_t CAN_SCHEDULER_MAX_IN_FLIGHT {4};
+
+// Largest reassembled ISO-TP response payload that will be accepted
+constexpr size_t CAN_SCHEDULER_MAX_PAYLOAD {128};
+
+// Time to wait for an OBD-II response
+constexpr system_tick_t CAN_SCHEDULER_OBD_TIMEOUT_MS {100};
+
+// Time to wait for a UDS response (P2 client)
+constexpr system_tick_t CAN_SCHEDULER_UDS_TIMEOUT_MS {150};
+
+// Time to wait for a UDS response after a response pending negative response (P2* client)
+constexpr system_tick_t CAN_SCHEDULER_UDS_PENDING_TIMEOUT_MS {5000};
+
+// Functional OBD-II request identifier (11-bit)
+constexpr uint32_t CAN_SCHEDULER_OBD_FUNCTIONAL_ID {0x7DF};
+
+/**
+ * @brief Kind of diagnostic request
+ *
+ */
+enum class CanRequestType {
+    OBD_PID,                        /**< OBD-II service 0x01 current data */
+    OBD_VEHICLE_INFO,               /**< OBD-II service 0x09 vehicle information */
+    UDS_DID,                        /**< UDS service 0x22 ReadDataByIdentifier */
+};
+
+struct CanRequest;
+
+/**
+ * @brief Callback for a positive response
+ *
+ * @details data points past the echoed service and identifier bytes.  timestamp is the
+ * monotonic reception time of the last frame of the response in microseconds, see ClockService.
+ */
+using CanResponseCallback = std::function<void(const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp)>;
+
+/**
+ * @brief Function used to put a frame on the bus
+ *
+ * @retval 0 Success
+ */
+using CanSendFunction = std::function<int(uint32_t id, bool extended, const uint8_t* data, uint8_t len)>;
+
+/**
+ * @brief A periodic diagnostic request
+ *
+ */
+struct CanRequest {
+    CanRequestType type;            /**< Request kind */
+    uint32_t txId;                  /**< CAN identifier to send the request on */
+    uint32_t rxId;                  /**< CAN identifier of the response */
+    bool extended;                  /**< 29-bit identifiers */
+    uint16_t id;                    /**< PID or DID */
+    system_tick_t period;           /**< Request period in milliseconds */
+    bool enabled;                   /**< Request is scheduled */
+    CanResponseCallback callback;   /**< Called on every positive response */
+
+    // Scheduling state and statistics
+    system_tick_t lastRequest;      /**< Time of the last request */
+    unsigned int responses;         /**< Count of positive responses */
+    unsigned int timeouts;          /**< Count of requests without a response */
+    unsigned int negatives;         /**< Count of negative responses */
+};
+
+/**
+ * @brief Scheduler shared by OBD-II PIDs and UDS DIDs
+ *
+ * @details Requests are issued in order of how overdue they are.  Several requests may be
+ * in flight at once as long as each one targets a different responder, which keeps a slow
+ * ECU from stalling the others.  Responses are reassembled with ISO-TP (ISO 15765-2) so that
+ * multi-frame UDS responses are supported.
+ */
+class CanScheduler {
+public:
+    /**
+     * @brief Singleton class instance access for CanScheduler
+     *
+     * @return CanScheduler&
+     */
+    static CanScheduler &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new CanScheduler();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Set the function used to send frames
+     *
+     * @param send Frame send function
+     */
+    void begin(CanSendFunction send);
+
+    /**
+     * @brief Register a periodic request
+     *
+     * @param request Request description, scheduling state is reset
+     * @return int Handle of the request, negative on error
+     */
+    int add(const CanRequest& request);
+
+    /**
+     * @brief Remove every request of the given type
+     *
+     * @param type Request type to remove
+     */
+    void remove(CanRequestType type);
+
+    /**
+     * @brief Enable or disable a single request
+     *
+     * @param handle Handle returned by add()
+     * @param enable Schedule the request when true
+     */
+    void setEnabled(int handle, bool enable);
+
+    /**
+     * @brief Get a registered request and its statistics
+     *
+     * @param handle Handle returned by add()
+     * @return const CanRequest* nullptr if the handle is invalid
+     */
+    const CanRequest* get(int handle) const;
+
+    /**
+     * @brief Allow or prevent requests from going on the bus (e.g. ignition state)
+     *
+     * @param active Send requests when true
+     */
+    void setActive(bool active);
+
+    /**
+     * @brief Send due requests and expire stale ones
+     *
+     */
+    void loop();
+
+    /**
+     * @brief Process a received frame
+     *
+     * @param id CAN identifier without flag bits
+     * @param extended Frame uses a 29-bit identifier
+     * @param data Frame data
+     * @param len Frame data length
+     * @param timestamp Monotonic time, in microseconds, the frame was received
+     * @return true Frame belonged to an outstanding request
+     * @return false Frame was not consumed
+     */
+    bool onFrame(uint32_t id, bool extended, const uint8_t* data, uint8_t len, uint64_t timestamp);
+
+private:
+    CanScheduler();
+
+    struct Channel {
+        int handle;                 // request in flight, -1 when free
+        system_tick_t sentAt;
+        system_tick_t timeout;
+        size_t expected;            // total ISO-TP payload length
+        size_t received;            // bytes reassembled so far
+        uint8_t sequence;           // next consecutive frame sequence number
+        uint8_t payload[CAN_SCHEDULER_MAX_PAYLOAD];
+    };
+
+    int sendRequest(int handle, Channel& channel);
+    int sendFlowControl(const CanRequest& request);
+    void complete(Channel& channel, uint64_t timestamp);
+    void release(Channel& channel);
+    bool isResponderBusy(const CanRequest& request) const;
+
+    CanSendFunction _send;
+    CanRequest _requests[CAN_SCHEDULER_MAX_REQUESTS];
+    bool _used[CAN_SCHEDULER_MAX_REQUESTS];
+    Channel _channels[CAN_SCHEDULER_MAX_IN_FLIGHT];
+    bool _active;
+    bool _sendError;
+
+    static CanScheduler *_instance;
+};
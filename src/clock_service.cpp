@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "clock_service.h"
+#include "location_service.h"
+
+ClockService *ClockService::_instance = nullptr;
+
+ClockService::ClockService() :
+    _wrapTimer(CLOCK_SERVICE_WRAP_CHECK_MS, &ClockService::tick, *this),
+    _thread(nullptr),
+    _lastMicros(0),
+    _wraps(0),
+    _lastEpoch(0),
+    _lastPollUs(0),
+    _offsetUs(0),
+    _synced(false),
+    _bursting(false),
+    _burstStartMs(0),
+    _nextBurstMs(0),
+    _failedInRow(0),
+    _stats{} {
+
+    _wrapTimer.start();
+    os_queue_create(&_burstQueue, sizeof(bool), 1, nullptr);
+    _thread = new Thread("clock_service", [this]() {ClockService::thread_f();}, OS_THREAD_PRIORITY_DEFAULT);
+}
+
+uint64_t ClockService::nowUs() {
+    uint64_t now;
+
+    ATOMIC_BLOCK() {
+        uint32_t micro = micros();
+        if (micro < _lastMicros) {
+            _wraps++;
+        }
+        _lastMicros = micro;
+        now = ((uint64_t)_wraps << 32) | micro;
+    }
+
+    return now;
+}
+
+int64_t ClockService::toUtcUs(uint64_t monoUs) const {
+    if (!_synced) {
+        return 0;
+    }
+
+    // The offset is updated from the poll thread
+    int64_t offset;
+    ATOMIC_BLOCK() {
+        offset = _offsetUs;
+    }
+    return (int64_t)monoUs + offset;
+}
+
+void ClockService::discipline() {
+    if (_bursting || ((int32_t)(millis() - _nextBurstMs) < 0)) {
+        return;
+    }
+
+    // The poll thread owns the edge state until the burst ends
+    _lastEpoch = 0;
+    _burstStartMs = millis();
+    _bursting = true;
+    bool start = true;
+    if (os_queue_put(_burstQueue, &start, 0, nullptr)) {
+        _bursting = false;
+    }
+}
+
+// a thread to poll GNSS time through a burst without holding up the timer thread
+void ClockService::thread_f() {
+    while (true) {
+        bool start = false;
+        if (os_queue_take(_burstQueue, &start, CONCURRENT_WAIT_FOREVER, nullptr)) {
+            continue;
+        }
+        while (_bursting) {
+            poll();
+            delay(CLOCK_SERVICE_POLL_MS);
+        }
+    }
+}
+
+void ClockService::poll() {
+    auto now = nowUs();
+    time_t epoch = 0;
+
+    if ((LocationService::instance().getUtcTime(epoch) == SYSTEM_ERROR_NONE) && sample(epoch, now)) {
+        endBurst(true);
+    }
+    else if (millis() - _burstStartMs >= CLOCK_SERVICE_BURST_MS) {
+        endBurst(false);
+    }
+}
+
+bool ClockService::sample(time_t epoch, uint64_t now) {
+    bool aligned = false;
+
+    // Only a change to the very next second, seen soon after the previous poll, pins down
+    // when the second started
+    if (_lastEpoch && (epoch == _lastEpoch + 1) && (now - _lastPollUs <= CLOCK_SERVICE_MAX_EDGE_UNCERTAINTY_US)) {
+        uint64_t edgeUs = _lastPollUs + (now - _lastPollUs) / 2;
+        int64_t measured = (int64_t)epoch * 1000000 - (int64_t)edgeUs;
+        int64_t error = measured - _offsetUs;
+
+        ATOMIC_BLOCK() {
+            if (!_synced || (error > CLOCK_SERVICE_STEP_THRESHOLD_US) || (error < -CLOCK_SERVICE_STEP_THRESHOLD_US)) {
+                _offsetUs = measured;
+            }
+            else {
+                _offsetUs += error / (1 << CLOCK_SERVICE_SLEW_SHIFT);
+            }
+        }
+        if (!_synced) {
+            Log.info("clock synced to GNSS");
+        }
+        _synced = true;
+        aligned = true;
+    }
+
+    _lastEpoch = epoch;
+    _lastPollUs = now;
+    return aligned;
+}
+
+void ClockService::endBurst(bool aligned) {
+    if (aligned) {
+        _stats.edges++;
+        _failedInRow = 0;
+        _nextBurstMs = millis() + CLOCK_SERVICE_RESYNC_MS;
+    }
+    else {
+        _stats.failedBursts++;
+        if (++_failedInRow == CLOCK_SERVICE_MAX_FAILED_BURSTS) {
+            Log.warn("clock not aligned to GNSS after %lu bursts", _failedInRow);
+        }
+        _nextBurstMs = millis() + CLOCK_SERVICE_RETRY_MS;
+    }
+    _bursting = false;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// A GNSS second change observed more than this long after the previous poll is not used
+constexpr uint32_t CLOCK_SERVICE_MAX_EDGE_UNCERTAINTY_US {20000};
+
+// Period of the GNSS time polls that look for a second change
+constexpr unsigned CLOCK_SERVICE_POLL_MS {5};
+
+// Longest burst of polls, long enough to see one second change
+constexpr system_tick_t CLOCK_SERVICE_BURST_MS {1500};
+
+// Time between alignments once synced, and before retrying a burst without a second change
+constexpr system_tick_t CLOCK_SERVICE_RESYNC_MS {60000};
+constexpr system_tick_t CLOCK_SERVICE_RETRY_MS {10000};
+
+// Bursts in a row without a usable second change before warning
+constexpr uint32_t CLOCK_SERVICE_MAX_FAILED_BURSTS {5};
+
+// Period of the timer that keeps the micros() wrap count current
+constexpr unsigned CLOCK_SERVICE_WRAP_CHECK_MS {10 * 60 * 1000};
+
+// Offset errors larger than this are stepped, smaller ones are slewed
+constexpr int64_t CLOCK_SERVICE_STEP_THRESHOLD_US {1000000};
+
+// Fraction, as a power of two, of the offset error corrected per GNSS second
+constexpr unsigned CLOCK_SERVICE_SLEW_SHIFT {3};
+
+/**
+ * @brief Alignment statistics
+ *
+ */
+struct ClockServiceStats {
+    uint32_t edges;                 /**< Second changes used to align the clock */
+    uint32_t failedBursts;          /**< Bursts that ended without a usable second change */
+};
+
+/**
+ * @brief Monotonic microsecond clock disciplined to GNSS time
+ *
+ * @details micros() is extended to 64 bits so that timestamps never wrap.  The offset to UTC
+ * is estimated from the moments the GNSS reported second changes.  The location loop only
+ * runs once a second, so it starts a short burst of CLOCK_SERVICE_POLL_MS polls that catches
+ * the change, bounding the alignment by the receiver's reporting latency and the poll period
+ * rather than by a timepulse.  The polls run on their own thread since they wait for the GNSS
+ * lock, which would hold up every software timer.  Monotonic timestamps stay valid across
+ * discipline updates and are converted to UTC only when written out.
+ */
+class ClockService {
+public:
+    /**
+     * @brief Singleton class instance access for ClockService
+     *
+     * @return ClockService&
+     */
+    static ClockService &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new ClockService();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Get the monotonic time, safe to call from interrupt context
+     *
+     * @details A timer calls this often enough to catch every micros() wrap.
+     *
+     * @return uint64_t Microseconds since boot
+     */
+    uint64_t nowUs();
+
+    /**
+     * @brief Align to GNSS time when due, called on every location loop while locked
+     *
+     */
+    void discipline();
+
+    /**
+     * @brief Check if the clock has been aligned to GNSS time
+     *
+     * @return true Timestamps can be converted to UTC
+     * @return false Not aligned yet
+     */
+    bool isSynced() const {
+        return _synced;
+    }
+
+    /**
+     * @brief Convert a monotonic timestamp to UTC
+     *
+     * @param monoUs Monotonic timestamp from nowUs()
+     * @return int64_t Microseconds since the Unix epoch, 0 when not synced
+     */
+    int64_t toUtcUs(uint64_t monoUs) const;
+
+    void getStats(ClockServiceStats& stats) const {
+        stats = _stats;
+    }
+
+private:
+    ClockService();
+
+    void tick() {
+        nowUs();
+    }
+
+    void poll();
+    bool sample(time_t epoch, uint64_t now);
+    void endBurst(bool aligned);
+    void thread_f();
+
+    Timer _wrapTimer;
+    os_queue_t _burstQueue;
+    Thread* _thread;
+    uint32_t _lastMicros;
+    uint32_t _wraps;
+    time_t _lastEpoch;
+    uint64_t _lastPollUs;
+    int64_t _offsetUs;
+    std::atomic<bool> _synced;
+    std::atomic<bool> _bursting;
+    system_tick_t _burstStartMs;
+    std::atomic<system_tick_t> _nextBurstMs;
+    uint32_t _failedInRow;
+    ClockServiceStats _stats;
+
+    static ClockService *_instance;
+};
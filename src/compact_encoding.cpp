@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compact_encoding.h"
+
+#include <string.h>
+
+static const char Z85Alphabet[] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+
+// First byte of a compactJson() record, JSON text starts with '{' or '['
+constexpr uint8_t CompactJsonMagic = 0xB1;
+
+// Record tags
+constexpr uint8_t TagEnd = 0x00;        // closes an object or array
+constexpr uint8_t TagNull = 0x01;
+constexpr uint8_t TagTrue = 0x02;
+constexpr uint8_t TagFalse = 0x03;
+constexpr uint8_t TagObject = 0x04;     // name and value pairs up to TagEnd
+constexpr uint8_t TagArray = 0x05;      // values up to TagEnd
+constexpr uint8_t TagString = 0x06;     // uvarint length then the characters, escapes as written
+constexpr uint8_t TagNumber = 0x10;     // low nibble is the number of decimals, svarint mantissa
+constexpr uint8_t TagSmallInt = 0x40;   // low six bits are the value
+constexpr uint8_t TagToken = 0x80;      // low seven bits index CompactJsonTokens
+
+// Deepest nesting of objects and arrays
+constexpr int CompactJsonMaxDepth = 8;
+
+// Most decimals of a number, the low nibble of TagNumber
+constexpr unsigned CompactJsonMaxDecimals = 15;
+
+// Largest mantissa that can take another digit and still fit in an int64_t
+constexpr uint64_t CompactJsonMantissaLimit = 99999999999999999ULL;
+
+// Member names and strings of location publishes.  Stored records index into this table so
+// entries may only be appended.
+static const char* const CompactJsonTokens[] = {
+    "cmd", "loc", "time", "req_id", "lck", "lat", "lon", "alt",
+    "hd", "spd", "h_acc", "hdop", "v_acc", "vdop", "trig", "crumbs",
+    "towers", "wps", "cell", "batt", "temp", "str", "sig", "rat",
+    "mcc", "mnc", "lac", "cid", "nid", "ch", "bssid", "lte",
+    "loc_cb", "uds", "uds_ts", "sig_ts", "vprof", "ev", "t0", "drop",
+    "tripStart", "tripEnd", "tripDist", "tripFuel", "tripFuelSrc", "rate", "maf", "z",
+    "engineOff", "engineIdle", "engineNonIdle", "engineRpmMin", "engineRpmMean", "engineRpmMax",
+    "engineSpeedMin", "engineSpeedMean", "engineSpeedMax", "engineDist", "engineFuel",
+    "err", "batt_low", "batt_warn", "imm", "imu_g", "imu_m", "lock", "radius",
+    "temp_h", "temp_l", "trip_end", "trig_cnt",
+    "gf", "gf_enter", "gf_exit", "enter", "exit",
+    "distance", "turn",
+};
+
+static_assert(sizeof(CompactJsonTokens) / sizeof(CompactJsonTokens[0]) <= 0x80,
+    "tokens must fit the low seven bits of TagToken");
+
+namespace {
+
+class JsonCompactor {
+public:
+    JsonCompactor(const char* json, size_t length, CompactWriter& out) :
+        _p(json),
+        _end(json + length),
+        _out(out) {
+
+    }
+
+    bool value(int depth);
+
+    bool finished() {
+        skipSpace();
+        return (_p == _end) || (*_p == '\0');
+    }
+
+private:
+    void skipSpace() {
+        while ((_p < _end) && ((*_p == ' ') || (*_p == '\t') || (*_p == '\r') || (*_p == '\n'))) {
+            _p++;
+        }
+    }
+
+    bool literal(const char* text, uint8_t tag);
+    bool string();
+    bool number();
+
+    const char* _p;
+    const char* _end;
+    CompactWriter& _out;
+};
+
+bool JsonCompactor::value(int depth) {
+    skipSpace();
+    if ((_p >= _end) || (depth > CompactJsonMaxDepth)) {
+        return false;
+    }
+
+    switch (*_p) {
+        case '{':
+        case '[': {
+            bool object = (*_p == '{');
+            char close = object ? '}' : ']';
+            _out.u8(object ? TagObject : TagArray);
+            _p++;
+            skipSpace();
+            if ((_p < _end) && (*_p == close)) {
+                _p++;
+                _out.u8(TagEnd);
+                return true;
+            }
+            while (true) {
+                if (object) {
+                    skipSpace();
+                    if ((_p >= _end) || (*_p != '"') || !string()) {
+                        return false;
+                    }
+                    skipSpace();
+                    if ((_p >= _end) || (*_p != ':')) {
+                        return false;
+                    }
+                    _p++;
+                }
+                if (!value(depth + 1)) {
+                    return false;
+                }
+                skipSpace();
+                if (_p >= _end) {
+                    return false;
+                }
+                if (*_p == ',') {
+                    _p++;
+                    continue;
+                }
+                if (*_p != close) {
+                    return false;
+                }
+                _p++;
+                _out.u8(TagEnd);
+                return true;
+            }
+        }
+
+        case '"':
+            return string();
+
+        case 't':
+            return literal("true", TagTrue);
+
+        case 'f':
+            return literal("false", TagFalse);
+
+        case 'n':
+            return literal("null", TagNull);
+
+        default:
+            return number();
+    }
+}
+
+bool JsonCompactor::literal(const char* text, uint8_t tag) {
+    auto length = strlen(text);
+    if (((size_t)(_end - _p) < length) || strncmp(_p, text, length)) {
+        return false;
+    }
+    _p += length;
+    _out.u8(tag);
+    return true;
+}
+
+bool JsonCompactor::string() {
+    auto start = _p + 1;
+    auto q = start;
+    while ((q < _end) && (*q != '"')) {
+        if (*q == '\\') {
+            q++;
+        }
+        q++;
+    }
+    if (q >= _end) {
+        return false;
+    }
+    size_t length = q - start;
+    _p = q + 1;
+
+    for (size_t i = 0; i < sizeof(CompactJsonTokens) / sizeof(CompactJsonTokens[0]); i++) {
+        if ((strlen(CompactJsonTokens[i]) == length) && !memcmp(CompactJsonTokens[i], start, length)) {
+            _out.u8(TagToken | i);
+            return true;
+        }
+    }
+    _out.u8(TagString).uvarint(length).bytes(start, length);
+    return true;
+}
+
+bool JsonCompactor::number() {
+    bool negative = false;
+    if ((_p < _end) && (*_p == '-')) {
+        negative = true;
+        _p++;
+    }
+
+    uint64_t mantissa = 0;
+    unsigned decimals = 0;
+    bool digits = false;
+    bool point = false;
+    while (_p < _end) {
+        auto c = *_p;
+        if ((c >= '0') && (c <= '9')) {
+            if (mantissa > CompactJsonMantissaLimit) {
+                return false;
+            }
+            mantissa = mantissa * 10 + (c - '0');
+            digits = true;
+            if (point) {
+                decimals++;
+            }
+        }
+        else if ((c == '.') && !point) {
+            point = true;
+        }
+        else {
+            break;
+        }
+        _p++;
+    }
+
+    // Exponents are left to the caller to store as text, as is -0 which has no mantissa sign
+    if (!digits || (point && !decimals) || (decimals > CompactJsonMaxDecimals) ||
+        (negative && !mantissa) || ((_p < _end) && ((*_p == 'e') || (*_p == 'E')))) {
+        return false;
+    }
+
+    if (!negative && !decimals && (mantissa < 0x40)) {
+        _out.u8(TagSmallInt | (uint8_t)mantissa);
+    }
+    else {
+        _out.u8(TagNumber | decimals).svarint(negative ? -(int64_t)mantissa : (int64_t)mantissa);
+    }
+    return true;
+}
+
+class JsonExpander {
+public:
+    JsonExpander(CompactReader& in, char* out, size_t size) :
+        _in(in),
+        _out(out),
+        _size(size),
+        _length(0),
+        _overflow(false) {
+
+    }
+
+    bool value(uint8_t tag, int depth);
+
+    size_t length() const {
+        return _length;
+    }
+
+    bool overflow() const {
+        return _overflow;
+    }
+
+private:
+    void put(char c) {
+        // Room is always kept for the null terminator
+        if (_length + 1 < _size) {
+            _out[_length++] = c;
+        }
+        else {
+            _overflow = true;
+        }
+    }
+
+    void put(const char* text, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            put(text[i]);
+        }
+    }
+
+    void number(int64_t mantissa, unsigned decimals);
+
+    CompactReader& _in;
+    char* _out;
+    size_t _size;
+    size_t _length;
+    bool _overflow;
+};
+
+bool JsonExpander::value(uint8_t tag, int depth) {
+    if (depth > CompactJsonMaxDepth) {
+        return false;
+    }
+
+    if (tag & TagToken) {
+        size_t index = tag & ~TagToken;
+        if (index >= sizeof(CompactJsonTokens) / sizeof(CompactJsonTokens[0])) {
+            return false;
+        }
+        put('"');
+        put(CompactJsonTokens[index], strlen(CompactJsonTokens[index]));
+        put('"');
+        return true;
+    }
+    if (tag & TagSmallInt) {
+        number(tag & ~TagSmallInt, 0);
+        return true;
+    }
+    if ((tag & 0xF0) == TagNumber) {
+        number(_in.svarint(), tag & 0x0F);
+        return !_in.error();
+    }
+
+    switch (tag) {
+        case TagNull:
+            put("null", 4);
+            return true;
+
+        case TagTrue:
+            put("true", 4);
+            return true;
+
+        case TagFalse:
+            put("false", 5);
+            return true;
+
+        case TagString: {
+            auto length = (size_t)_in.uvarint();
+            auto text = _in.bytes(length);
+            if (!text) {
+                return false;
+            }
+            put('"');
+            put((const char*)text, length);
+            put('"');
+            return true;
+        }
+
+        case TagObject:
+        case TagArray: {
+            bool object = (tag == TagObject);
+            put(object ? '{' : '[');
+            bool first = true;
+            while (true) {
+                auto next = _in.u8();
+                if (_in.error()) {
+                    return false;
+                }
+                if (next == TagEnd) {
+                    break;
+                }
+                if (!first) {
+                    put(',');
+                }
+                first = false;
+                if (object) {
+                    if (!(next & TagToken) && (next != TagString)) {
+                        return false;
+                    }
+                    if (!value(next, depth + 1)) {
+                        return false;
+                    }
+                    put(':');
+                    next = _in.u8();
+                }
+                if (!value(next, depth + 1)) {
+                    return false;
+                }
+            }
+            put(object ? '}' : ']');
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+void JsonExpander::number(int64_t mantissa, unsigned decimals) {
+    char digits[24];
+    size_t count = 0;
+    auto magnitude = (mantissa < 0) ? -(uint64_t)mantissa : (uint64_t)mantissa;
+    // At least one digit ahead of the decimal point
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude || (count <= decimals));
+
+    if (mantissa < 0) {
+        put('-');
+    }
+    while (count) {
+        if (count == decimals) {
+            put('.');
+        }
+        put(digits[--count]);
+    }
+}
+
+} // namespace
+
+CompactWriter& CompactWriter::u8(uint8_t value) {
+    if (_length < _size) {
+        _buffer[_length++] = value;
+    }
+    else {
+        _overflow = true;
+    }
+    return *this;
+}
+
+CompactWriter& CompactWriter::bytes(const void* data, size_t length) {
+    auto p = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        u8(p[i]);
+    }
+    return *this;
+}
+
+CompactWriter& CompactWriter::uvarint(uint64_t value) {
+    while (value >= 0x80) {
+        u8((uint8_t)value | 0x80);
+        value >>= 7;
+    }
+    return u8((uint8_t)value);
+}
+
+uint8_t CompactReader::u8() {
+    if (_offset < _length) {
+        return _buffer[_offset++];
+    }
+    _error = true;
+    return 0;
+}
+
+const uint8_t* CompactReader::bytes(size_t length) {
+    if (length > remaining()) {
+        _error = true;
+        return nullptr;
+    }
+    auto data = _buffer + _offset;
+    _offset += length;
+    return data;
+}
+
+uint64_t CompactReader::uvarint() {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        auto byte = u8();
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    _error = true;
+    return 0;
+}
+
+size_t compactJson(const char* json, size_t length, uint8_t* out, size_t size) {
+    CompactWriter writer(out, size);
+    writer.u8(CompactJsonMagic);
+    JsonCompactor compactor(json, length, writer);
+    if (!compactor.value(0) || !compactor.finished() || writer.overflow()) {
+        return 0;
+    }
+    return writer.length();
+}
+
+bool isCompactJson(const uint8_t* data, size_t length) {
+    return (length > 1) && (data[0] == CompactJsonMagic);
+}
+
+size_t expandJson(const uint8_t* data, size_t length, char* out, size_t size) {
+    if (!isCompactJson(data, length) || !size) {
+        return 0;
+    }
+
+    CompactReader reader(data + 1, length - 1);
+    JsonExpander expander(reader, out, size);
+    auto tag = reader.u8();
+    if (reader.error() || !expander.value(tag, 0) || reader.error() || expander.overflow()) {
+        out[0] = '\0';
+        return 0;
+    }
+    out[expander.length()] = '\0';
+    return expander.length();
+}
+
+size_t z85Encode(const uint8_t* data, size_t length, char* out) {
+    size_t written = 0;
+
+    for (size_t i = 0; i < length; i += 4) {
+        uint32_t value = 0;
+        for (size_t n = 0; n < 4; n++) {
+            value = (value << 8) | ((i + n < length) ? data[i + n] : 0);
+        }
+        for (int n = 4; n >= 0; n--) {
+            out[written + n] = Z85Alphabet[value % 85];
+            value /= 85;
+        }
+        written += 5;
+    }
+    out[written] = '\0';
+
+    return written;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Append varint and fixed-point fields to a byte buffer
+ *
+ * @details Unsigned values are LEB128 varints, signed values are zigzag encoded first so that
+ * small magnitudes of either sign stay short.  Writes past the end of the buffer are dropped
+ * and flagged by overflow().
+ */
+class CompactWriter {
+public:
+    CompactWriter(uint8_t* buffer, size_t size) :
+        _buffer(buffer),
+        _size(size),
+        _length(0),
+        _overflow(false) {
+
+    }
+
+    CompactWriter& u8(uint8_t value);
+    CompactWriter& bytes(const void* data, size_t length);
+    CompactWriter& uvarint(uint64_t value);
+    CompactWriter& svarint(int64_t value) {
+        return uvarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    }
+
+    size_t length() const {
+        return _length;
+    }
+
+    bool overflow() const {
+        return _overflow;
+    }
+
+private:
+    uint8_t* _buffer;
+    size_t _size;
+    size_t _length;
+    bool _overflow;
+};
+
+/**
+ * @brief Read fields written by CompactWriter
+ *
+ * @details Reads past the end of the buffer return zeros and are flagged by error().
+ */
+class CompactReader {
+public:
+    CompactReader(const uint8_t* buffer, size_t length) :
+        _buffer(buffer),
+        _length(length),
+        _offset(0),
+        _error(false) {
+
+    }
+
+    uint8_t u8();
+    const uint8_t* bytes(size_t length);
+    uint64_t uvarint();
+    int64_t svarint() {
+        auto value = uvarint();
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+    size_t remaining() const {
+        return _length - _offset;
+    }
+
+    bool error() const {
+        return _error;
+    }
+
+private:
+    const uint8_t* _buffer;
+    size_t _length;
+    size_t _offset;
+    bool _error;
+};
+
+/**
+ * @brief Encode JSON text as a compact binary record
+ *
+ * @details Numbers keep their exact decimal digits as a fixed-point mantissa and a count of
+ * decimals, and the member names and strings common to location publishes become single
+ * byte tokens, so expandJson() gives back the same text less any whitespace.  Numbers with
+ * an exponent are not encoded.
+ *
+ * @param json JSON text
+ * @param length Length of the text
+ * @param out Buffer for the record
+ * @param size Size of the buffer
+ * @return size_t Bytes written, 0 if the text cannot be encoded or does not fit
+ */
+size_t compactJson(const char* json, size_t length, uint8_t* out, size_t size);
+
+/**
+ * @brief Check for a record written by compactJson()
+ *
+ * @param data Stored bytes
+ * @param length Number of bytes
+ * @return true if the bytes are a compact record rather than JSON text
+ */
+bool isCompactJson(const uint8_t* data, size_t length);
+
+/**
+ * @brief Render a record written by compactJson() back to JSON text
+ *
+ * @param data Record
+ * @param length Length of the record
+ * @param out Buffer for the null terminated text
+ * @param size Size of the buffer
+ * @return size_t Characters written, not including the null terminator, 0 if the record is
+ * malformed or the text does not fit
+ */
+size_t expandJson(const uint8_t* data, size_t length, char* out, size_t size);
+
+/**
+ * @brief Length of the Z85 text for a number of bytes
+ *
+ * @param length Number of bytes, padded up to a multiple of four
+ * @return size_t Characters, not including a null terminator
+ */
+constexpr size_t z85Length(size_t length) {
+    return (length + 3) / 4 * 5;
+}
+
+/**
+ * @brief Encode bytes as Z85 (ZeroMQ base85) text
+ *
+ * @details The input is padded with zero bytes to a multiple of four.  The alphabet has no
+ * quote or backslash so the text can be written into JSON strings without escaping.
+ *
+ * @param data Bytes to encode
+ * @param length Number of bytes
+ * @param out Buffer for the text, at least z85Length(length) + 1 characters
+ * @return size_t Characters written, not including the null terminator
+ */
+size_t z85Encode(const uint8_t* data, size_t length, char* out);
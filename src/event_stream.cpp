@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "event_stream.h"
+#include "cloud_service.h"
+#include "tracker.h"
+#include "json_sizing.h"
+
+EventStream *EventStream::_instance = nullptr;
+
+// One publish worth of tokens, refilled at rate per minute with millisecond steps
+constexpr uint32_t TokensPerPublish = 60000;
+
+EventStream::EventStream() :
+    _queue{},
+    _head(0),
+    _count(0),
+    _critical(false),
+    _tokens(EVENT_STREAM_BURST_DEFAULT * TokensPerPublish),
+    _lastRefill(0),
+    _lastPublish(0),
+    _dropped(0) {
+
+    _config.enable = EVENT_STREAM_ENABLE_DEFAULT;
+    _config.interval = EVENT_STREAM_INTERVAL_DEFAULT_SEC;
+    _config.rate = EVENT_STREAM_RATE_DEFAULT;
+    _config.burst = EVENT_STREAM_BURST_DEFAULT;
+}
+
+void EventStream::init() {
+    static ConfigObject events_desc("events", {
+        ConfigBool("enable", &_config.enable),
+        ConfigInt("interval", &_config.interval, 1, 86400),
+        ConfigInt("rate", &_config.rate, 1, 60),
+        ConfigInt("burst", &_config.burst, 1, 10),
+    });
+    Tracker::instance().configService.registerModule(events_desc);
+
+    _lastRefill = _lastPublish = millis();
+}
+
+int EventStream::post(const char* name, float value, uint64_t timestamp, bool critical) {
+    CHECK_TRUE(_config.enable, SYSTEM_ERROR_INVALID_STATE);
+
+    if (_count == EVENT_STREAM_QUEUE_SIZE) {
+        // Keep the newest events
+        _head = (_head + 1) % EVENT_STREAM_QUEUE_SIZE;
+        _count--;
+        _dropped++;
+    }
+
+    auto& event = _queue[(_head + _count) % EVENT_STREAM_QUEUE_SIZE];
+    event.timestamp = timestamp;
+    event.value = value;
+    strncpy(event.name, name, EVENT_STREAM_NAME_LEN);
+    event.name[EVENT_STREAM_NAME_LEN] = '\0';
+    _count++;
+    _critical |= critical;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void EventStream::refill() {
+    auto now = millis();
+    uint32_t capacity = (uint32_t)_config.burst * TokensPerPublish;
+    uint64_t tokens = _tokens + (uint64_t)(now - _lastRefill) * _config.rate;
+    _tokens = (uint32_t)std::min<uint64_t>(tokens, capacity);
+    _lastRefill = now;
+}
+
+int EventStream::publish() {
+    CloudService &cloud_service = CloudService::instance();
+    cloud_service.lock();
+
+    cloud_service.beginCommand("evt");
+    auto& writer = cloud_service.writer();
+
+    auto& first = _queue[_head];
+    auto t0 = ClockService::instance().toUtcUs(first.timestamp);
+    if (t0) {
+        writer.name("t0").value((double)t0 / 1000000.0, 3);
+    }
+    if (_dropped) {
+        writer.name("drop").value((unsigned int)_dropped);
+    }
+
+    writer.name("ev").beginArray();
+    size_t written = 0;
+    while (written < _count) {
+        auto& event = _queue[(_head + written) % EVENT_STREAM_QUEUE_SIZE];
+        uint64_t offset = (event.timestamp > first.timestamp) ? event.timestamp - first.timestamp : 0;
+        auto writeEvent = [&](JSONWriter& out) {
+            out.beginArray()
+                .value((unsigned int)(offset / 1000))
+                .value(event.name)
+                .value(event.value)
+                .endArray();
+        };
+
+        // Names come from the vehicle profile and may need escaping, so each event is sized
+        size_t remaining = writer.bufferSize() - 1 /* null */ - writer.dataSize()
+            - cloud_service.estimatedEndCommandSize() - 1 /* ] */;
+        if (jsonElementSize(writeEvent) > remaining) {
+            break;
+        }
+        writeEvent(writer);
+        written++;
+    }
+    writer.endArray();
+
+    int ret = cloud_service.send();
+    cloud_service.unlock();
+    CHECK(ret);
+
+    // Remove the events only once the publish is queued, anything left goes next time
+    _head = (_head + written) % EVENT_STREAM_QUEUE_SIZE;
+    _count -= written;
+    _dropped = 0;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void EventStream::loop() {
+    refill();
+
+    if (!_count || !Particle.connected()) {
+        return;
+    }
+
+    bool due = _critical || (millis() - _lastPublish >= (system_tick_t)_config.interval * 1000);
+    if (!due || (_tokens < TokensPerPublish)) {
+        return;
+    }
+
+    // A failed publish is charged as well so that it is retried at the rate limit rather than
+    // on every loop
+    _tokens -= TokensPerPublish;
+    if (publish()) {
+        return;
+    }
+    _lastPublish = millis();
+    // Events that did not fit go out with the next critical event or interval
+    _critical = false;
+}
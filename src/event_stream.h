@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "config_service.h"
+#include "clock_service.h"
+
+// Number of events held in RAM waiting to be published
+constexpr size_t EVENT_STREAM_QUEUE_SIZE {64};
+
+// Longest event name, matches the vehicle profile signal names
+constexpr size_t EVENT_STREAM_NAME_LEN {8};
+
+#define EVENT_STREAM_ENABLE_DEFAULT (false)
+#define EVENT_STREAM_INTERVAL_DEFAULT_SEC (30)
+#define EVENT_STREAM_RATE_DEFAULT (6)       // publishes per minute
+#define EVENT_STREAM_BURST_DEFAULT (3)      // publishes
+
+/**
+ * @brief A queued event
+ *
+ */
+struct StreamEvent {
+    uint64_t timestamp;             /**< Monotonic time in microseconds, see ClockService */
+    float value;                    /**< Signal value */
+    char name[EVENT_STREAM_NAME_LEN + 1];
+};
+
+struct EventStreamConfig {
+    bool enable;
+    int32_t interval;               // seconds between coalesced publishes
+    int32_t rate;                   // sustained publishes per minute
+    int32_t burst;                  // publishes allowed back to back
+};
+
+/**
+ * @brief Lightweight event stream published separately from the location
+ *
+ * @details Events are queued in RAM and coalesced into one "evt" publish every interval
+ * seconds, or as soon as possible after a critical event.  A token bucket of burst tokens
+ * refilled at rate per minute limits the stream's own publishes, failed attempts included.
+ * Location publishes are not charged to it, so rate must leave room for them within the cloud
+ * publish limits.  When the queue overflows the oldest events are dropped.  Events are
+ * published as
+ *
+ *   "t0": UTC seconds of the first event (omitted until the clock is synced to GNSS),
+ *   "ev": [[milliseconds since the first event, name, value], ...]
+ *
+ * Must only be used from the application thread.
+ */
+class EventStream {
+public:
+    /**
+     * @brief Singleton class instance access for EventStream
+     *
+     * @return EventStream&
+     */
+    static EventStream &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new EventStream();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register the configuration
+     *
+     */
+    void init();
+
+    /**
+     * @brief Publish queued events when due
+     *
+     */
+    void loop();
+
+    /**
+     * @brief Queue an event
+     *
+     * @param name Event name, truncated to EVENT_STREAM_NAME_LEN characters
+     * @param value Value
+     * @param timestamp Monotonic time in microseconds
+     * @param critical Publish as soon as the rate limit allows
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE the stream is disabled
+     */
+    int post(const char* name, float value, uint64_t timestamp, bool critical = false);
+
+private:
+    EventStream();
+
+    void refill();
+    int publish();
+
+    EventStreamConfig _config;
+    StreamEvent _queue[EVENT_STREAM_QUEUE_SIZE];
+    size_t _head;
+    size_t _count;
+    bool _critical;
+    uint32_t _tokens;               // in 1/60000 of a publish so that refills are exact
+    system_tick_t _lastRefill;
+    system_tick_t _lastPublish;
+    uint32_t _dropped;
+
+    static EventStream *_instance;
+};
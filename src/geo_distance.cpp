@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "geo_distance.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Radians and meters along a meridian per microdegree
+constexpr float RadiansPerMicrodegree = (float)(M_PI / 180e6);
+constexpr float MetersPerMicrodegree = GEO_EARTH_RADIUS_M * RadiansPerMicrodegree;
+
+// Longitude difference in the range of -180 to 180 degrees
+static int32_t longitudeDelta(int32_t from, int32_t to) {
+    int64_t delta = (int64_t)to - from;
+    if (delta > 180000000) {
+        delta -= 360000000;
+    }
+    else if (delta < -180000000) {
+        delta += 360000000;
+    }
+    return (int32_t)delta;
+}
+
+GeoPoint geoPoint(double latitude, double longitude) {
+    return {(int32_t)lround(latitude * 1e6), (int32_t)lround(longitude * 1e6)};
+}
+
+float geoHaversine(const GeoPoint& a, const GeoPoint& b) {
+    // Double precision, the float haversine term loses meters at short distances
+    constexpr double Radians = M_PI / 180e6;
+    double latA = a.latitude * Radians;
+    double latB = b.latitude * Radians;
+    double sinLat = sin((latB - latA) / 2);
+    double sinLon = sin(longitudeDelta(a.longitude, b.longitude) * Radians / 2);
+    double h = sinLat * sinLat + cos(latA) * cos(latB) * sinLon * sinLon;
+    return (float)(2 * GEO_EARTH_RADIUS_M * asin(sqrt(fmin(h, 1.0))));
+}
+
+GeoLocalFrame::GeoLocalFrame() :
+    _origin{0, 0},
+    _cosLatitude(1.0f),
+    _sinLatitude(0.0f) {
+
+}
+
+GeoLocalFrame::GeoLocalFrame(const GeoPoint& origin) {
+    setOrigin(origin);
+}
+
+void GeoLocalFrame::setOrigin(const GeoPoint& origin) {
+    _origin = origin;
+    _cosLatitude = cosf(origin.latitude * RadiansPerMicrodegree);
+    _sinLatitude = sinf(origin.latitude * RadiansPerMicrodegree);
+}
+
+bool GeoLocalFrame::project(const GeoPoint& point, float& east, float& north) const {
+    int32_t dLat = point.latitude - _origin.latitude;
+    int32_t dLon = longitudeDelta(_origin.longitude, point.longitude);
+    if ((abs(dLat) > GEO_LOCAL_MAX_SPAN) || (abs(dLon) > GEO_LOCAL_MAX_SPAN) ||
+        (abs(_origin.latitude) > GEO_LOCAL_MAX_LATITUDE)) {
+        return false;
+    }
+
+    // cos(origin + dLat / 2) to first order
+    float scale = _cosLatitude - _sinLatitude * (dLat * (RadiansPerMicrodegree / 2));
+    north = dLat * MetersPerMicrodegree;
+    east = dLon * MetersPerMicrodegree * scale;
+    return true;
+}
+
+float GeoLocalFrame::distance(const GeoPoint& point) const {
+    float east, north;
+    if (!project(point, east, north)) {
+        return geoHaversine(_origin, point);
+    }
+    return sqrtf(east * east + north * north);
+}
+
+bool GeoLocalFrame::isWithin(const GeoPoint& point, float radius) const {
+    float east, north;
+    if (!project(point, east, north)) {
+        return geoHaversine(_origin, point) <= radius;
+    }
+    return (east * east + north * north) <= (radius * radius);
+}
+
+float geoDistance(const GeoPoint& a, const GeoPoint& b) {
+    return GeoLocalFrame(a).distance(b);
+}
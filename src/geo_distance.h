@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Mean radius of the earth
+constexpr float GEO_EARTH_RADIUS_M {6371008.8f};
+
+// Largest latitude or longitude difference measured on the local tangent plane, about 11km
+constexpr int32_t GEO_LOCAL_MAX_SPAN {100000};
+
+// Highest latitude of a local tangent plane, beyond it meridians converge too quickly
+constexpr int32_t GEO_LOCAL_MAX_LATITUDE {80000000};
+
+/**
+ * @brief Position in microdegrees, about 0.11m of latitude per step
+ *
+ */
+struct GeoPoint {
+    int32_t latitude;
+    int32_t longitude;
+};
+
+/**
+ * @brief Convert degrees to a position in microdegrees
+ *
+ * @param latitude Latitude in degrees
+ * @param longitude Longitude in degrees
+ * @return GeoPoint Rounded to the nearest microdegree
+ */
+GeoPoint geoPoint(double latitude, double longitude);
+
+/**
+ * @brief Great-circle distance by the haversine formula
+ *
+ * @return float Meters
+ */
+float geoHaversine(const GeoPoint& a, const GeoPoint& b);
+
+/**
+ * @brief Distances from one reference position
+ *
+ * @details The reference keeps the cosine and sine of its latitude so that nearby positions
+ * are measured on the local tangent plane with a few multiplications and no trigonometry.
+ * The scale of a degree of longitude is taken at the mean latitude of the two positions by a
+ * first order correction, which keeps the error within a few centimeters over
+ * GEO_LOCAL_MAX_SPAN.  Positions further apart, or near the poles, fall back to geoHaversine().
+ */
+class GeoLocalFrame {
+public:
+    GeoLocalFrame();
+    explicit GeoLocalFrame(const GeoPoint& origin);
+
+    void setOrigin(const GeoPoint& origin);
+
+    const GeoPoint& origin() const {
+        return _origin;
+    }
+
+    /**
+     * @brief Distance from the reference
+     *
+     * @param point Measured position
+     * @return float Meters
+     */
+    float distance(const GeoPoint& point) const;
+
+    /**
+     * @brief Check a position against a radius around the reference
+     *
+     * @param point Measured position
+     * @param radius Meters
+     * @return true if the position is no further than the radius, decided without a square
+     * root on the local tangent plane
+     */
+    bool isWithin(const GeoPoint& point, float radius) const;
+
+private:
+    bool project(const GeoPoint& point, float& east, float& north) const;
+
+    GeoPoint _origin;
+    float _cosLatitude;
+    float _sinLatitude;
+};
+
+/**
+ * @brief Distance between two positions
+ *
+ * @return float Meters, on the local tangent plane of the first position when they are close
+ */
+float geoDistance(const GeoPoint& a, const GeoPoint& b);
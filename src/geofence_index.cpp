@@ -0,0 +1,641 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "geofence_index.h"
+#include "tracker_location.h"
+#include "geo_distance.h"
+
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define GEOFENCE_INDEX_ZONE_FILE (GEOFENCE_INDEX_DIR "/zones.gfz")
+#define GEOFENCE_INDEX_TEMP_FILE (GEOFENCE_INDEX_DIR "/zones.tmp")
+
+// Serialized sizes of each part of the zone file
+constexpr size_t HeaderSize = 12;
+constexpr size_t ZoneSize = 20;
+constexpr size_t VertexSize = 8;
+constexpr size_t MaxVertices = 0x10000;
+constexpr size_t MaxZoneFileSize = HeaderSize + GEOFENCE_INDEX_MAX_ZONES * ZoneSize + MaxVertices * VertexSize;
+
+// Smallest cell keeping the column of every longitude within 16 bits
+constexpr uint32_t MinCellSize = (360000000 + 0xFFFF) / 0x10000;
+
+// Largest decoded chunk accepted by the upload command
+constexpr size_t MaxUploadChunk = 512;
+
+// Zones read at once when validating an upload
+constexpr size_t ZonesPerRead = MaxUploadChunk / ZoneSize;
+
+// Microdegrees of latitude per meter in Q16
+// Largest zone radius in meters, half the circumference of the earth.  Bounds the products of
+// the circle test and the width of a bounding box near the poles.
+constexpr uint32_t MaxZoneRadius = 20015000;
+
+constexpr int64_t MicrodegreesPerMeterQ16 = (int64_t)(1e6 * 65536 / 111320.0);
+
+// Shared by uploading and validating, both run from the application thread
+static uint8_t zone_buffer[MaxUploadChunk];
+static uint8_t vertex_buffer[GEOFENCE_INDEX_MAX_POLYGON_VERTICES * VertexSize];
+
+GeofenceIndex *GeofenceIndex::_instance = nullptr;
+
+namespace {
+
+int hexNibble(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+uint16_t getU16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t getU32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void decodeZone(const uint8_t* p, GeofenceZone& zone) {
+    zone.id = getU16(p);
+    zone.shape = (GeofenceZoneShape)p[2];
+    zone.events = p[3];
+    zone.latitude = (int32_t)getU32(p + 4);
+    zone.longitude = (int32_t)getU32(p + 8);
+    zone.radius = getU32(p + 12);
+    zone.firstVertex = getU16(p + 16);
+    zone.vertexCount = getU16(p + 18);
+}
+
+bool readVertices(int fd, size_t zoneCount, const GeofenceZone& zone, GeofenceVertex* vertices) {
+    size_t size = zone.vertexCount * VertexSize;
+    lseek(fd, HeaderSize + zoneCount * ZoneSize + zone.firstVertex * VertexSize, SEEK_SET);
+    if (read(fd, vertex_buffer, size) != (int)size) {
+        return false;
+    }
+    for (size_t i = 0; i < zone.vertexCount; i++) {
+        vertices[i].latitude = (int32_t)getU32(vertex_buffer + i * VertexSize);
+        vertices[i].longitude = (int32_t)getU32(vertex_buffer + i * VertexSize + 4);
+    }
+    return true;
+}
+
+// Q15 cosine of a latitude in microdegrees, never below 1/256 so that a longitude
+// span stays bounded near the poles
+int32_t cosineQ15(int32_t latitude) {
+    auto value = (int32_t)(cosf((float)latitude * (float)(M_PI / 180e6)) * 32768.0f);
+    return std::max<int32_t>(value, 128);
+}
+
+int64_t radiusMicrodegrees(uint32_t meters) {
+    return ((int64_t)meters * MicrodegreesPerMeterQ16) >> 16;
+}
+
+// Zones reaching beyond the neighbouring cells of their centre.  A degree of longitude
+// shrinks away from the equator, so the radius is widened to match.
+bool isLarge(const GeofenceZone& zone, uint32_t cellSize) {
+    int64_t radius = radiusMicrodegrees(zone.radius);
+    return ((radius << 15) / cosineQ15(zone.latitude)) > (int64_t)cellSize;
+}
+
+int32_t clampMicrodegrees(int64_t value) {
+    return (int32_t)std::min<int64_t>(std::max<int64_t>(value, INT32_MIN), INT32_MAX);
+}
+
+bool insideCircle(const GeofenceZone& zone, int64_t radius, int32_t latitude, int32_t longitude, int32_t cosLatitude) {
+    int64_t dy = (int64_t)latitude - zone.latitude;
+    int64_t dx = (((int64_t)longitude - zone.longitude) * cosLatitude) >> 15;
+    return (dx * dx + dy * dy) <= (radius * radius);
+}
+
+// Crossing-number test.  The longitude where an edge crosses the latitude of the point is
+// compared after multiplying through by the latitude span of the edge, so no division is
+// needed and the products of microdegrees fit in 64 bits.
+bool insidePolygon(const GeofenceVertex* vertices, size_t count, int32_t latitude, int32_t longitude) {
+    bool inside = false;
+    for (size_t i = 0, j = count - 1; i < count; j = i++) {
+        auto& a = vertices[i];
+        auto& b = vertices[j];
+        if ((a.latitude > latitude) == (b.latitude > latitude)) {
+            continue;
+        }
+        int64_t span = (int64_t)b.latitude - a.latitude;
+        int64_t left = ((int64_t)longitude - a.longitude) * span;
+        int64_t right = ((int64_t)b.longitude - a.longitude) * ((int64_t)latitude - a.latitude);
+        if ((span > 0) ? (left < right) : (left > right)) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+} // namespace
+
+GeofenceIndex::GeofenceIndex() :
+    _fd(-1),
+    _zoneCount(0),
+    _cellSize(0),
+    _cellValid(false),
+    _cellKey(0),
+    _cosLatitude(32768),
+    _largeCount(0),
+    _candidateCount(0),
+    _vertexCount(0),
+    _largeVertexCount(0),
+    _inside{},
+    _enteredCount(0),
+    _exitedCount(0),
+    _dropped(0),
+    _stats{} {
+
+}
+
+void GeofenceIndex::init() {
+    mkdir(GEOFENCE_INDEX_DIR, 0777);
+
+    CloudService::instance().regCommandCallback("geofence_zones", &GeofenceIndex::zones_cmd_cb, this);
+    TrackerLocation::instance().regLocGenCallback(&GeofenceIndex::loc_gen_cb, &GeofenceIndex::loc_gen_commit_cb, this);
+
+    int ret = load();
+    if (ret && (ret != SYSTEM_ERROR_NOT_FOUND)) {
+        Log.error("geofence zones invalid: %d", ret);
+    }
+}
+
+void GeofenceIndex::unload() {
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    _zoneCount = 0;
+    _largeCount = 0;
+    _candidateCount = 0;
+    _vertexCount = 0;
+    _largeVertexCount = 0;
+    _cellValid = false;
+    memset(_inside, 0, sizeof(_inside));
+}
+
+int GeofenceIndex::load() {
+    unload();
+
+    int fd = open(GEOFENCE_INDEX_ZONE_FILE, O_RDONLY);
+    CHECK_TRUE(fd >= 0, SYSTEM_ERROR_NOT_FOUND);
+
+    uint8_t header[HeaderSize];
+    if (read(fd, header, sizeof(header)) != (int)sizeof(header)) {
+        close(fd);
+        return SYSTEM_ERROR_IO;
+    }
+    _fd = fd;
+    _cellSize = getU32(header + 8);
+    _zoneCount = getU16(header + 6);
+
+    // Large zones are never candidates, keep them apart
+    GeofenceZone zone;
+    for (size_t i = 0; i < _zoneCount; i++) {
+        if (!readZone(i, zone)) {
+            unload();
+            return SYSTEM_ERROR_IO;
+        }
+        if (isLarge(zone, _cellSize) && (_largeCount < GEOFENCE_INDEX_MAX_LARGE_ZONES) &&
+            makeCandidate(zone, i, _large[_largeCount])) {
+            _largeCount++;
+        }
+    }
+    _largeVertexCount = _vertexCount;
+
+    Log.info("geofence zones loaded: %u, %u large", _zoneCount, _largeCount);
+    return SYSTEM_ERROR_NONE;
+}
+
+int GeofenceIndex::validate(const char* path) {
+    int fd = open(path, O_RDONLY);
+    CHECK_TRUE(fd >= 0, SYSTEM_ERROR_IO);
+
+    int ret = SYSTEM_ERROR_NONE;
+    uint8_t header[HeaderSize];
+    size_t count = 0;
+    size_t vertices = 0;
+    uint32_t cellSize = 0;
+    int size = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+
+    if (read(fd, header, sizeof(header)) != (int)sizeof(header)) {
+        ret = SYSTEM_ERROR_BAD_DATA;
+    }
+    else {
+        count = getU16(header + 6);
+        cellSize = getU32(header + 8);
+        if ((getU32(header) != GEOFENCE_INDEX_MAGIC) ||
+            (getU16(header + 4) != GEOFENCE_INDEX_VERSION) ||
+            (cellSize < MinCellSize) ||
+            (count > GEOFENCE_INDEX_MAX_ZONES) ||
+            (size < (int)(HeaderSize + count * ZoneSize)) ||
+            ((size - HeaderSize - count * ZoneSize) % VertexSize)) {
+            ret = SYSTEM_ERROR_BAD_DATA;
+        }
+        vertices = (size - HeaderSize - count * ZoneSize) / VertexSize;
+    }
+
+    // Zones must be well formed and sorted by cell for the binary search
+    uint32_t lastKey = 0;
+    size_t large = 0;
+    size_t largeVertices = 0;
+    int vertexFd = open(path, O_RDONLY);
+    if (vertexFd < 0) {
+        ret = SYSTEM_ERROR_IO;
+    }
+    for (size_t first = 0; !ret && (first < count); first += ZonesPerRead) {
+        size_t zones = std::min(ZonesPerRead, count - first);
+        if (read(fd, zone_buffer, zones * ZoneSize) != (int)(zones * ZoneSize)) {
+            ret = SYSTEM_ERROR_IO;
+            break;
+        }
+        for (size_t i = 0; i < zones; i++) {
+            GeofenceZone zone;
+            decodeZone(zone_buffer + i * ZoneSize, zone);
+            if ((zone.latitude < -90000000) || (zone.latitude > 90000000) ||
+                (zone.longitude < -180000000) || (zone.longitude > 180000000) ||
+                (zone.radius > MaxZoneRadius)) {
+                ret = SYSTEM_ERROR_BAD_DATA;
+                break;
+            }
+            if (zone.shape == GeofenceZoneShape::CIRCLE) {
+                if (zone.vertexCount) {
+                    ret = SYSTEM_ERROR_BAD_DATA;
+                    break;
+                }
+            }
+            else if (zone.shape == GeofenceZoneShape::POLYGON) {
+                // Every vertex must lie in the enclosing circle that places the polygon in the grid
+                GeofenceVertex polygon[GEOFENCE_INDEX_MAX_POLYGON_VERTICES];
+                if ((zone.vertexCount < 3) || (zone.vertexCount > GEOFENCE_INDEX_MAX_POLYGON_VERTICES) ||
+                    ((size_t)zone.firstVertex + zone.vertexCount > vertices)) {
+                    ret = SYSTEM_ERROR_BAD_DATA;
+                    break;
+                }
+                if (!readVertices(vertexFd, count, zone, polygon)) {
+                    ret = SYSTEM_ERROR_IO;
+                    break;
+                }
+                auto radius = radiusMicrodegrees(zone.radius);
+                auto cosLatitude = cosineQ15(zone.latitude);
+                for (size_t v = 0; !ret && (v < zone.vertexCount); v++) {
+                    if (!insideCircle(zone, radius, polygon[v].latitude, polygon[v].longitude, cosLatitude)) {
+                        ret = SYSTEM_ERROR_BAD_DATA;
+                    }
+                }
+                if (ret) {
+                    break;
+                }
+            }
+            else {
+                ret = SYSTEM_ERROR_BAD_DATA;
+                break;
+            }
+            auto key = geofenceCellKey(zone.latitude, zone.longitude, cellSize);
+            if (key < lastKey) {
+                ret = SYSTEM_ERROR_BAD_DATA;
+                break;
+            }
+            lastKey = key;
+
+            if (isLarge(zone, cellSize)) {
+                largeVertices += zone.vertexCount;
+                if ((++large > GEOFENCE_INDEX_MAX_LARGE_ZONES) || (largeVertices > GEOFENCE_INDEX_MAX_VERTICES / 2)) {
+                    ret = SYSTEM_ERROR_TOO_LARGE;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (vertexFd >= 0) {
+        close(vertexFd);
+    }
+    close(fd);
+    return ret;
+}
+
+bool GeofenceIndex::readZone(size_t index, GeofenceZone& zone) {
+    uint8_t record[ZoneSize];
+    lseek(_fd, HeaderSize + index * ZoneSize, SEEK_SET);
+    if (read(_fd, record, sizeof(record)) != (int)sizeof(record)) {
+        return false;
+    }
+    decodeZone(record, zone);
+    return true;
+}
+
+bool GeofenceIndex::makeCandidate(const GeofenceZone& zone, uint16_t index, Candidate& candidate) {
+    candidate.zone = zone;
+    candidate.index = index;
+    candidate.radius = radiusMicrodegrees(zone.radius);
+    candidate.firstVertex = _vertexCount;
+
+    if (zone.shape == GeofenceZoneShape::CIRCLE) {
+        // Up to 256 times the radius near the poles, beyond 32 bits for the largest zones
+        int64_t width = (candidate.radius << 15) / cosineQ15(zone.latitude);
+        candidate.minLatitude = clampMicrodegrees((int64_t)zone.latitude - candidate.radius);
+        candidate.maxLatitude = clampMicrodegrees((int64_t)zone.latitude + candidate.radius);
+        candidate.minLongitude = clampMicrodegrees((int64_t)zone.longitude - width);
+        candidate.maxLongitude = clampMicrodegrees((int64_t)zone.longitude + width);
+        return true;
+    }
+
+    if (_vertexCount + zone.vertexCount > GEOFENCE_INDEX_MAX_VERTICES) {
+        Log.warn("geofence zone %u skipped, vertices limited to %u", zone.id, GEOFENCE_INDEX_MAX_VERTICES);
+        return false;
+    }
+    auto vertices = &_vertices[_vertexCount];
+    if (!readVertices(_fd, _zoneCount, zone, vertices)) {
+        return false;
+    }
+    _vertexCount += zone.vertexCount;
+
+    candidate.minLatitude = candidate.maxLatitude = vertices[0].latitude;
+    candidate.minLongitude = candidate.maxLongitude = vertices[0].longitude;
+    for (size_t i = 1; i < zone.vertexCount; i++) {
+        candidate.minLatitude = std::min(candidate.minLatitude, vertices[i].latitude);
+        candidate.maxLatitude = std::max(candidate.maxLatitude, vertices[i].latitude);
+        candidate.minLongitude = std::min(candidate.minLongitude, vertices[i].longitude);
+        candidate.maxLongitude = std::max(candidate.maxLongitude, vertices[i].longitude);
+    }
+    return true;
+}
+
+void GeofenceIndex::loadCell(int32_t latitude, int32_t longitude, uint32_t key) {
+    int32_t row = key >> 16;
+    int32_t column = key & 0xFFFF;
+
+    // Zones left behind are no longer checked, so leave them now
+    for (size_t i = 0; i < _candidateCount; i++) {
+        auto& candidate = _candidates[i];
+        auto zoneKey = geofenceCellKey(candidate.zone.latitude, candidate.zone.longitude, _cellSize);
+        if ((abs((int32_t)(zoneKey >> 16) - row) > 1) || (abs((int32_t)(zoneKey & 0xFFFF) - column) > 1)) {
+            exitZone(candidate.zone, candidate.index);
+        }
+    }
+
+    _candidateCount = 0;
+    _vertexCount = _largeVertexCount;
+    for (int32_t r = row - 1; r <= row + 1; r++) {
+        if (r < 0) {
+            continue;
+        }
+        addCandidates(((uint32_t)r << 16) | std::max<int32_t>(column - 1, 0), ((uint32_t)r << 16) | std::min<int32_t>(column + 1, 0xFFFF));
+    }
+
+    _cellKey = key;
+    _cellValid = true;
+    _cosLatitude = cosineQ15(((int32_t)row * (int32_t)_cellSize + (int32_t)_cellSize / 2) - 90000000);
+    _stats.cellLoads++;
+}
+
+void GeofenceIndex::addCandidates(uint32_t first, uint32_t last) {
+    GeofenceZone zone;
+
+    // Find the first zone of the row at or after the first cell
+    size_t low = 0;
+    size_t high = _zoneCount;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (!readZone(mid, zone)) {
+            return;
+        }
+        if (geofenceCellKey(zone.latitude, zone.longitude, _cellSize) < first) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    for (size_t i = low; i < _zoneCount; i++) {
+        if (!readZone(i, zone) || (geofenceCellKey(zone.latitude, zone.longitude, _cellSize) > last)) {
+            break;
+        }
+        if (isLarge(zone, _cellSize)) {
+            continue;
+        }
+        if (_candidateCount >= GEOFENCE_INDEX_MAX_CANDIDATES) {
+            Log.warn("geofence candidates limited to %u", GEOFENCE_INDEX_MAX_CANDIDATES);
+            break;
+        }
+        if (makeCandidate(zone, i, _candidates[_candidateCount])) {
+            _candidateCount++;
+        }
+    }
+}
+
+void GeofenceIndex::update(const LocationPoint& point) {
+    if (_fd < 0) {
+        return;
+    }
+
+    auto start = micros();
+    auto position = geoPoint(point.latitude, point.longitude);
+    auto latitude = position.latitude;
+    auto longitude = position.longitude;
+    auto key = geofenceCellKey(latitude, longitude, _cellSize);
+    if (!_cellValid || (key != _cellKey)) {
+        loadCell(latitude, longitude, key);
+    }
+
+    for (size_t i = 0; i < _candidateCount; i++) {
+        check(_candidates[i], latitude, longitude);
+    }
+    for (size_t i = 0; i < _largeCount; i++) {
+        check(_large[i], latitude, longitude);
+    }
+
+    uint32_t elapsed = micros() - start;
+    if (elapsed > _stats.maxUpdateUs) {
+        _stats.maxUpdateUs = elapsed;
+    }
+}
+
+void GeofenceIndex::check(const Candidate& candidate, int32_t latitude, int32_t longitude) {
+    bool inside = (latitude >= candidate.minLatitude) && (latitude <= candidate.maxLatitude) &&
+        (longitude >= candidate.minLongitude) && (longitude <= candidate.maxLongitude);
+    if (inside) {
+        if (candidate.zone.shape == GeofenceZoneShape::POLYGON) {
+            inside = insidePolygon(&_vertices[candidate.firstVertex], candidate.zone.vertexCount, latitude, longitude);
+        }
+        else {
+            inside = insideCircle(candidate.zone, candidate.radius, latitude, longitude, _cosLatitude);
+        }
+    }
+    uint32_t mask = 1u << (candidate.index % 32);
+    auto& word = _inside[candidate.index / 32];
+    if (inside == ((word & mask) != 0)) {
+        return;
+    }
+
+    word ^= mask;
+    if (inside) {
+        if (candidate.zone.events & GEOFENCE_ZONE_ENTER) {
+            addEvent(GEOFENCE_ZONE_ENTER, candidate.zone.id);
+        }
+    }
+    else if (candidate.zone.events & GEOFENCE_ZONE_EXIT) {
+        addEvent(GEOFENCE_ZONE_EXIT, candidate.zone.id);
+    }
+}
+
+void GeofenceIndex::exitZone(const GeofenceZone& zone, uint16_t index) {
+    uint32_t mask = 1u << (index % 32);
+    auto& word = _inside[index / 32];
+    if (!(word & mask)) {
+        return;
+    }
+
+    word &= ~mask;
+    if (zone.events & GEOFENCE_ZONE_EXIT) {
+        addEvent(GEOFENCE_ZONE_EXIT, zone.id);
+    }
+}
+
+void GeofenceIndex::addEvent(uint8_t event, uint16_t id) {
+    bool enter = (event == GEOFENCE_ZONE_ENTER);
+    auto ids = enter ? _entered : _exited;
+    auto& count = enter ? _enteredCount : _exitedCount;
+
+    if (count >= GEOFENCE_INDEX_MAX_EVENTS) {
+        _dropped++;
+        return;
+    }
+    ids[count++] = id;
+    TrackerLocation::instance().triggerLocPub(Trigger::NORMAL, enter ? "gf_enter" : "gf_exit");
+}
+
+void GeofenceIndex::getStats(GeofenceIndexStats& stats, bool reset) {
+    _stats.zones = _zoneCount;
+    _stats.largeZones = _largeCount;
+    _stats.candidates = _candidateCount;
+    stats = _stats;
+    if (reset) {
+        _stats.cellLoads = 0;
+        _stats.maxUpdateUs = 0;
+    }
+}
+
+int GeofenceIndex::zones_cmd_cb(CloudServiceStatus status, JSONValue *root, const void *context) {
+    int offset = 0;
+    bool last = false;
+    bool erase = false;
+    JSONString data;
+
+    JSONObjectIterator item(*root);
+    while (item.next()) {
+        if (item.name() == "offset") {
+            offset = item.value().toInt();
+        }
+        else if (item.name() == "data") {
+            data = item.value().toString();
+        }
+        else if (item.name() == "last") {
+            last = item.value().toBool();
+        }
+        else if (item.name() == "delete") {
+            erase = item.value().toBool();
+        }
+    }
+
+    if (erase) {
+        unload();
+        unlink(GEOFENCE_INDEX_ZONE_FILE);
+        return SYSTEM_ERROR_NONE;
+    }
+
+    size_t chunk = data.size() / 2;
+    CHECK_TRUE(((data.size() % 2) == 0) && (chunk <= MaxUploadChunk), SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE((offset >= 0) && ((size_t)offset + chunk <= MaxZoneFileSize), SYSTEM_ERROR_TOO_LARGE);
+
+    for (size_t i = 0; i < chunk; i++) {
+        int high = hexNibble(data.data()[i * 2]);
+        int low = hexNibble(data.data()[i * 2 + 1]);
+        CHECK_TRUE((high >= 0) && (low >= 0), SYSTEM_ERROR_INVALID_ARGUMENT);
+        zone_buffer[i] = (high << 4) | low;
+    }
+
+    int fd = open(GEOFENCE_INDEX_TEMP_FILE, O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC));
+    CHECK_TRUE(fd >= 0, SYSTEM_ERROR_IO);
+    lseek(fd, offset, SEEK_SET);
+    int written = write(fd, zone_buffer, chunk);
+    close(fd);
+    CHECK_TRUE(written == (int)chunk, SYSTEM_ERROR_IO);
+
+    if (!last) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // Validate the complete file before replacing the stored zones
+    int ret = validate(GEOFENCE_INDEX_TEMP_FILE);
+    if (ret) {
+        Log.error("geofence zones upload invalid: %d", ret);
+        unlink(GEOFENCE_INDEX_TEMP_FILE);
+        return ret;
+    }
+
+    unload();
+    unlink(GEOFENCE_INDEX_ZONE_FILE);
+    CHECK_FALSE(rename(GEOFENCE_INDEX_TEMP_FILE, GEOFENCE_INDEX_ZONE_FILE), SYSTEM_ERROR_IO);
+    return load();
+}
+
+void GeofenceIndex::loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context) {
+    if (!_enteredCount && !_exitedCount && !_dropped) {
+        return;
+    }
+
+    writer.name("gf").beginObject();
+    if (_enteredCount) {
+        writer.name("enter").beginArray();
+        for (size_t i = 0; i < _enteredCount; i++) {
+            writer.value((unsigned int)_entered[i]);
+        }
+        writer.endArray();
+    }
+    if (_exitedCount) {
+        writer.name("exit").beginArray();
+        for (size_t i = 0; i < _exitedCount; i++) {
+            writer.value((unsigned int)_exited[i]);
+        }
+        writer.endArray();
+    }
+    if (_dropped) {
+        writer.name("drop").value((unsigned int)_dropped);
+    }
+    writer.endObject();
+}
+
+// Events are cleared only once they are in the publish, otherwise they go out with the next one
+void GeofenceIndex::loc_gen_commit_cb(const void *context) {
+    _enteredCount = 0;
+    _exitedCount = 0;
+    _dropped = 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "cloud_service.h"
+#include "location_service.h"
+
+#define GEOFENCE_INDEX_DIR "/usr/geofence"
+
+// Most zones in the zone file, each has one bit of inside state
+constexpr size_t GEOFENCE_INDEX_MAX_ZONES {16384};
+
+// Zones too large for the grid, checked on every update
+constexpr size_t GEOFENCE_INDEX_MAX_LARGE_ZONES {32};
+
+// Zones of the current and neighbouring cells held in RAM
+constexpr size_t GEOFENCE_INDEX_MAX_CANDIDATES {64};
+
+// Zone events reported with one location publish
+constexpr size_t GEOFENCE_INDEX_MAX_EVENTS {16};
+
+// Vertices of one polygon zone
+constexpr size_t GEOFENCE_INDEX_MAX_POLYGON_VERTICES {64};
+
+// Vertices of the candidate and large polygon zones held in RAM
+constexpr size_t GEOFENCE_INDEX_MAX_VERTICES {512};
+
+/*
+ * Zone file format, all values little-endian
+ *
+ *   header    uint32 magic "GFZ1", uint16 version, uint16 zone count,
+ *             uint32 cell size (microdegrees)
+ *   zones     uint16 id, uint8 shape (0: circle, 1: polygon), uint8 events (bit0: enter,
+ *             bit1: exit), int32 latitude, int32 longitude (microdegrees), uint32 radius
+ *             (meters, at most half the circumference of the earth), uint16 first vertex, uint16 vertex count
+ *   vertices  int32 latitude, int32 longitude (microdegrees), to the end of the file
+ *
+ * The centre and radius of a polygon are a circle enclosing all of its vertices, which places
+ * the polygon in the grid.  Its vertices are a range of the vertex table, 3 to
+ * GEOFENCE_INDEX_MAX_POLYGON_VERTICES of them, and its edges may not cross the antimeridian.
+ * Circles have no vertices.
+ *
+ * The grid divides the globe into square cells of the given size in degrees.  Zones are
+ * sorted by geofenceCellKey() of their centre so the zones of a row of cells are
+ * contiguous and found by binary search in the file.  A zone may reach into the
+ * neighbouring cells, a radius of at most one cell, otherwise it is one of the
+ * GEOFENCE_INDEX_MAX_LARGE_ZONES large zones that are checked on every update.
+ */
+constexpr uint32_t GEOFENCE_INDEX_MAGIC {0x315A4647}; // "GFZ1"
+constexpr uint16_t GEOFENCE_INDEX_VERSION {1};
+
+// Events reported for a zone
+constexpr uint8_t GEOFENCE_ZONE_ENTER {0x01};
+constexpr uint8_t GEOFENCE_ZONE_EXIT {0x02};
+
+enum class GeofenceZoneShape : uint8_t {
+    CIRCLE = 0,
+    POLYGON = 1,
+};
+
+struct GeofenceZone {
+    uint16_t id;                    /**< Identifier reported with events */
+    GeofenceZoneShape shape;
+    uint8_t events;                 /**< GEOFENCE_ZONE_ENTER and GEOFENCE_ZONE_EXIT */
+    int32_t latitude;               /**< Centre in microdegrees */
+    int32_t longitude;              /**< Centre in microdegrees */
+    uint32_t radius;                /**< Meters, of the enclosing circle for polygons */
+    uint16_t firstVertex;           /**< Polygon vertices in the vertex table */
+    uint16_t vertexCount;
+};
+
+struct GeofenceVertex {
+    int32_t latitude;               /**< Microdegrees */
+    int32_t longitude;              /**< Microdegrees */
+};
+
+/**
+ * @brief Grid cell of a position, rows of cells in the upper 16 bits
+ *
+ * @param latitude Latitude in microdegrees
+ * @param longitude Longitude in microdegrees
+ * @param cellSize Cell size in microdegrees
+ * @return uint32_t Key ordering cells by row then column
+ */
+inline uint32_t geofenceCellKey(int32_t latitude, int32_t longitude, uint32_t cellSize) {
+    uint32_t row = (uint32_t)(latitude + 90000000) / cellSize;
+    uint32_t column = (uint32_t)(longitude + 180000000) / cellSize;
+    return (row << 16) | (column & 0xFFFF);
+}
+
+/**
+ * @brief Geofence engine usage
+ *
+ */
+struct GeofenceIndexStats {
+    size_t zones;                   /**< Zones in the zone file */
+    size_t largeZones;              /**< Zones checked on every update */
+    size_t candidates;              /**< Zones around the current cell */
+    uint32_t cellLoads;             /**< Times the candidates were read from the file */
+    uint32_t maxUpdateUs;           /**< Longest update */
+};
+
+/**
+ * @brief Geofences of many zones stored in the filesystem
+ *
+ * @details Zones are uploaded with the "geofence_zones" cloud command and kept in
+ * /usr/geofence.  Only the zones of the cell holding the device and its eight neighbours are
+ * read into RAM, again whenever the device moves to another cell, so an update only checks
+ * nearby zones however many are stored.  Polygons are tested with an integer crossing-number
+ * test after a bounding box check.  The inside state of every zone is one bit.  Enter
+ * and exit events trigger a location publish and are reported under "gf".
+ */
+class GeofenceIndex {
+public:
+    /**
+     * @brief Singleton class instance access for GeofenceIndex
+     *
+     * @return GeofenceIndex&
+     */
+    static GeofenceIndex &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new GeofenceIndex();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register the upload command and location publish callback and load the zones
+     *
+     */
+    void init();
+
+    /**
+     * @brief Check the zones around a new position
+     *
+     * @param point Location with a stable lock
+     */
+    void update(const LocationPoint& point);
+
+    /**
+     * @brief Zones are loaded
+     *
+     * @return true if there are zones to check
+     */
+    bool isEnabled() const {
+        return _zoneCount > 0;
+    }
+
+    void getStats(GeofenceIndexStats& stats, bool reset = false);
+
+private:
+    GeofenceIndex();
+
+    struct Candidate {
+        GeofenceZone zone;
+        uint16_t index;             // position in the zone file
+        int64_t radius;             // microdegrees of latitude
+        int32_t minLatitude;        // bounding box in microdegrees
+        int32_t maxLatitude;
+        int32_t minLongitude;
+        int32_t maxLongitude;
+        uint16_t firstVertex;       // polygon vertices in _vertices
+    };
+
+    int load();
+    void unload();
+    int validate(const char* path);
+    bool readZone(size_t index, GeofenceZone& zone);
+    bool makeCandidate(const GeofenceZone& zone, uint16_t index, Candidate& candidate);
+    void loadCell(int32_t latitude, int32_t longitude, uint32_t key);
+    void addCandidates(uint32_t first, uint32_t last);
+    void check(const Candidate& candidate, int32_t latitude, int32_t longitude);
+    void exitZone(const GeofenceZone& zone, uint16_t index);
+    void addEvent(uint8_t event, uint16_t id);
+
+    int zones_cmd_cb(CloudServiceStatus status, JSONValue *root, const void *context);
+    void loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context);
+    void loc_gen_commit_cb(const void *context);
+
+    int _fd;
+    size_t _zoneCount;
+    uint32_t _cellSize;
+    bool _cellValid;
+    uint32_t _cellKey;
+    int32_t _cosLatitude;           // Q15 cosine of the latitude of the current cell
+
+    Candidate _large[GEOFENCE_INDEX_MAX_LARGE_ZONES];
+    size_t _largeCount;
+    Candidate _candidates[GEOFENCE_INDEX_MAX_CANDIDATES];
+    size_t _candidateCount;
+    GeofenceVertex _vertices[GEOFENCE_INDEX_MAX_VERTICES];
+    size_t _vertexCount;
+    size_t _largeVertexCount;       // vertices of large zones, ahead of the candidates
+    uint32_t _inside[GEOFENCE_INDEX_MAX_ZONES / 32];
+
+    uint16_t _entered[GEOFENCE_INDEX_MAX_EVENTS];
+    size_t _enteredCount;
+    uint16_t _exited[GEOFENCE_INDEX_MAX_EVENTS];
+    size_t _exitedCount;
+    uint32_t _dropped;
+
+    GeofenceIndexStats _stats;
+
+    static GeofenceIndex *_instance;
+};
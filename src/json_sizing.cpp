@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "json_sizing.h"
+
+namespace {
+
+// Reaches the protected output of any JSONWriter to copy already encoded text
+class JSONRawWriter : public JSONWriter {
+public:
+    static void append(JSONWriter& writer, const char* data, size_t size) {
+        (writer.*(&JSONRawWriter::write))(data, size);
+    }
+};
+
+} // namespace
+
+void JSONMemberStage::append(JSONWriter& writer) const {
+    if ((_length <= 2) || (_length > _size)) {
+        return;
+    }
+
+    // Members without the enclosing braces, after a separator
+    JSONRawWriter::append(writer, ",", 1);
+    JSONRawWriter::append(writer, _buffer + 1, _length - 2);
+}
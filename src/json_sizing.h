@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+/**
+ * @brief JSON writer that only counts the bytes it would write
+ *
+ */
+class JSONCountingWriter : public JSONWriter {
+public:
+    JSONCountingWriter() :
+        _size(0) {
+
+    }
+
+    size_t dataSize() const {
+        return _size;
+    }
+
+protected:
+    void write(const char* data, size_t size) override {
+        _size += size;
+    }
+
+private:
+    size_t _size;
+};
+
+/**
+ * @brief Encoded size of the members written by a function
+ *
+ * @param fn Function taking a JSONWriter& that writes name and value pairs
+ * @return size_t Bytes, including the comma that separates them from earlier members of the
+ * enclosing object, 0 if nothing is written
+ */
+template <typename F>
+size_t jsonMemberSize(F fn) {
+    JSONCountingWriter counter;
+    counter.beginObject();
+    fn(counter);
+    counter.endObject();
+    // Trade the braces for the separator
+    return (counter.dataSize() > 2) ? counter.dataSize() - 1 : 0;
+}
+
+/**
+ * @brief Encoded size of an array element written by a function
+ *
+ * @param fn Function taking a JSONWriter& that writes one value
+ * @return size_t Bytes, including the comma that separates it from an earlier element
+ */
+template <typename F>
+size_t jsonElementSize(F fn) {
+    JSONCountingWriter counter;
+    counter.beginArray();
+    fn(counter);
+    counter.endArray();
+    return (counter.dataSize() > 2) ? counter.dataSize() - 1 : 0;
+}
+
+/**
+ * @brief Stage the members written by a callback so that they can be sized before they are
+ * committed to a publish
+ *
+ * @details Callbacks with side effects cannot be run once to size them and again to write.
+ * capture() runs the callback once into a scratch buffer and append() copies the encoded
+ * members into the destination object, which must already hold at least one member.
+ */
+class JSONMemberStage {
+public:
+    JSONMemberStage(char* buffer, size_t size) :
+        _buffer(buffer),
+        _size(size),
+        _length(0) {
+
+    }
+
+    /**
+     * @brief Run a callback into the scratch buffer
+     *
+     * @param fn Function taking a JSONWriter& that writes name and value pairs
+     * @return size_t Bytes append() will write, 0 if nothing was written.  A callback that
+     * overflows the scratch buffer returns a size larger than the buffer.
+     */
+    template <typename F>
+    size_t capture(F fn) {
+        JSONBufferWriter writer(_buffer, _size);
+        writer.beginObject();
+        fn(writer);
+        writer.endObject();
+        _length = writer.dataSize();
+        return (_length > 2) ? _length - 1 : 0;
+    }
+
+    /**
+     * @brief Append the captured members to an object
+     *
+     * @param writer Writer positioned after a member of an open object
+     */
+    void append(JSONWriter& writer) const;
+
+private:
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+};
@@ -20,6 +20,7 @@
 #include "Particle.h"
 #include "tracker_config.h"
 #include "location_service.h"
+#include "spi_arbiter.h"
 
 using namespace spark;
 using namespace particle;
@@ -192,6 +193,17 @@ int LocationService::getLocation(LocationPoint& point) {
     return SYSTEM_ERROR_NONE;
 }
 
+int LocationService::getUtcTime(time_t& epoch) {
+    CHECK_TRUE(gps_, SYSTEM_ERROR_INVALID_STATE);
+
+    WITH_LOCK(*gps_) {
+        CHECK_TRUE(gps_->getLock(), SYSTEM_ERROR_INVALID_STATE);
+        epoch = (time_t)gps_->getUTCTime();
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
 int LocationService::getRadiusThreshold(float& radius) {
     const std::lock_guard<RecursiveMutex> lock(pointMutex_);
     radius = pointThreshold_.radius;
@@ -204,18 +216,17 @@ int LocationService::setRadiusThreshold(float radius) {
     return SYSTEM_ERROR_NONE;
 }
 
-int LocationService::getWayPoint(float& latitude, float& longitude) {
+int LocationService::getWayPoint(double& latitude, double& longitude) {
     const std::lock_guard<RecursiveMutex> lock(pointMutex_);
     CHECK_TRUE(pointThresholdConfigured_, SYSTEM_ERROR_INVALID_STATE);
-    latitude = pointThreshold_.latitude;
-    longitude = pointThreshold_.longitude;
+    latitude = pointThreshold_.frame.origin().latitude / 1e6;
+    longitude = pointThreshold_.frame.origin().longitude / 1e6;
     return SYSTEM_ERROR_NONE;
 }
 
-int LocationService::setWayPoint(float latitude, float longitude) {
+int LocationService::setWayPoint(double latitude, double longitude) {
     const std::lock_guard<RecursiveMutex> lock(pointMutex_);
-    pointThreshold_.latitude = latitude;
-    pointThreshold_.longitude = longitude;
+    pointThreshold_.frame.setOrigin(geoPoint(latitude, longitude));
     pointThresholdConfigured_ = true;
     return SYSTEM_ERROR_NONE;
 }
@@ -228,32 +239,19 @@ int LocationService::getWayPoint(PointThreshold& point) {
 }
 
 int LocationService::getDistance(float& distance, const PointThreshold& wayPoint, const LocationPoint& point) {
-    CHECK_TRUE(gps_, SYSTEM_ERROR_INVALID_STATE);
     CHECK_TRUE(pointThresholdConfigured_, SYSTEM_ERROR_INVALID_STATE);
 
-    distance = fabs(gps_->getDistance(
-        wayPoint.latitude, wayPoint.longitude,
-        point.latitude, point.longitude));
+    distance = wayPoint.frame.distance(geoPoint(point.latitude, point.longitude));
 
     return SYSTEM_ERROR_NONE;
 }
 
 int LocationService::isOutsideRadius(bool& outside, const LocationPoint& point) {
-    CHECK_TRUE(gps_, SYSTEM_ERROR_INVALID_STATE);
-    CHECK_TRUE(pointThresholdConfigured_, SYSTEM_ERROR_INVALID_STATE);
-
+    // The lock is only held to copy the waypoint, measured on its local tangent plane
     PointThreshold current;
-    getWayPoint(current);
+    CHECK(getWayPoint(current));
 
-    float distance = fabs(gps_->getDistance(
-        current.latitude, current.longitude,
-        point.latitude, point.longitude));
-
-    if (distance > current.radius) {
-        outside = true;
-    } else {
-        outside = false;
-    }
+    outside = !current.frame.isWithin(geoPoint(point.latitude, point.longitude), current.radius);
 
     return SYSTEM_ERROR_NONE;
 }
@@ -301,6 +299,8 @@ int LocationService::getStatus(LocationStatus& status) {
 bool LocationService::assertSelect(bool select)
 {
     digitalWrite(selectPin_, (select) ? LOW : HIGH);
+    // The GNSS library owns its SPI transaction, account for its bus time only
+    SpiArbiter::instance().observe(SpiDevice::GNSS, select);
     return true;
 }
 
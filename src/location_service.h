@@ -17,6 +17,7 @@
 #pragma once
 
 #include "Particle.h"
+#include "geo_distance.h"
 
 #include "ubloxGPS.h"
 
@@ -84,8 +85,7 @@ struct LocationPoint {
  */
 struct PointThreshold {
     float radius;
-    double latitude;
-    double longitude;
+    GeoLocalFrame frame;
 };
 
 struct LocationStatus {
@@ -551,6 +551,15 @@ public:
      */
     int getLocation(LocationPoint& point);
 
+    /**
+     * @brief Get the GNSS UTC time without the rest of the location
+     *
+     * @param epoch Returned UTC time in seconds
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE Not locked
+     */
+    int getUtcTime(time_t& epoch);
+
     /**
      * @brief Get the radius threshold for point event triggering
      *
@@ -575,7 +584,7 @@ public:
      * @retval SYSTEM_ERROR_NONE
      * @retval SYSTEM_ERROR_INVALID_STATE
      */
-    int getWayPoint(float& latitude, float& longitude);
+    int getWayPoint(double& latitude, double& longitude);
 
     /**
      * @brief Set the starting point coordinates to compare for radius thresholding
@@ -584,7 +593,7 @@ public:
      * @param longitude Longitude in degrees
      * @retval SYSTEM_ERROR_NONE
      */
-    int setWayPoint(float latitude, float longitude);
+    int setWayPoint(double latitude, double longitude);
 
     /**
      * @brief Get the distance, in meters, between two location points
@@ -18,6 +18,15 @@
 
 #include "tracker_config.h"
 #include "tracker.h"
+#include "vehicle_integrator.h"
+#include "can_scheduler.h"
+#include "uds_client.h"
+#include "vehicle_profile.h"
+#include "spi_arbiter.h"
+#include "mcp2515_fast.h"
+#include "clock_service.h"
+#include "event_stream.h"
+#include "LocationPublish.h"
 
 // Library: MCP_CAN_RK
 #include "mcp_can.h"
@@ -45,27 +54,28 @@ SerialLogHandler logHandler(115200, LOG_LEVEL_TRACE, {
 });
 
 // Various OBD-II (CAN) constants
-const uint8_t SERVICE_CURRENT_DATA = 0x01; // also known as mode 1
-
-// These are the CAN IDs (11-bit) for OBD-II requests to the primary ECU 
-// and the CAN ID for the response. 
-const uint32_t OBD_CAN_REQUEST_ID      = 0x7DF;
-const uint32_t OBD_CAN_REPLY_ID        = 0x7E8;
+// The CAN IDs for OBD-II requests and responses, the bitrate and the idle thresholds come
+// from the active vehicle profile (0x7DF/0x7E8 at 500 kbit/sec when no profile is loaded).
 
 // Note: SAE PID codes are 8 bits. Proprietary ones are 16 bits.
 const uint8_t PID_ENGINE_RPM          = 0x0C;
 const uint8_t PID_VEHICLE_SPEED       = 0x0D;
+const uint8_t PID_MAF_FLOW            = 0x10;
+const uint8_t PID_ENGINE_FUEL_RATE    = 0x5E;
 
-// This is the request we make by OBD-II. It's always the same and requests the engine RPM.
-byte obdRequestRPM[8] = {0x02, SERVICE_CURRENT_DATA, PID_ENGINE_RPM, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc};
-byte obdRequestSPEED[8] = {0x02, SERVICE_CURRENT_DATA, PID_VEHICLE_SPEED, 0x55, 0x55, 0x55, 0x55, 0x55};
-
-// How often to request the data by CAN in milliseconds
+// How often to sample the data for the engine stats in milliseconds. The requests
+// themselves are issued by the CanScheduler at the same rates.
 unsigned long requestRpmLastMillis = 0;
 unsigned long requestSpeedLastMillis = 0;
+unsigned long requestFuelLastMillis = 0;
 
 const unsigned long requestRpmPeriod = 200; // in milliseconds (5 times per second)
 const unsigned long requestSpeedPeriod = 200; // in milliseconds (5 times per second)
+const unsigned long requestFuelPeriod = 1000; // in milliseconds (once per second)
+
+// Not every vehicle supports the engine fuel rate PID.  After this many unanswered
+// requests fall back to mass air flow with a stoichiometric conversion.
+const int fuelRateMaxMisses = 5;
 
 // Various engine stats that we maintain
 int lastRPM = 0, lastSPEED = 0;
@@ -77,6 +87,17 @@ int nonIdleSumRPM = 0, nonIdleSumSPEED = 0;
 int nonIdleMinRPM = 0, nonIdleMinSPEED = 0;
 int nonIdleMaxRPM = 0, nonIdleMaxSPEED = 0;
 
+// Distance and fuel integration, per publish window and per trip (ignition on to off)
+VehicleIntegrator integrator;
+bool fuelRateReplied = false;
+bool fuelRateSupported = false;
+int fuelRateMisses = 0;
+int fuelRateRequest = -1;
+int mafRequest = -1;
+
+// Bitrate the CAN controller is currently configured for
+uint32_t canBitrate = 0;
+
 // Last ignition signal
 bool lastIgnition = false;
 
@@ -104,6 +125,11 @@ int idleSPEED = 10; // 10 km/h
 MCP_CAN canInterface(CAN_CS, SPI1);   
 
 void myLocationGenerationCallback(JSONWriter &writer, LocationPoint &point, const void *context); // Forward declaration
+void myLocationCommitCallback(const void *context); // Forward declaration
+void addObdRequests(); // Forward declaration
+void beginCan(uint32_t bitrate); // Forward declaration
+byte setCanMode(byte mode); // Forward declaration
+void onVehicleProfile(const VehicleProfileData& profile); // Forward declaration
 
 void setup()
 {
@@ -115,7 +141,7 @@ void setup()
     Tracker::instance().init();
 
     // Callback to add key press information to the location publish
-    Tracker::instance().location.regLocGenCallback(myLocationGenerationCallback);
+    Tracker::instance().location.regLocGenCallback(myLocationGenerationCallback, nullptr, myLocationCommitCallback);
 
     // Set up configuration settings
     static ConfigObject engineDesc("engine", {
@@ -140,8 +166,11 @@ void setup()
     pinMode(CAN_STBY, OUTPUT);
     digitalWrite(CAN_STBY, LOW);
 
-    // Enable the CAN interrupt pin as an input just in case
+    // Enable the CAN interrupt pin as an input and timestamp frames on its falling edge.  The
+    // clock is created first so that the interrupt handler never allocates it or its timers.
+    ClockService::instance();
     pinMode(CAN_INT, INPUT);
+    Mcp2515Fast::instance().attachInterrupt(CAN_INT);
 
     // Hardware reset the CAN controller. Not really necessary, but doesn't hurt.
     pinMode(CAN_RST, OUTPUT);
@@ -149,19 +178,33 @@ void setup()
     delay(100);
     digitalWrite(CAN_RST, HIGH);
 
-    // Most vehicles use 500 kbit/sec for OBD-II 
-    // Make sure the last parameter is MCP_20MHZ; this is dependent on the crystal
-    // connected to the CAN chip and it's 20 MHz on the Tracker SoM.
-    byte status = canInterface.begin(MCP_SIDL, CAN_500KBPS, MCP_20MHZ);
-    if(status == CAN_OK) {
-        Log.info("CAN initialization succeeded");
-    }
-    else {
-        Log.error("CAN initialization failed %d", status);
+    // OBD-II PIDs and UDS DIDs share one request scheduler
+    CanScheduler::instance().begin([](uint32_t id, bool extended, const uint8_t* data, uint8_t len) {
+        CanFrame frame {};
+        frame.id = id;
+        frame.extended = extended;
+        frame.len = len;
+        memcpy(frame.data, data, std::min<size_t>(len, sizeof(frame.data)));
+        return Mcp2515Fast::instance().sendFrame(frame);
+    });
+
+    // Load the profile of the vehicle this device was last installed in
+    VehicleProfile::instance().init();
+    VehicleProfile::instance().regChangeCallback(onVehicleProfile);
+    auto& profile = VehicleProfile::instance().get();
+    if (profile.id) {
+        idleRPM = profile.idleRpm;
+        idleSPEED = profile.idleSpeed;
     }
 
+    beginCan(profile.bitrate);
+
     // Change to Sleep mode
-    canInterface.setMode(MCP_MODE_SLEEP);   
+    setCanMode(MCP_MODE_SLEEP);
+
+    addObdRequests();
+    UdsClient::instance().init();
+    EventStream::instance().init();
 
     // Connect to the cloud!
     Particle.connect();
@@ -184,14 +227,27 @@ void loop()
         // update lastIgnitionOnMillis
         lastIgnitionOnMillis = millis();
         // change state to normal mode
-        canInterface.setMode(MCP_MODE_NORMAL);
+        setCanMode(MCP_MODE_NORMAL);
+        // start a new trip and probe for fuel rate support again
+        integrator.resetTrip();
+        fuelRateSupported = false;
+        fuelRateMisses = 0;
+        CanScheduler::instance().setEnabled(fuelRateRequest, true);
+        CanScheduler::instance().setEnabled(mafRequest, fuelRateRequest < 0);
+        // the vehicle may have been swapped while off
+        VehicleProfile::instance().requestVin();
+        EventStream::instance().post("ign", 1.0f, ClockService::instance().nowUs());
     } 
     // on to off signal
     else if (lastIgnition != ignition) {
         // update lastIgnitionOffMillis
         lastIgnitionOffMillis = millis();
         // go back to sleep mode!
-        canInterface.setMode(MCP_MODE_SLEEP);
+        setCanMode(MCP_MODE_SLEEP);
+        // close the trip and publish its totals
+        integrator.interrupt();
+        Tracker::instance().location.triggerLocPub(Trigger::NORMAL, "trip_end");
+        EventStream::instance().post("ign", 0.0f, ClockService::instance().nowUs());
     }
 
     // update lastIgnition
@@ -212,32 +268,29 @@ void loop()
 
     // Handle received CAN data
     if (!digitalRead(CAN_INT)) {
-        long unsigned int rxId;
-        unsigned char len = 0;
-        unsigned char rxBuf[8];
-
-        canInterface.readMsgBufID(&rxId, &len, rxBuf);      // Read data: len = data length, buf = data byte(s)
-        
-        if ((rxId & 0x80000000) == 0x00000000) {
-            // Standard frame 
-            // Log.info("%.3lx: %02x %02x %02x %02x %02x %02x ", rxId, rxBuf[0], rxBuf[1], rxBuf[2], rxBuf[3], rxBuf[4],rxBuf[5]  );            
-            if (rxId == OBD_CAN_REPLY_ID && rxBuf[0] == 0x04 && rxBuf[1] == 0x41 && rxBuf[2] == PID_ENGINE_RPM) {
-                lastRPM = (rxBuf[3] << 8) | rxBuf[4];
-                lastRPM /= 4;
-                // Log.info("rpm=%d", lastRPM);
-                // We don't process the RPM here, it's done below (with an explanation why)
-            }
-
-            else if (rxId == OBD_CAN_REPLY_ID && rxBuf[0] == 0x03 && rxBuf[1] == 0x41 && rxBuf[2] == PID_VEHICLE_SPEED) {
-                lastSPEED = rxBuf[3];
-                // Log.info("speed=%d", lastSPEED);
-                // We don't process the SPEED here, it's done below (with an explanation why)
+        // Both receive buffers are drained in one hold of the bus
+        CanFrame frames[MCP2515_RX_BUFFERS];
+        int count = Mcp2515Fast::instance().readFrames(frames, MCP2515_RX_BUFFERS);
+
+        for (int i = 0; i < count; i++) {
+            auto& frame = frames[i];
+            // Responses are decoded by the callbacks registered with the scheduler
+            if (!CanScheduler::instance().onFrame(frame.id, frame.extended, frame.data, frame.len, frame.timestamp)) {
+                // Not a diagnostic response, may be a broadcast signal described by the profile
+                VehicleProfile::instance().onFrame(frame.id, frame.extended, frame.data, frame.len, frame.timestamp);
             }
         }
-
     }
 
-    // Request RPM reading
+    // Send requests once the vehicle has been on for a while
+    bool requesting = ignition && (millis() - lastIgnitionOnMillis) >= REQUEST_WAIT_POWER_ON;
+    CanScheduler::instance().setActive(requesting);
+    CanScheduler::instance().loop();
+    VehicleProfile::instance().loop();
+    UdsClient::instance().loop();
+    EventStream::instance().loop();
+
+    // Sample RPM reading
     if (millis() - requestRpmLastMillis >= requestRpmPeriod) {
         requestRpmLastMillis = millis();
         
@@ -268,27 +321,9 @@ void loop()
         // Clear lastRPM so if the transmission fails we can record it as off on the
         // next check
         lastRPM = 0;
-
-        // This flag prevents the error log from overflowing from thousands of error
-        // messages when the vehicle is off
-        static bool errorFlag = false;
-
-        // Send a request for engine RPM via OBD-II (CAN)
-        if (ignition && (millis() - lastIgnitionOnMillis) >= REQUEST_WAIT_POWER_ON) {
-            byte sndStat = canInterface.sendMsgBuf(OBD_CAN_REQUEST_ID, 0, 8, obdRequestRPM);
-            if(sndStat == CAN_OK) {
-                errorFlag = false;
-            }
-            else {
-                if (!errorFlag) {
-                    Log.error("Error Sending Message %d", sndStat);
-                    errorFlag = true;
-                }
-            }
-        }
     }
 
-    // Request SPEED reading
+    // Sample SPEED reading
     if (millis() - requestSpeedLastMillis >= requestSpeedPeriod) {
         requestSpeedLastMillis = millis();
         
@@ -320,24 +355,25 @@ void loop()
         // Clear lastSPEED so if the transmission fails we can record it as off on the
         // next check
         lastSPEED = 0;
+    }
 
-        // This flag prevents the error log from overflowing from thousands of error
-        // messages when the vehicle is off
-        static bool errorFlag = false;
+    // Choose fuel rate, or mass air flow when fuel rate is not supported by the vehicle
+    if (millis() - requestFuelLastMillis >= requestFuelPeriod) {
+        requestFuelLastMillis = millis();
 
-        // Send a request for engine RPM via OBD-II (CAN)
-        if (ignition && (millis() - lastIgnitionOnMillis) >= REQUEST_WAIT_POWER_ON) {
-            byte sndStat = canInterface.sendMsgBuf(OBD_CAN_REQUEST_ID, 0, 8, obdRequestSPEED);
-            if(sndStat == CAN_OK) {
-                errorFlag = false;
-            }
-            else {
-                if (!errorFlag) {
-                    Log.error("Error Sending Message %d", sndStat);
-                    errorFlag = true;
-                }
-            }
+        if (fuelRateReplied) {
+            fuelRateSupported = true;
+            fuelRateMisses = 0;
         }
+        else if (requesting && !fuelRateSupported && fuelRateMisses < fuelRateMaxMisses) {
+            fuelRateMisses++;
+        }
+        fuelRateReplied = false;
+
+        // Switch to mass air flow once fuel rate is known to be unsupported
+        bool useMaf = (fuelRateRequest < 0) || (!fuelRateSupported && fuelRateMisses >= fuelRateMaxMisses);
+        CanScheduler::instance().setEnabled(fuelRateRequest, !useMaf);
+        CanScheduler::instance().setEnabled(mafRequest, useMaf);
     }
 
     // Print engine info to the serial log to help with debugging
@@ -360,6 +396,31 @@ void loop()
             (int)(nonIdleSamplesSPEED * requestSpeedPeriod / 1000),
             nonIdleMinSPEED, nonIdleSpeedMean, nonIdleMaxSPEED
         );
+
+        auto window = integrator.getWindow();
+        Log.info("FUEL: distance=%lu fuel=%lu source=%d",
+            window.distanceM, window.fuelMl, (int)window.fuelSource);
+
+        // SPI cost of moving frames through the controller
+        auto can = Mcp2515Fast::instance().getStats(true);
+        Log.info("CAN: rxFrames/sec=%lu rxSpi/frame=%.2f txFrames=%lu txSpi/frame=%.2f txBusy=%lu",
+            can.rxFrames * 1000 / engineLogPeriod,
+            can.rxFrames ? (double)can.rxTransactions / can.rxFrames : 0.0,
+            can.txFrames,
+            can.txFrames ? (double)can.txTransactions / can.txFrames : 0.0,
+            can.txBusy);
+
+        LocationPublishStats pub;
+        LocationPublish::instance().getStats(pub, true);
+        Log.info("PUB: publishes=%lu noSlot=%lu tooLarge=%lu peakSlots=%u/%u drained=%lu merged=%lu ackMs=%lu window=%u compactions=%lu thinned=%lu lanes=%u/%u drainedPri=%lu",
+            pub.publishes, pub.noSlot, pub.tooLarge, pub.peakSlots, LOCATION_PUBLISH_SLOTS,
+            pub.drained, pub.merged, pub.ackMs, pub.window, pub.compactions, pub.thinned,
+            pub.priorityDepth, pub.periodicDepth, pub.drainedPriority);
+
+        ClockServiceStats clock;
+        ClockService::instance().getStats(clock);
+        Log.info("CLK: synced=%d edges=%lu failedBursts=%lu",
+            ClockService::instance().isSynced(), clock.edges, clock.failedBursts);
     }
 
     // idleRPM is a setting configured from the cloud side 
@@ -377,6 +438,123 @@ void loop()
 
 }
 
+// Get the request period of a PID, 0 when the vehicle profile says it is not supported
+system_tick_t pidPeriod(const VehicleProfileData& profile, uint8_t pid, system_tick_t period)
+{
+    if (!profile.pidCount) {
+        return period;
+    }
+    for (size_t i = 0; i < profile.pidCount; i++) {
+        if (profile.pids[i].pid == pid) {
+            return profile.pids[i].period ? profile.pids[i].period : period;
+        }
+    }
+    return 0;
+}
+
+void beginCan(uint32_t bitrate)
+{
+    byte speed;
+    switch (bitrate) {
+        case 125000: speed = CAN_125KBPS; break;
+        case 250000: speed = CAN_250KBPS; break;
+        case 1000000: speed = CAN_1000KBPS; break;
+        default: speed = CAN_500KBPS; bitrate = 500000; break;
+    }
+
+    // Make sure the last parameter is MCP_20MHZ; this is dependent on the crystal
+    // connected to the CAN chip and it's 20 MHz on the Tracker SoM.
+    SpiArbiter::instance().acquire(SpiDevice::CAN);
+    byte status = canInterface.begin(MCP_SIDL, speed, MCP_20MHZ);
+    SpiArbiter::instance().release(SpiDevice::CAN);
+    if(status == CAN_OK) {
+        Log.info("CAN initialization succeeded (%lu bit/sec)", bitrate);
+        canBitrate = bitrate;
+    }
+    else {
+        Log.error("CAN initialization failed %d", status);
+    }
+}
+
+byte setCanMode(byte mode)
+{
+    SpiArbiterLock lock(SpiDevice::CAN, SpiPriority::BACKGROUND);
+    return canInterface.setMode(mode);
+}
+
+void onVehicleProfile(const VehicleProfileData& profile)
+{
+    idleRPM = profile.idleRpm;
+    idleSPEED = profile.idleSpeed;
+
+    if (profile.bitrate != canBitrate) {
+        beginCan(profile.bitrate);
+        setCanMode(lastIgnition ? MCP_MODE_NORMAL : MCP_MODE_SLEEP);
+    }
+
+    addObdRequests();
+}
+
+void addObdRequests()
+{
+    auto& profile = VehicleProfile::instance().get();
+    auto& scheduler = CanScheduler::instance();
+    scheduler.remove(CanRequestType::OBD_PID);
+
+    CanRequest request {};
+    request.type = CanRequestType::OBD_PID;
+    request.txId = profile.obdTx;
+    request.rxId = profile.obdRx;
+    request.extended = profile.extended;
+    request.enabled = true;
+
+    request.id = PID_ENGINE_RPM;
+    request.period = pidPeriod(profile, PID_ENGINE_RPM, requestRpmPeriod);
+    request.callback = [](const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp) {
+        if (len >= 2) {
+            lastRPM = (data[0] << 8) | data[1];
+            lastRPM /= 4;
+            // We don't process the RPM here, it's done in the loop (with an explanation why)
+        }
+    };
+    if (request.period) {
+        scheduler.add(request);
+    }
+
+    request.id = PID_VEHICLE_SPEED;
+    request.period = pidPeriod(profile, PID_VEHICLE_SPEED, requestSpeedPeriod);
+    request.callback = [](const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp) {
+        if (len >= 1) {
+            lastSPEED = data[0];
+            integrator.addSpeed(timestamp, lastSPEED);
+        }
+    };
+    if (request.period) {
+        scheduler.add(request);
+    }
+
+    request.id = PID_ENGINE_FUEL_RATE;
+    request.period = pidPeriod(profile, PID_ENGINE_FUEL_RATE, requestFuelPeriod);
+    request.callback = [](const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp) {
+        if (len >= 2) {
+            fuelRateReplied = true;
+            integrator.addFuelRate(timestamp, (data[0] << 8) | data[1]);
+        }
+    };
+    fuelRateRequest = request.period ? scheduler.add(request) : -1;
+
+    request.id = PID_MAF_FLOW;
+    request.period = pidPeriod(profile, PID_MAF_FLOW, requestFuelPeriod);
+    // MAF is only requested once fuel rate turns out to be unsupported
+    request.enabled = (fuelRateRequest < 0);
+    request.callback = [](const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp) {
+        if (len >= 2) {
+            integrator.addMaf(timestamp, (data[0] << 8) | data[1]);
+        }
+    };
+    mafRequest = request.period ? scheduler.add(request) : -1;
+}
+
 void myLocationGenerationCallback(JSONWriter &writer, LocationPoint &point, const void *context)
 {
     int nonIdleRpmMean = nonIdleSamplesRPM ? (nonIdleSumRPM / nonIdleSamplesRPM) : 0;
@@ -394,7 +572,29 @@ void myLocationGenerationCallback(JSONWriter &writer, LocationPoint &point, cons
     writer.name("engineSpeedMean").value(nonIdleSpeedMean);
     writer.name("engineSpeedMax").value(nonIdleMaxSPEED);
 
-    // reset stats
+    // distance in meters and fuel in milliliters for this publish window and the current trip
+    auto window = integrator.getWindow();
+    auto trip = integrator.getTrip();
+    writer.name("engineDist").value((unsigned int)window.distanceM);
+    writer.name("engineFuel").value((unsigned int)window.fuelMl);
+    writer.name("tripDist").value((unsigned int)trip.distanceM);
+    writer.name("tripFuel").value((unsigned int)trip.fuelMl);
+    if (trip.fuelSource != VehicleFuelSource::NONE) {
+        writer.name("tripFuelSrc").value((trip.fuelSource == VehicleFuelSource::FUEL_RATE) ? "rate" : "maf");
+    }
+
+    // UTC time of the first and last samples of the trip, once the clock is synced to GNSS
+    auto tripStart = ClockService::instance().toUtcUs(trip.firstUs);
+    auto tripEnd = ClockService::instance().toUtcUs(trip.lastUs);
+    if (trip.firstUs && tripStart) {
+        writer.name("tripStart").value((double)tripStart / 1000000.0, 3);
+        writer.name("tripEnd").value((double)tripEnd / 1000000.0, 3);
+    }
+}
+
+void myLocationCommitCallback(const void *context)
+{
+    // reset stats once they are in the publish, otherwise they carry into the next one
     numSamplesRPM = numSamplesSPEED = 0;
     offSamplesRPM = offSamplesSPEED= 0;
     idleSamplesRPM = idleSamplesSPEED = 0;
@@ -402,5 +602,6 @@ void myLocationGenerationCallback(JSONWriter &writer, LocationPoint &point, cons
     nonIdleSumRPM = nonIdleSumSPEED = 0;
     nonIdleMinRPM = nonIdleMinSPEED= 0;
     nonIdleMaxRPM = nonIdleMaxSPEED = 0;
+    integrator.resetWindow();
 }
 
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mcp2515_fast.h"
+
+Mcp2515Fast *Mcp2515Fast::_instance = nullptr;
+
+// SPI instructions
+constexpr uint8_t InstructionReadStatus = 0xA0;
+constexpr uint8_t InstructionReadRxBuffer = 0x90;   // | 0x04 for RXB1, starting at RXBnSIDH
+constexpr uint8_t InstructionLoadTxBuffer = 0x40;   // | (n << 1), starting at TXBnSIDH
+constexpr uint8_t InstructionRequestToSend = 0x80;  // | (1 << n)
+
+// READ STATUS bits
+constexpr uint8_t StatusRx0If = 0x01;
+constexpr uint8_t StatusRx1If = 0x02;
+constexpr uint8_t StatusTx0Req = 0x04;              // TXnREQ is at 0x04 << (n * 2)
+
+// SIDL and DLC register bits
+constexpr uint8_t SidlExide = 0x08;
+constexpr uint8_t SidlSrr = 0x10;
+constexpr uint8_t DlcRtr = 0x40;
+
+// SIDH, SIDL, EID8, EID0, DLC and eight data bytes
+constexpr size_t BufferLength = 13;
+
+Mcp2515Fast::Mcp2515Fast() :
+    _edgeValid(false),
+    _edgeUs(0),
+    _rx1Older(false),
+    _stats{} {
+
+}
+
+void Mcp2515Fast::attachInterrupt(pin_t pin) {
+    ::attachInterrupt(pin, &Mcp2515Fast::onInterrupt, FALLING);
+}
+
+void Mcp2515Fast::onInterrupt() {
+    auto& self = instance();
+    if (!self._edgeValid) {
+        self._edgeUs = ClockService::instance().nowUs();
+        self._edgeValid = true;
+    }
+}
+
+uint8_t Mcp2515Fast::readStatus() {
+    // The status byte follows the instruction
+    uint8_t tx[2] = {InstructionReadStatus, 0xff};
+    uint8_t rx[2] = {};
+    SpiArbiter::instance().transferFramed(SpiDevice::CAN, {tx, rx, sizeof(tx)});
+    return rx[1];
+}
+
+int Mcp2515Fast::readFrames(CanFrame* frames, size_t count) {
+    CHECK_TRUE(frames, SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    auto& arbiter = SpiArbiter::instance();
+    // Draining the controller is latency critical, it only has two receive buffers
+    CHECK(arbiter.beginTransaction(SpiDevice::CAN, SpiPriority::REALTIME));
+
+    uint8_t status = readStatus() & (StatusRx0If | StatusRx1If);
+    uint32_t transactions = 1;
+    size_t read = 0;
+
+    uint64_t readUs = ClockService::instance().nowUs();
+    uint64_t edgeUs = readUs;
+    ATOMIC_BLOCK() {
+        if (_edgeValid) {
+            edgeUs = _edgeUs;
+            _edgeValid = false;
+        }
+    }
+
+    // Rollover moves a frame into RXB1 only while RXB0 is full.  Once RXB0 is read it may
+    // refill with a newer frame than the one left in RXB1, so whether RXB1 holds the older
+    // frame is carried from the last read of either buffer.
+    while (status && (read < count)) {
+        size_t buffer = ((status & StatusRx1If) && (_rx1Older || !(status & StatusRx0If))) ? 1 : 0;
+
+        uint8_t tx[1 + BufferLength];
+        uint8_t rx[1 + BufferLength];
+        memset(tx, 0xff, sizeof(tx));
+        tx[0] = InstructionReadRxBuffer | (buffer << 2);
+        // RXnIF is cleared when chip select is raised
+        arbiter.transferFramed(SpiDevice::CAN, {tx, rx, sizeof(tx)});
+        transactions++;
+
+        const uint8_t* regs = rx + 1;
+        auto& frame = frames[read++];
+        uint32_t id = ((uint32_t)regs[0] << 3) | (regs[1] >> 5);
+        if (regs[1] & SidlExide) {
+            frame.id = (id << 18) | ((uint32_t)(regs[1] & 0x03) << 16) | ((uint32_t)regs[2] << 8) | regs[3];
+            frame.extended = true;
+            frame.remote = (regs[4] & DlcRtr) != 0;
+        }
+        else {
+            frame.id = id;
+            frame.extended = false;
+            frame.remote = (regs[1] & SidlSrr) != 0;
+        }
+        frame.len = std::min<uint8_t>(regs[4] & 0x0F, sizeof(frame.data));
+        memcpy(frame.data, regs + 5, frame.len);
+        frame.timestamp = (read == 1) ? edgeUs : readUs;
+
+        if (buffer == 1) {
+            // Anything in RXB0 arrived before RXB1 could fill again
+            _rx1Older = false;
+            status &= ~StatusRx1If;
+        }
+        else if (status & StatusRx1If) {
+            // RXB1 filled while RXB0 was full
+            _rx1Older = true;
+            status &= ~StatusRx0If;
+        }
+        else {
+            // A frame that reached RXB1 before RXB0 was freed is older than anything RXB0
+            // receives next.  Refilling RXB0 and then RXB1 takes two frame times, far longer
+            // than this status read, so a pending RXB1 is always the older one.
+            status = readStatus() & (StatusRx0If | StatusRx1If);
+            transactions++;
+            _rx1Older = (status & StatusRx1If) != 0;
+        }
+    }
+
+    arbiter.endTransaction(SpiDevice::CAN);
+
+    _mutex.lock();
+    _stats.rxFrames += read;
+    _stats.rxTransactions += transactions;
+    _mutex.unlock();
+
+    return (int)read;
+}
+
+int Mcp2515Fast::sendFrame(const CanFrame& frame) {
+    CHECK_TRUE(frame.len <= sizeof(frame.data), SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    uint8_t tx[1 + BufferLength];
+    memset(tx, 0, sizeof(tx));
+    uint8_t* regs = tx + 1;
+    if (frame.extended) {
+        regs[0] = (uint8_t)(frame.id >> 21);
+        regs[1] = (uint8_t)(((frame.id >> 13) & 0xE0) | SidlExide | ((frame.id >> 16) & 0x03));
+        regs[2] = (uint8_t)(frame.id >> 8);
+        regs[3] = (uint8_t)frame.id;
+    }
+    else {
+        regs[0] = (uint8_t)(frame.id >> 3);
+        regs[1] = (uint8_t)((frame.id & 0x07) << 5);
+    }
+    regs[4] = frame.len | (frame.remote ? DlcRtr : 0);
+    memcpy(regs + 5, frame.data, frame.len);
+
+    auto& arbiter = SpiArbiter::instance();
+    CHECK(arbiter.beginTransaction(SpiDevice::CAN, SpiPriority::BACKGROUND));
+
+    uint8_t status = readStatus();
+    uint32_t transactions = 1;
+    int buffer = -1;
+    for (size_t i = 0; i < MCP2515_TX_BUFFERS; i++) {
+        if (!(status & (StatusTx0Req << (i * 2)))) {
+            buffer = (int)i;
+            break;
+        }
+    }
+
+    if (buffer >= 0) {
+        tx[0] = InstructionLoadTxBuffer | (buffer << 1);
+        arbiter.transferFramed(SpiDevice::CAN, {tx, nullptr, sizeof(tx)});
+        uint8_t rts = InstructionRequestToSend | (1 << buffer);
+        arbiter.transferFramed(SpiDevice::CAN, {&rts, nullptr, 1});
+        transactions += 2;
+    }
+
+    arbiter.endTransaction(SpiDevice::CAN);
+
+    _mutex.lock();
+    _stats.txTransactions += transactions;
+    if (buffer >= 0) {
+        _stats.txFrames++;
+    }
+    else {
+        _stats.txBusy++;
+    }
+    _mutex.unlock();
+
+    return (buffer >= 0) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_BUSY;
+}
+
+Mcp2515FastStats Mcp2515Fast::getStats(bool reset) {
+    _mutex.lock();
+    auto stats = _stats;
+    if (reset) {
+        _stats = {};
+    }
+    _mutex.unlock();
+
+    return stats;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "spi_arbiter.h"
+#include "clock_service.h"
+
+// Number of receive buffers in the MCP2515
+constexpr size_t MCP2515_RX_BUFFERS {2};
+
+// Number of transmit buffers in the MCP2515
+constexpr size_t MCP2515_TX_BUFFERS {3};
+
+/**
+ * @brief A classic CAN frame
+ *
+ */
+struct CanFrame {
+    uint32_t id;                    /**< 11 or 29 bit identifier */
+    bool extended;                  /**< Identifier is 29 bits */
+    bool remote;                    /**< Remote transmission request */
+    uint8_t len;                    /**< Data length, 0 to 8 */
+    uint8_t data[8];                /**< Data bytes */
+    uint64_t timestamp;             /**< Monotonic reception time in microseconds, see ClockService */
+};
+
+/**
+ * @brief SPI cost of the fast path
+ *
+ */
+struct Mcp2515FastStats {
+    uint32_t rxFrames;              /**< Frames received */
+    uint32_t rxTransactions;        /**< Chip select frames spent receiving */
+    uint32_t txFrames;              /**< Frames queued for transmission */
+    uint32_t txTransactions;        /**< Chip select frames spent transmitting */
+    uint32_t txBusy;                /**< Sends refused because every transmit buffer was pending */
+};
+
+/**
+ * @brief Fast receive and transmit paths for the MCP2515 CAN controller
+ *
+ * @details The CAN library is still used to configure the controller.  Frames are moved with
+ * the dedicated SPI instructions instead of register accesses: READ STATUS returns every
+ * receive and transmit flag in one byte, READ RX BUFFER returns identifier, DLC and data in
+ * one burst and clears the receive flag when chip select is raised, and LOAD TX BUFFER
+ * followed by RTS queues a frame without touching TXBnCTRL.  A received frame costs one
+ * READ RX BUFFER plus at most two READ STATUS, the second telling whether a frame rolled
+ * over into RXB1 before RXB0 was freed, all within a single hold of the SPI arbiter.
+ */
+class Mcp2515Fast {
+public:
+    /**
+     * @brief Singleton class instance access for Mcp2515Fast
+     *
+     * @return Mcp2515Fast&
+     */
+    static Mcp2515Fast &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new Mcp2515Fast();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Timestamp received frames at the falling edge of the controller interrupt
+     *
+     * @param pin Interrupt pin, active low
+     */
+    void attachInterrupt(pin_t pin);
+
+    /**
+     * @brief Read every pending frame, oldest first
+     *
+     * @details The oldest frame is stamped with the time of the interrupt edge that announced
+     * it.  Frames that arrived while the interrupt was already asserted have no edge of their
+     * own and are stamped with the time they were read.
+     *
+     * @param frames Buffer for the frames
+     * @param count Size of the buffer, MCP2515_RX_BUFFERS reads everything pending
+     * @return Number of frames read, or a negative system error
+     */
+    int readFrames(CanFrame* frames, size_t count);
+
+    /**
+     * @brief Queue a frame in a free transmit buffer and request its transmission
+     *
+     * @details Does not wait for the frame to be sent.
+     *
+     * @param frame Frame to send
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_BUSY every transmit buffer is pending
+     * @retval SYSTEM_ERROR_INVALID_ARGUMENT
+     */
+    int sendFrame(const CanFrame& frame);
+
+    /**
+     * @brief Get the SPI cost statistics
+     *
+     * @param reset Clear the statistics after reading them
+     * @return Mcp2515FastStats
+     */
+    Mcp2515FastStats getStats(bool reset = false);
+
+private:
+    Mcp2515Fast();
+
+    uint8_t readStatus();
+    static void onInterrupt();
+
+    Mutex _mutex;
+    volatile bool _edgeValid;
+    volatile uint64_t _edgeUs;
+    bool _rx1Older;                 // the frame in RXB1 predates the one in RXB0
+    Mcp2515FastStats _stats;
+
+    static Mcp2515Fast *_instance;
+};
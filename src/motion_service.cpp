@@ -18,6 +18,7 @@
 #include "tracker_config.h"
 #include "motion_service.h"
 #include "bmi160.h"
+#include "spi_arbiter.h"
 
 using namespace spark;
 using namespace particle;
@@ -98,6 +99,11 @@ int MotionService::start(size_t eventDepth) {
         return ret;
     }
 
+    // Share SPI1 with the other devices through the arbiter
+    BMI160.setSpiTransferHook([](uint8_t header, const uint8_t* tx, uint8_t* rx, size_t length) {
+        return SpiArbiter::instance().transfer(SpiDevice::IMU, header, tx, rx, length);
+    });
+
     // Clear all configuration to defaults
     BMI160.reset();
     awakeFlags_ = MOTION_AWAKE_NONE;
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "publish_latency.h"
+#include "json_sizing.h"
+
+PublishLatency *PublishLatency::_instance = nullptr;
+
+static const char* const ReasonNames[] = {"none", "time", "trig", "imm"};
+static const char* const NetworkNames[] = {"on", "off"};
+
+// Room kept in the report for ,"drop":<count>
+constexpr size_t ReportDropSize = 20;
+
+static system_tick_t bucketBound(size_t bucket) {
+    return PUBLISH_LATENCY_FIRST_BUCKET_MS << bucket;
+}
+
+void LatencyHistogram::add(system_tick_t ms) {
+    size_t bucket = 0;
+    while ((bucket < PUBLISH_LATENCY_BUCKETS - 1) && (ms > bucketBound(bucket))) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    totalMs += ms;
+    if (ms > maxMs) {
+        maxMs = ms;
+    }
+}
+
+system_tick_t LatencyHistogram::percentile(unsigned percent) const {
+    if (!count) {
+        return 0;
+    }
+
+    uint32_t target = std::max<uint32_t>(1, ((uint64_t)count * percent + 99) / 100);
+    uint32_t seen = 0;
+    for (size_t bucket = 0; bucket < PUBLISH_LATENCY_BUCKETS - 1; bucket++) {
+        seen += buckets[bucket];
+        if (seen >= target) {
+            return std::min<system_tick_t>(bucketBound(bucket), maxMs);
+        }
+    }
+    return maxMs;
+}
+
+PublishLatency::PublishLatency() :
+    _dimensions{},
+    _heartbeat{},
+    _active(false),
+    _reason(PublishReason::NONE),
+    _network(LatencyNetwork::CONNECTED),
+    _startMs(0),
+    _sentMs(0),
+    _context(nullptr),
+    _published(false),
+    _publishedMs(0) {
+
+}
+
+void PublishLatency::init() {
+    CloudService::instance().regCommandCallback("get_latency", &PublishLatency::get_latency_cb, this);
+}
+
+void PublishLatency::begin(PublishReason reason) {
+    if (_active) {
+        _dimensions[(size_t)_reason][(size_t)_network].abandoned++;
+        _heartbeat.abandoned++;
+    }
+    _active = true;
+    _reason = reason;
+    _network = Particle.connected() ? LatencyNetwork::CONNECTED : LatencyNetwork::DISCONNECTED;
+    _startMs = millis();
+    _context = nullptr;
+    _published = false;
+}
+
+void PublishLatency::sent(const void* context) {
+    if (!_active) {
+        return;
+    }
+
+    _sentMs = millis();
+    auto build = _sentMs - _startMs;
+    _dimensions[(size_t)_reason][(size_t)_network].stages[(size_t)LatencyStage::BUILD].add(build);
+    _heartbeat.build.add(build);
+    _context = context;
+}
+
+void PublishLatency::published(const void* context) {
+    if (context && (context == _context.load())) {
+        _publishedMs = millis();
+        _published = true;
+    }
+}
+
+void PublishLatency::end(CloudServiceStatus status, const void* context) {
+    if (!_active || (context != _context.load())) {
+        return;
+    }
+    _active = false;
+    _context = nullptr;
+
+    auto& dimension = _dimensions[(size_t)_reason][(size_t)_network];
+    if (_published.exchange(false)) {
+        dimension.stages[(size_t)LatencyStage::PUBLISH].add(_publishedMs - _sentMs);
+    }
+
+    switch (status) {
+        case CloudServiceStatus::SUCCESS: {
+            auto ack = millis() - _sentMs;
+            dimension.stages[(size_t)LatencyStage::ACK].add(ack);
+            _heartbeat.ack.add(ack);
+            break;
+        }
+
+        case CloudServiceStatus::TIMEOUT:
+            dimension.timeouts++;
+            _heartbeat.timeouts++;
+            break;
+
+        default:
+            dimension.failures++;
+            _heartbeat.failures++;
+            break;
+    }
+}
+
+void PublishLatency::getHeartbeat(PublishLatencyHeartbeat& heartbeat, bool reset) {
+    heartbeat = _heartbeat;
+    if (reset) {
+        _heartbeat = {};
+    }
+}
+
+void PublishLatency::clear() {
+    for (auto& reason : _dimensions) {
+        for (auto& dimension : reason) {
+            dimension = {};
+        }
+    }
+}
+
+// Each reason and connection with samples is reported as
+// [reason, network, failures, timeouts, abandoned, build, publish, ack], each stage being
+// [count, total, max, [buckets]] without the trailing empty buckets, or 0 without samples
+int PublishLatency::report() {
+    CloudService &cloud_service = CloudService::instance();
+    cloud_service.lock();
+
+    cloud_service.beginCommand("latency");
+    auto& writer = cloud_service.writer();
+
+    writer.name("bounds").beginArray();
+    for (size_t bucket = 0; bucket < PUBLISH_LATENCY_BUCKETS - 1; bucket++) {
+        writer.value((unsigned int)bucketBound(bucket));
+    }
+    writer.endArray();
+
+    unsigned int dropped = 0;
+    writer.name("hist").beginArray();
+    for (size_t reason = 0; reason < Reasons; reason++) {
+        for (size_t network = 0; network < Networks; network++) {
+            auto& dimension = _dimensions[reason][network];
+            bool samples = dimension.failures || dimension.timeouts || dimension.abandoned;
+            for (auto& stage : dimension.stages) {
+                samples = samples || stage.count;
+            }
+            if (!samples) {
+                continue;
+            }
+
+            auto writeDimension = [&](JSONWriter& out) {
+                out.beginArray()
+                    .value(ReasonNames[reason])
+                    .value(NetworkNames[network])
+                    .value((unsigned int)dimension.failures)
+                    .value((unsigned int)dimension.timeouts)
+                    .value((unsigned int)dimension.abandoned);
+                for (auto& stage : dimension.stages) {
+                    if (!stage.count) {
+                        out.value(0);
+                        continue;
+                    }
+                    size_t used = PUBLISH_LATENCY_BUCKETS;
+                    while (!stage.buckets[used - 1]) {
+                        used--;
+                    }
+                    out.beginArray()
+                        .value((unsigned int)stage.count)
+                        .value((unsigned int)stage.totalMs)
+                        .value((unsigned int)stage.maxMs)
+                        .beginArray();
+                    for (size_t bucket = 0; bucket < used; bucket++) {
+                        out.value((unsigned int)stage.buckets[bucket]);
+                    }
+                    out.endArray().endArray();
+                }
+                out.endArray();
+            };
+
+            size_t remaining = writer.bufferSize() - 1 /* null */ - writer.dataSize()
+                - cloud_service.estimatedEndCommandSize() - 1 /* ] */ - ReportDropSize;
+            if (jsonElementSize(writeDimension) > remaining) {
+                dropped++;
+                continue;
+            }
+            writeDimension(writer);
+        }
+    }
+    writer.endArray();
+    if (dropped) {
+        writer.name("drop").value(dropped);
+    }
+
+    int ret = cloud_service.send();
+    cloud_service.unlock();
+    return ret;
+}
+
+int PublishLatency::get_latency_cb(CloudServiceStatus status, JSONValue *root, const void *context) {
+    bool reset = false;
+
+    JSONObjectIterator item(*root);
+    while (item.next()) {
+        if (item.name() == "reset") {
+            reset = item.value().toBool();
+        }
+    }
+
+    CHECK(report());
+    if (reset) {
+        clear();
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
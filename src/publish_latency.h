@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "cloud_service.h"
+#include "tracker_location.h"
+
+// Histogram buckets, each bound twice the one before and the last unbounded
+constexpr size_t PUBLISH_LATENCY_BUCKETS {12};
+
+// Upper bound of the first bucket
+constexpr system_tick_t PUBLISH_LATENCY_FIRST_BUCKET_MS {125};
+
+/**
+ * @brief Intervals measured for each location publish
+ *
+ */
+enum class LatencyStage {
+    BUILD,                          /**< Start of building the publish to handing it to CloudService */
+    PUBLISH,                        /**< Handing it to CloudService to BackgroundPublish completing it */
+    ACK,                            /**< Handing it to CloudService to its acknowledgement */
+    COUNT,
+};
+
+/**
+ * @brief Cloud connection when a publish is built
+ *
+ */
+enum class LatencyNetwork {
+    CONNECTED,                      /**< Connected to the cloud */
+    DISCONNECTED,                   /**< Not connected, built for the store or a reconnection */
+    COUNT,
+};
+
+/**
+ * @brief Histogram of latencies in milliseconds
+ *
+ */
+struct LatencyHistogram {
+    uint32_t count;                 /**< Samples */
+    uint32_t totalMs;               /**< Sum of the samples */
+    uint32_t maxMs;                 /**< Longest sample */
+    uint32_t buckets[PUBLISH_LATENCY_BUCKETS]; /**< Samples up to each bucket bound */
+
+    void add(system_tick_t ms);
+
+    /**
+     * @brief Estimate a percentile
+     *
+     * @param percent Percentile from 0 to 100
+     * @return system_tick_t Bound of the bucket holding the percentile, capped at the
+     * longest sample, 0 without samples
+     */
+    system_tick_t percentile(unsigned percent) const;
+};
+
+/**
+ * @brief Location publish latency over a Memfault heartbeat interval
+ *
+ */
+struct PublishLatencyHeartbeat {
+    LatencyHistogram build;         /**< BUILD stage of every publish */
+    LatencyHistogram ack;           /**< ACK stage of every acknowledged publish */
+    uint32_t failures;              /**< Publishes that failed */
+    uint32_t timeouts;              /**< Publishes that were not acknowledged in time */
+    uint32_t abandoned;             /**< Publishes replaced by the next one before they ended */
+};
+
+/**
+ * @brief Timing of location publishes from building to acknowledgement
+ *
+ * @details One location publish is followed at a time, from TrackerLocation building it,
+ * through CloudService and BackgroundPublish, to the acknowledgement from the cloud or
+ * from the end application when loc_ack is enabled.  Histograms of each stage are kept by
+ * publish reason and cloud connection until the "get_latency" command reports them, with
+ * "reset" set to clear them afterwards.
+ */
+class PublishLatency {
+public:
+    /**
+     * @brief Singleton class instance access for PublishLatency
+     *
+     * @return PublishLatency&
+     */
+    static PublishLatency &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new PublishLatency();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register the get_latency command
+     *
+     */
+    void init();
+
+    /**
+     * @brief Building of a location publish has started
+     *
+     * @details A publish still being followed is counted as abandoned, its late results are
+     * ignored.
+     *
+     * @param reason Why the location is published
+     */
+    void begin(PublishReason reason);
+
+    /**
+     * @brief The publish was handed to CloudService
+     *
+     * @param context Context given to CloudService::send(), unique to the publish so that it
+     * is recognised when BackgroundPublish completes it and when its result arrives
+     */
+    void sent(const void* context);
+
+    /**
+     * @brief BackgroundPublish completed a publish, called from its thread
+     *
+     * @param context Context of the CloudService send
+     */
+    void published(const void* context);
+
+    /**
+     * @brief The publish was acknowledged, failed or timed out
+     *
+     * @details Results of a publish abandoned by begin() do not match the context of the
+     * one being followed and are ignored.
+     *
+     * @param status Result of the publish
+     * @param context Context of the CloudService send, nullptr when the send was refused
+     */
+    void end(CloudServiceStatus status, const void* context);
+
+    /**
+     * @brief Get latencies since the last reset for the Memfault heartbeat
+     *
+     * @param heartbeat Latencies
+     * @param reset Start a new interval
+     */
+    void getHeartbeat(PublishLatencyHeartbeat& heartbeat, bool reset = false);
+
+private:
+    PublishLatency();
+
+    static constexpr size_t Reasons = (size_t)PublishReason::IMMEDIATE + 1;
+    static constexpr size_t Networks = (size_t)LatencyNetwork::COUNT;
+    static constexpr size_t Stages = (size_t)LatencyStage::COUNT;
+
+    struct Dimension {
+        LatencyHistogram stages[Stages];
+        uint32_t failures;
+        uint32_t timeouts;
+        uint32_t abandoned;
+    };
+
+    int get_latency_cb(CloudServiceStatus status, JSONValue *root, const void *context);
+    int report();
+    void clear();
+
+    Dimension _dimensions[Reasons][Networks];
+    PublishLatencyHeartbeat _heartbeat;
+
+    bool _active;
+    PublishReason _reason;
+    LatencyNetwork _network;
+    system_tick_t _startMs;
+    system_tick_t _sentMs;
+    std::atomic<const void*> _context;
+    std::atomic<bool> _published;
+    std::atomic<system_tick_t> _publishedMs;
+
+    static PublishLatency *_instance;
+};
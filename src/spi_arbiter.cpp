@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "spi_arbiter.h"
+
+SpiArbiter *SpiArbiter::_instance = nullptr;
+
+// Most waiters that can be queued on one priority class
+constexpr unsigned SpiArbiterMaxWaiters = 8;
+
+SpiArbiter::SpiArbiter() :
+    _spi(nullptr),
+    _wake{},
+    _waiters{},
+    _oldestWait{},
+    _busy(false),
+    _devices{} {
+
+}
+
+int SpiArbiter::begin(SPIClass& spi) {
+    CHECK_FALSE(_spi, SYSTEM_ERROR_NONE);
+
+    for (auto& wake : _wake) {
+        if (os_semaphore_create(&wake, SpiArbiterMaxWaiters, 0)) {
+            wake = nullptr;
+            return SYSTEM_ERROR_NO_MEMORY;
+        }
+    }
+    _spi = &spi;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void SpiArbiter::configure(SpiDevice device, pin_t selectPin, const SPISettings& settings, SpiPriority priority) {
+    auto& info = _devices[(size_t)device];
+    info.selectPin = selectPin;
+    info.settings = settings;
+    info.priority = priority;
+
+    pinMode(selectPin, OUTPUT);
+    digitalWrite(selectPin, HIGH);
+}
+
+void SpiArbiter::acquire(SpiDevice device, SpiPriority priority) {
+    if (!_spi) {
+        return;
+    }
+
+    auto start = micros();
+    auto cls = (size_t)priority;
+
+    _mutex.lock();
+    if (_busy) {
+        if (!_waiters[cls]++) {
+            _oldestWait[cls] = start;
+        }
+        _mutex.unlock();
+        // Ownership is handed over by release(), _busy stays set across the hand-off
+        os_semaphore_take(_wake[cls], CONCURRENT_WAIT_FOREVER, false);
+        _mutex.lock();
+        if (--_waiters[cls]) {
+            // Approximation, the next waiter in this class arrived no earlier than now
+            _oldestWait[cls] = micros();
+        }
+    }
+    _busy = true;
+
+    auto& info = _devices[(size_t)device];
+    info.since = micros();
+    uint32_t waited = info.since - start;
+    info.stats.transactions++;
+    info.stats.waitUs += waited;
+    if (waited > info.stats.maxWaitUs) {
+        info.stats.maxWaitUs = waited;
+    }
+    _mutex.unlock();
+}
+
+void SpiArbiter::release(SpiDevice device) {
+    if (!_spi) {
+        return;
+    }
+
+    _mutex.lock();
+    auto now = micros();
+    auto& info = _devices[(size_t)device];
+    info.stats.busUs += now - info.since;
+
+    // Serve the highest priority class unless a lower one has waited too long
+    int next = -1;
+    for (size_t cls = 0; cls < (size_t)SpiPriority::COUNT; cls++) {
+        if (!_waiters[cls]) {
+            continue;
+        }
+        if (next < 0) {
+            next = cls;
+        }
+        if (now - _oldestWait[cls] >= SPI_ARBITER_AGING_US) {
+            next = cls;
+            break;
+        }
+    }
+
+    if (next >= 0) {
+        os_semaphore_give(_wake[next], false);
+    }
+    else {
+        _busy = false;
+    }
+    _mutex.unlock();
+}
+
+void SpiArbiter::transferSegment(const SpiSegment& segment) {
+    if (segment.length >= SPI_ARBITER_DMA_MIN_LENGTH) {
+        // Blocking DMA transfer when no completion callback is given
+        _spi->transfer(segment.tx, segment.rx, segment.length, nullptr);
+        return;
+    }
+
+    for (size_t i = 0; i < segment.length; i++) {
+        auto value = _spi->transfer(segment.tx ? segment.tx[i] : 0xff);
+        if (segment.rx) {
+            segment.rx[i] = value;
+        }
+    }
+}
+
+int SpiArbiter::transfer(SpiDevice device, uint8_t header, const uint8_t* tx, uint8_t* rx, size_t length) {
+    CHECK_TRUE(_spi, SYSTEM_ERROR_INVALID_STATE);
+
+    auto& info = _devices[(size_t)device];
+    SpiArbiterLock lock(device, info.priority);
+
+    _spi->beginTransaction(info.settings);
+    digitalWrite(info.selectPin, LOW);
+    _spi->transfer(header);
+    transferSegment({tx, rx, length});
+    digitalWrite(info.selectPin, HIGH);
+    _spi->endTransaction();
+
+    info.stats.bytes += length + 1;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int SpiArbiter::transfer(SpiDevice device, const SpiSegment* segments, size_t count, SpiPriority priority) {
+    CHECK(beginTransaction(device, priority));
+    for (size_t i = 0; i < count; i++) {
+        transferFramed(device, segments[i]);
+    }
+    endTransaction(device);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int SpiArbiter::beginTransaction(SpiDevice device, SpiPriority priority) {
+    CHECK_TRUE(_spi, SYSTEM_ERROR_INVALID_STATE);
+
+    acquire(device, priority);
+    _spi->beginTransaction(_devices[(size_t)device].settings);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void SpiArbiter::transferFramed(SpiDevice device, const SpiSegment& segment) {
+    auto& info = _devices[(size_t)device];
+
+    digitalWrite(info.selectPin, LOW);
+    transferSegment(segment);
+    digitalWrite(info.selectPin, HIGH);
+    info.stats.bytes += segment.length;
+}
+
+void SpiArbiter::endTransaction(SpiDevice device) {
+    _spi->endTransaction();
+    release(device);
+}
+
+void SpiArbiter::observe(SpiDevice device, bool selected) {
+    auto& info = _devices[(size_t)device];
+    auto now = micros();
+
+    _mutex.lock();
+    if (selected && !info.selected) {
+        info.since = now;
+        info.stats.transactions++;
+    }
+    else if (!selected && info.selected) {
+        info.stats.busUs += now - info.since;
+    }
+    info.selected = selected;
+    _mutex.unlock();
+}
+
+SpiDeviceStats SpiArbiter::getStats(SpiDevice device, bool reset) {
+    _mutex.lock();
+    auto& info = _devices[(size_t)device];
+    auto stats = info.stats;
+    if (reset) {
+        info.stats = {};
+    }
+    _mutex.unlock();
+
+    return stats;
+}
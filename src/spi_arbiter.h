@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Transfers at least this long use DMA, shorter ones are cheaper byte by byte
+constexpr size_t SPI_ARBITER_DMA_MIN_LENGTH {16};
+
+// A waiter of any priority that has waited this long is served before higher priorities
+constexpr uint32_t SPI_ARBITER_AGING_US {2000};
+
+/**
+ * @brief Devices sharing the SPI1 bus
+ *
+ */
+enum class SpiDevice {
+    CAN,                            /**< MCP2515 CAN controller */
+    IMU,                            /**< BMI160 accelerometer */
+    GNSS,                           /**< u-blox GNSS, accounted only */
+    COUNT,
+};
+
+/**
+ * @brief Priority classes, lower values are served first
+ *
+ */
+enum class SpiPriority {
+    REALTIME,                       /**< Latency critical, e.g. draining CAN receive buffers */
+    NORMAL,                         /**< Sensor reads */
+    BACKGROUND,                     /**< Configuration and transmit */
+    COUNT,
+};
+
+/**
+ * @brief One chip select framed part of a batched transfer
+ *
+ */
+struct SpiSegment {
+    const uint8_t* tx;              /**< Bytes to send, nullptr to clock out 0xff */
+    uint8_t* rx;                    /**< Buffer for received bytes, nullptr to discard */
+    size_t length;                  /**< Number of bytes */
+};
+
+/**
+ * @brief Bus usage of a device
+ *
+ */
+struct SpiDeviceStats {
+    uint32_t transactions;          /**< Number of times the bus was held */
+    uint32_t bytes;                 /**< Bytes transferred through the arbiter */
+    uint64_t busUs;                 /**< Time holding the bus in microseconds */
+    uint64_t waitUs;                /**< Time waiting for the bus in microseconds */
+    uint32_t maxWaitUs;             /**< Longest wait for the bus in microseconds */
+};
+
+/**
+ * @brief Arbiter for the SPI1 bus shared by the CAN controller, IMU and GNSS
+ *
+ * @details Bus ownership is handed from one client to the next by priority class so that a
+ * burst of CAN traffic cannot hold off an IMU read for long and vice versa; waiters that
+ * have aged past SPI_ARBITER_AGING_US are served first regardless of class.  Clients always
+ * take the arbiter before the Device OS SPI lock.  Drivers that manage their own
+ * transactions inside a library (the u-blox GNSS and the ESP32 handled by Device OS) cannot
+ * take the arbiter without risking a lock inversion, so GNSS is only accounted through
+ * observe() and the ESP32 is not seen at all.
+ */
+class SpiArbiter {
+public:
+    /**
+     * @brief Singleton class instance access for SpiArbiter
+     *
+     * @return SpiArbiter&
+     */
+    static SpiArbiter &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new SpiArbiter();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize the arbiter
+     *
+     * @param spi SPI interface shared by the devices
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int begin(SPIClass& spi);
+
+    /**
+     * @brief Describe a device that transfers through the arbiter
+     *
+     * @param device Device
+     * @param selectPin Chip select pin, active low
+     * @param settings Bus settings for the device
+     * @param priority Priority used when none is given
+     */
+    void configure(SpiDevice device, pin_t selectPin, const SPISettings& settings, SpiPriority priority);
+
+    /**
+     * @brief Take ownership of the bus, blocking until it is handed over
+     *
+     * @param device Device taking the bus
+     * @param priority Priority class of the request
+     */
+    void acquire(SpiDevice device, SpiPriority priority);
+
+    void acquire(SpiDevice device) {
+        acquire(device, _devices[(size_t)device].priority);
+    }
+
+    /**
+     * @brief Give up ownership of the bus
+     *
+     * @param device Device releasing the bus
+     */
+    void release(SpiDevice device);
+
+    /**
+     * @brief Transfer a register style command: one header byte followed by data
+     *
+     * @param device Device to transfer with
+     * @param header First byte (command or register address)
+     * @param tx Data to send after the header, nullptr to clock out 0xff
+     * @param rx Buffer for data received after the header, nullptr to discard
+     * @param length Data length
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int transfer(SpiDevice device, uint8_t header, const uint8_t* tx, uint8_t* rx, size_t length);
+
+    /**
+     * @brief Transfer several chip select framed segments while holding the bus once
+     *
+     * @param device Device to transfer with
+     * @param segments Segments to transfer in order
+     * @param count Number of segments
+     * @param priority Priority class of the request
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int transfer(SpiDevice device, const SpiSegment* segments, size_t count, SpiPriority priority);
+
+    /**
+     * @brief Hold the bus for a sequence of dependent segments
+     *
+     * @details Use when later segments depend on what earlier ones read.  Every call must be
+     * paired with endTransaction().
+     *
+     * @param device Device to transfer with
+     * @param priority Priority class of the request
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int beginTransaction(SpiDevice device, SpiPriority priority);
+
+    /**
+     * @brief Transfer one chip select framed segment inside beginTransaction()/endTransaction()
+     *
+     * @param device Device holding the bus
+     * @param segment Segment to transfer
+     */
+    void transferFramed(SpiDevice device, const SpiSegment& segment);
+
+    /**
+     * @brief Release the bus held by beginTransaction()
+     *
+     * @param device Device holding the bus
+     */
+    void endTransaction(SpiDevice device);
+
+    /**
+     * @brief Account for a device that drives its own chip select and transaction
+     *
+     * @param device Device
+     * @param selected Chip select asserted
+     */
+    void observe(SpiDevice device, bool selected);
+
+    /**
+     * @brief Get the bus usage of a device
+     *
+     * @param device Device
+     * @param reset Clear the statistics after reading them
+     * @return SpiDeviceStats
+     */
+    SpiDeviceStats getStats(SpiDevice device, bool reset = false);
+
+private:
+    SpiArbiter();
+
+    struct DeviceInfo {
+        pin_t selectPin;
+        SPISettings settings;
+        SpiPriority priority;
+        uint32_t since;             // micros() when the bus or select was taken
+        bool selected;              // observed chip select state
+        SpiDeviceStats stats;
+    };
+
+    void transferSegment(const SpiSegment& segment);
+
+    SPIClass* _spi;
+    Mutex _mutex;
+    os_semaphore_t _wake[(size_t)SpiPriority::COUNT];
+    unsigned int _waiters[(size_t)SpiPriority::COUNT];
+    uint32_t _oldestWait[(size_t)SpiPriority::COUNT];
+    bool _busy;
+    DeviceInfo _devices[(size_t)SpiDevice::COUNT];
+
+    static SpiArbiter *_instance;
+};
+
+/**
+ * @brief Hold the bus for the lifetime of the object
+ *
+ */
+class SpiArbiterLock {
+public:
+    SpiArbiterLock(SpiDevice device, SpiPriority priority) : _device(device) {
+        SpiArbiter::instance().acquire(device, priority);
+    }
+
+    ~SpiArbiterLock() {
+        SpiArbiter::instance().release(_device);
+    }
+
+private:
+    SpiDevice _device;
+};
@@ -20,6 +20,8 @@
 #include "tracker_cellular.h"
 #include "mcp_can.h"
 #include "LocationPublish.h"
+#include "spi_arbiter.h"
+#include "publish_latency.h"
 
 // Defines and constants
 constexpr int CanSleepRetries = 10; // Based on a series of 10ms delays
@@ -108,6 +110,40 @@ void Tracker::collectMemfaultHeartbeatMetrics() {
     memfault_metrics_heartbeat_set_unsigned(
         MEMFAULT_METRICS_KEY(Bat_Soc), (uint32_t)(System.batteryCharge() * TrackerMemfaultBatteryScaling));
 
+    auto& arbiter = SpiArbiter::instance();
+    auto canStats = arbiter.getStats(SpiDevice::CAN, true);
+    auto imuStats = arbiter.getStats(SpiDevice::IMU, true);
+    auto gnssStats = arbiter.getStats(SpiDevice::GNSS, true);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Spi_Can_BusUs), (uint32_t)canStats.busUs);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Spi_Can_MaxWaitUs), canStats.maxWaitUs);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Spi_Imu_BusUs), (uint32_t)imuStats.busUs);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Spi_Imu_MaxWaitUs), imuStats.maxWaitUs);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Spi_Gnss_BusUs), (uint32_t)gnssStats.busUs);
+
+    PublishLatencyHeartbeat latency;
+    PublishLatency::instance().getHeartbeat(latency, true);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Build_MaxMs), latency.build.maxMs);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Ack_Count), latency.ack.count);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Ack_P50Ms), latency.ack.percentile(50));
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Ack_P95Ms), latency.ack.percentile(95));
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Ack_MaxMs), latency.ack.maxMs);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Failures), latency.failures);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Timeouts), latency.timeouts);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Pub_Abandoned), latency.abandoned);
+
     if (_model == TRACKER_MODEL_TRACKERONE) {
         auto temperature = get_temperature();
 
@@ -223,7 +259,10 @@ int Tracker::initCan()
 
     // Initialize CAN device driver
     MCP_CAN can(MCP_CAN_CS_PIN, MCP_CAN_SPI_INTERFACE);
-    if (can.minimalInit() != CAN_OK)
+    SpiArbiter::instance().acquire(SpiDevice::CAN);
+    auto status = can.minimalInit();
+    SpiArbiter::instance().release(SpiDevice::CAN);
+    if (status != CAN_OK)
     {
         Log.error("CAN init failed");
     }
@@ -235,9 +274,22 @@ int Tracker::initCan()
     return SYSTEM_ERROR_NONE;
 }
 
+int Tracker::initSpi()
+{
+    // The CAN controller, IMU and GNSS share SPI1.  CAN receive requests are raised to high
+    // priority by the caller when draining the controller.
+    auto& arbiter = SpiArbiter::instance();
+    CHECK(arbiter.begin(SPI1));
+    arbiter.configure(SpiDevice::CAN, MCP_CAN_CS_PIN, SPISettings(10*MHZ, MSBFIRST, SPI_MODE0), SpiPriority::BACKGROUND);
+    arbiter.configure(SpiDevice::IMU, BMI160_SPI_CS_PIN, SPISettings(4*MHZ, MSBFIRST, SPI_MODE0), SpiPriority::NORMAL);
+
+    return SYSTEM_ERROR_NONE;
+}
+
 int Tracker::initIo()
 {
     // Initialize basic Tracker GPIO to known inactive values until they are needed later
+    (void)initSpi();
     (void)initEsp32();
     (void)initCan();
 
@@ -639,6 +691,7 @@ int Tracker::init()
     enableWatchdog(true);
 
     LocationPublish::instance().init();
+    PublishLatency::instance().init();
 
     // Associate handler to OTAs and pending resets to disable the watchdog
     System.on(reset_pending,
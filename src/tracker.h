@@ -459,6 +459,7 @@ class Tracker {
         static int enablePowerManagement();
         int initEsp32();
         int initCan();
+        int initSpi();
         int initIo();
 
         // Sleep related
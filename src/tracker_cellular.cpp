@@ -26,6 +26,9 @@ TrackerCellular::TrackerCellular() : _signal_update(0), _thread(nullptr)
 
 int TrackerCellular::startScan() {
     auto event = TrackerCellularCommand::Measure;
+    // Counted ahead of the command so that a fast completion is not missed, a full queue
+    // already holds a scan that has not started and so will cover this request
+    _scanRequested++;
     CHECK_FALSE(os_queue_put(_commandQueue, &event, 0, nullptr), SYSTEM_ERROR_BUSY);
 
     return SYSTEM_ERROR_NONE;
@@ -185,6 +188,7 @@ void TrackerCellular::thread_f()
                 break;
 
             case TrackerCellularCommand::Measure: {
+                uint32_t requested = _scanRequested;
                 // Access to this data will always be requested in advance.  We just need
                 // to take inventory of what has been collected and data from the operation.
 
@@ -193,6 +197,7 @@ void TrackerCellular::thread_f()
                         _userServingTower = {};
                         _userTowerListSize = 0;
                      }
+                    _scanCompleted = requested;
                     // The cellular modem is not even ready (maybe not powered) so leave
                     break;
                 }
@@ -216,6 +221,7 @@ void TrackerCellular::thread_f()
                         _userTowerListSize = 0;
                     }
                 }
+                _scanCompleted = requested;
                 break;
             }
 
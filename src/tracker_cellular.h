@@ -96,6 +96,16 @@ public:
      */
     int startScan();
 
+    /**
+     * @brief Check if the results of the last requested scan have not arrived yet
+     *
+     * @return true A scan started at or after the last request has not completed
+     * @return false Results of a scan started after the last request are available
+     */
+    bool isScanPending() const {
+        return _scanCompleted.load() != _scanRequested.load();
+    }
+
     /**
      * @brief Get the cellular signal strength
      *
@@ -167,6 +177,10 @@ private:
     int _towerListSize {0};
     CellularNeighbor _userTowerList[TRACKER_CELLULAR_MAX_NEIGHBORS];
     int _userTowerListSize {0};
+    // Scans requested and the request count when the last completed scan started, a scan
+    // already running when more are requested does not satisfy them
+    std::atomic<uint32_t> _scanRequested {0};
+    std::atomic<uint32_t> _scanCompleted {0};
 
     RecursiveMutex mutex;
     os_queue_t _commandQueue;
@@ -21,10 +21,16 @@
 #include "tracker_config.h"
 #include "tracker_location.h"
 #include "tracker_cellular.h"
+#include "tracker_wifi.h"
 
 #include "config_service.h"
 #include "location_service.h"
 #include "LocationPublish.h"
+#include "clock_service.h"
+#include "compact_encoding.h"
+#include "json_sizing.h"
+#include "publish_latency.h"
+#include "geofence_index.h"
 
 TrackerLocation *TrackerLocation::_instance = nullptr;
 
@@ -32,12 +38,10 @@ static constexpr system_tick_t LoopSampleRate = 1000; // milliseconds
 static constexpr uint32_t EarlySleepSec = 2; // seconds
 static constexpr uint32_t MiscSleepWakeSec = 3; // seconds - miscellaneous time spent by system entering and exiting sleep
 static constexpr uint32_t LockTimeoutSec = 10; // seconds - time to wait for GNSS lock (sleep disabled)
-static constexpr uint32_t WifiPowerOnSec = 3; // seconds - time to wait for WiFi power on
-static constexpr uint32_t WifiPowerScanSec = 1; // seconds - time to wait for WiFi scan
+static constexpr system_tick_t EnhancedScanTimeout = std::max(TRACKER_CELLULAR_SCAN_DELAY, TRACKER_WIFI_SCAN_DELAY) + 2000; // milliseconds
+static constexpr system_tick_t EnhancedScanMaxAge = 60000; // milliseconds - scans are repeated for a publish held longer
 
 static constexpr size_t EnhancedLocationQueueSize = 5; // up to this many elements
-static constexpr size_t ObjectEstimateWpsHeaderSize = sizeof(",{\"wps\":[]}") - 1 /* null */;
-static constexpr size_t ObjectEstimateWpsDataSize = sizeof("{\"bssid\":\"00:11:22:33:44:55\",\"ch\":99,\"str\":-999},") - 1 /* null */;
 
 static int set_radius_cb(double value, const void *context)
 {
@@ -133,6 +137,30 @@ void TrackerLocation::init(unsigned int gnssRetries)
                 config_get_bool_cb, config_set_bool_cb,
                 &_config_state.loc_cb, &_config_state_shadow.loc_cb
             ),
+            ConfigInt("crumb_interval", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.crumb_interval, &_config_state_shadow.crumb_interval,
+                0, 3600),
+            ConfigInt("crumb_max", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.crumb_max, &_config_state_shadow.crumb_max,
+                1, TrackerLocationMaxCrumbs),
+            ConfigInt("crumb_error", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.crumb_error, &_config_state_shadow.crumb_error,
+                0, 10000),
+            ConfigInt("encoding", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.encoding, &_config_state_shadow.encoding,
+                (int32_t)LocationEncoding::JSON, (int32_t)LocationEncoding::COMPACT),
+            ConfigInt("wps_cache", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.wps_cache, &_config_state_shadow.wps_cache,
+                0, 86400),
+            ConfigInt("adapt_dist", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.adapt_distance, &_config_state_shadow.adapt_distance,
+                0, 1000000),
+            ConfigInt("adapt_turn", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.adapt_turn, &_config_state_shadow.adapt_turn,
+                0, 180),
+            ConfigInt("adapt_speed", config_get_int32_cb, config_set_int32_cb,
+                &_config_state.adapt_speed, &_config_state_shadow.adapt_speed,
+                0, 500),
         },
         std::bind(&TrackerLocation::enter_location_config_cb, this, _1, _2),
         std::bind(&TrackerLocation::exit_location_config_cb, this, _1, _2, _3)
@@ -217,6 +245,7 @@ void TrackerLocation::init(unsigned int gnssRetries)
 
     _geofence.RegisterGeofenceCallback([this](CallbackContext& context){ this->onGeofenceCallback(context); });
     _geofence.init();
+    GeofenceIndex::instance().init();
 
     CloudService::instance().regCommandCallback("loc-enhanced", &TrackerLocation::enhanced_cb, this);
 
@@ -307,9 +336,11 @@ int TrackerLocation::enhanced_cb(CloudServiceStatus status, JSONValue *root, con
 
 int TrackerLocation::regLocGenCallback(
     std::function<void(JSONWriter&, LocationPoint &, const void *)> cb,
-    const void *context)
+    const void *context,
+    std::function<void(const void *)> commit)
 {
     locGenCallbacks.append(std::bind(cb, _1, _2, context));
+    locGenCommits.append(commit ? std::function<void()>(std::bind(commit, context)) : std::function<void()>());
     return 0;
 }
 
@@ -342,21 +373,39 @@ int TrackerLocation::regEnhancedLocCallback(
 int TrackerLocation::triggerLocPub(Trigger type, const char *s)
 {
     std::lock_guard<RecursiveMutex> lg(mutex);
-    bool matched = false;
 
-    for(auto trigger : _pending_triggers)
+    // Callers pass literals so the pointer almost always matches before the string compare
+    size_t index = 0;
+    while ((index < _triggerCount) &&
+        (_triggers[index].name != s) && strcmp(_triggers[index].name, s))
+    {
+        index++;
+    }
+
+    if (index == _triggerCount)
     {
-        if(!strcmp(trigger, s))
+        if (_triggerCount == TrackerLocationMaxTriggers)
         {
-            matched = true;
-            break;
+            Log.error("trigger %s not registered, %u in use", s, _triggerCount);
+            return SYSTEM_ERROR_NO_MEMORY;
         }
+        _triggers[_triggerCount++].name = s;
     }
 
-    if(!matched)
+    auto now = System.uptime();
+    auto& trigger = _triggers[index];
+    uint64_t bit = 1ULL << index;
+    if (!(_pendingTriggers & bit))
     {
-        _pending_triggers.append(s);
+        _pendingTriggers |= bit;
+        trigger.count = 0;
+        trigger.firstSec = now;
     }
+    if (trigger.count < UINT16_MAX)
+    {
+        trigger.count++;
+    }
+    trigger.lastSec = now;
 
     if(type == Trigger::IMMEDIATE)
     {
@@ -381,23 +430,25 @@ int TrackerLocation::location_publish_cb(CloudServiceStatus status, JSONValue *r
     {
         // this could either be on the Particle Cloud ack (default) OR the
         // end-to-end ACK
-        Log.info("location cb publish %lu success!", *(uint32_t *) context);
+        Log.info("location cb publish %lu success!", (uint32_t)(uintptr_t)context);
         _first_publish = false;
         _pending_first_publish = false;
     }
     else if(status == CloudServiceStatus::FAILURE)
     {
-        Log.info("location cb publish %lu failure", *(uint32_t *) context);
+        Log.info("location cb publish %lu failure", (uint32_t)(uintptr_t)context);
     }
     else if(status == CloudServiceStatus::TIMEOUT)
     {
-        Log.info("location cb publish %lu timeout", *(uint32_t *) context);
+        Log.info("location cb publish %lu timeout", (uint32_t)(uintptr_t)context);
     }
     else
     {
-        Log.info("location cb publish %lu unexpected status: %d", *(uint32_t *) context, status);
+        Log.info("location cb publish %lu unexpected status: %d", (uint32_t)(uintptr_t)context, status);
     }
 
+    PublishLatency::instance().end(status, context);
+
     _publishAttempted++;
 
     issue_location_publish_callbacks(status, rsp_root, req_event);
@@ -417,17 +468,29 @@ void TrackerLocation::location_publish()
     CloudServicePublishFlags cloud_flags =
         (_config_state.process_ack) ? CloudServicePublishFlags::FULL_ACK : CloudServicePublishFlags::NONE;
 
+    // each publish is sent with its own sequence number as context so that results arriving
+    // after a later publish started are told apart
+    if (!++_publishSequence) {
+        ++_publishSequence;
+    }
+    auto context = (const void *)(uintptr_t)_publishSequence;
+
     // publish a new loc (contained in cloud_service buffer)
     rval = cloud_service.send(WITH_ACK,
         cloud_flags,
         &TrackerLocation::location_publish_cb, this,
-        CLOUD_DEFAULT_TIMEOUT_MS, &_last_location_publish_sec);
+        CLOUD_DEFAULT_TIMEOUT_MS, context);
 
     //if error issue the user defined callbacks
     if(rval)
     {
+        PublishLatency::instance().end(CloudServiceStatus::FAILURE, nullptr);
         issue_location_publish_callbacks(CloudServiceStatus::FAILURE, NULL, cloud_service.writer().buffer());
     }
+    else
+    {
+        PublishLatency::instance().sent(context);
+    }
     cloud_service.unlock();
 }
 
@@ -500,7 +563,7 @@ EvaluationResults TrackerLocation::evaluatePublish(bool error) {
         minNetwork -= (uint32_t)_nextEarlyWake;
     }
 
-    if (_pending_triggers.size()) {
+    if (_pendingTriggers) {
         if (!_config_state.interval_min_seconds ||
             (interval >= minNetwork)) {
             // min interval adjusted for early wake
@@ -524,7 +587,7 @@ EvaluationResults TrackerLocation::evaluatePublish(bool error) {
 // the next time it needs to wake and process inputs, publish, and what not.
 void TrackerLocation::onSleepPrepare(TrackerSleepContext context) {
     // The first thing to figure out is the needed interval, min or max
-    int32_t interval = (_pending_triggers.size()) ?
+    int32_t interval = (_pendingTriggers) ?
         _config_state.interval_min_seconds : _config_state.interval_max_seconds;
 
     auto published = (0 != _publishAttempted.exchange(0));
@@ -573,7 +636,8 @@ void TrackerLocation::onSleepPrepare(TrackerSleepContext context) {
     if (wake > _nextEarlyWake)
         wake -= _nextEarlyWake;
 
-    if (_geofenceConfig.interval && _config_state_loop_safe.gnss && _geofence.AnyGeofenceEnabled()) {
+    if (_geofenceConfig.interval && _config_state_loop_safe.gnss &&
+        (_geofence.AnyGeofenceEnabled() || GeofenceIndex::instance().isEnabled())) {
         unsigned int geoWake = System.uptime() + (unsigned int)_geofenceConfig.interval;
         if (geoWake < wake) {
             wake = geoWake;
@@ -692,52 +756,153 @@ void TrackerLocation::onGeofenceCallback(CallbackContext& context) {
     triggerLocPub(Trigger::NORMAL, zoneStr);
 }
 
+void TrackerLocation::startWpsScan() {
+    TrackerWifi::instance().startScan();
+    MotionCounters counters {};
+    MotionService::instance().getStatistics(counters);
+    _wpsCacheMotion = counters.motionEvents;
+    _wpsCacheMs = millis();
+    _wpsCacheValid = false;
+    _wpsScanned = true;
+    _wpsCacheStats.misses++;
+}
+
+void TrackerLocation::updateWpsCache() {
+    // Key the results of a completed scan with the serving cell found alongside it
+    if (!_wpsScanned || TrackerWifi::instance().isScanPending()) {
+        return;
+    }
+    _wpsScanned = false;
+    TrackerCellular::instance().getServingTower(_wpsCacheCell);
+    _wpsCacheOnMs = TrackerWifi::instance().getLastOnTime();
+    _wpsCacheValid = (_wpsCacheCell.rat != RadioAccessTechnology::NONE);
+}
+
+void TrackerLocation::startEnhancedScans(const LocationPoint& cur_loc) {
+    // A publish held for GNSS lock would otherwise report towers and access points from
+    // wherever it was first due
+    if (_scansStarted && (millis() - _scanStartedMs < EnhancedScanMaxAge)) {
+        return;
+    }
+    _wpsCacheCheck = false;
+
+    // A scanner that is busy will still deliver results before the publish is built
+    if (_config_state_loop_safe.tower) {
+        TrackerCellular::instance().startScan();
+    }
+    if (_config_state_loop_safe.wps) {
+        // The last scan is reused while the device has not moved since and the serving cell,
+        // checked once the tower scan completes, is unchanged
+        MotionCounters counters {};
+        MotionService::instance().getStatistics(counters);
+        bool parked = _wpsCacheValid &&
+            _config_state_loop_safe.tower &&
+            _config_state_loop_safe.wps_cache &&
+            (millis() - _wpsCacheMs < (system_tick_t)_config_state_loop_safe.wps_cache * 1000) &&
+            (counters.motionEvents == _wpsCacheMotion) &&
+            (!cur_loc.locked || (cur_loc.speed < TRACKER_LOCATION_WPS_CACHE_MAX_SPEED));
+        if (parked) {
+            _wpsCacheCheck = true;
+        }
+        else {
+            startWpsScan();
+        }
+    }
+    _scansStarted = true;
+    _scanStartedMs = millis();
+}
+
+bool TrackerLocation::enhancedScansPending() {
+    if (!_scansStarted) {
+        return false;
+    }
+
+    bool towerPending = _config_state_loop_safe.tower && TrackerCellular::instance().isScanPending();
+    if (_wpsCacheCheck && !towerPending) {
+        _wpsCacheCheck = false;
+        CellularServing serving {};
+        TrackerCellular::instance().getServingTower(serving);
+        if ((serving.rat != RadioAccessTechnology::NONE) &&
+            (serving.mcc == _wpsCacheCell.mcc) &&
+            (serving.mnc == _wpsCacheCell.mnc) &&
+            (serving.tac == _wpsCacheCell.tac) &&
+            (serving.cellId == _wpsCacheCell.cellId)) {
+            _wpsCacheStats.hits++;
+            _wpsCacheStats.savedMs += _wpsCacheOnMs;
+            Log.info("reusing WiFi scan, %lu of %lu scans avoided, %lu ms on-time saved",
+                _wpsCacheStats.hits, _wpsCacheStats.hits + _wpsCacheStats.misses,
+                _wpsCacheStats.savedMs);
+        }
+        else {
+            startWpsScan();
+        }
+    }
+
+    if (millis() - _scanStartedMs >= EnhancedScanTimeout) {
+        return false;
+    }
+
+    return towerPending || _wpsCacheCheck ||
+        (_config_state_loop_safe.wps && TrackerWifi::instance().isScanPending());
+}
+
 size_t TrackerLocation::buildTowerInfo(JSONBufferWriter& writer, size_t size) {
     if (!_config_state_loop_safe.tower) {
         return 0;
     }
 
-    TrackerCellular::instance().startScan();
-    delay(TRACKER_CELLULAR_SCAN_DELAY);
-    size_t written = writer.dataSize();
-
     // The cellular information here is always sent and not configurable
     CellularServing servingTower {};
     TrackerCellular::instance().getServingTower(servingTower);
-    if (servingTower.rat != RadioAccessTechnology::NONE) {
-        writer.name("towers").beginArray();
-        writer.beginObject();
-        writer.name("rat").value("lte");
-        writer.name("mcc").value((unsigned)servingTower.mcc);
-        writer.name("mnc").value((unsigned)servingTower.mnc);
-        writer.name("lac").value((unsigned)servingTower.tac);
-        writer.name("cid").value((unsigned)servingTower.cellId);
-        writer.name("str").value(servingTower.signalPower);
-        writer.endObject();
-
-        Vector<CellularNeighbor> towerList;
-        TrackerCellular::instance().getNeighborTowers(towerList);
-        auto towerCount = TrackerLocationMaxTowerSend - 1;  // one has already been taken as the serving tower
-        for (auto tower: towerList) {
-            if (towerCount-- <= 0) {
-                break;
-            }
-            writer.beginObject();
-            writer.name("nid").value((unsigned)tower.neighborId);
-            writer.name("ch").value((unsigned)tower.earfcn);
-            writer.name("str").value(tower.signalPower);
-            writer.endObject();
-        }
+    if (servingTower.rat == RadioAccessTechnology::NONE) {
+        return 0;
+    }
 
-        writer.endArray();
+    Vector<CellularNeighbor> towerList;
+    TrackerCellular::instance().getNeighborTowers(towerList);
+
+    auto writeTowers = [&](JSONWriter& out, int neighbors) {
+        out.name("towers").beginArray();
+        out.beginObject();
+        out.name("rat").value("lte");
+        out.name("mcc").value((unsigned)servingTower.mcc);
+        out.name("mnc").value((unsigned)servingTower.mnc);
+        out.name("lac").value((unsigned)servingTower.tac);
+        out.name("cid").value((unsigned)servingTower.cellId);
+        out.name("str").value(servingTower.signalPower);
+        out.endObject();
+        for (int i = 0; i < neighbors; i++) {
+            auto& tower = towerList[i];
+            out.beginObject();
+            out.name("nid").value((unsigned)tower.neighborId);
+            out.name("ch").value((unsigned)tower.earfcn);
+            out.name("str").value(tower.signalPower);
+            out.endObject();
+        }
+        out.endArray();
+    };
+
+    // Drop neighbors until the towers fit, one has already been taken as the serving tower
+    for (int neighbors = std::min((int)towerList.size(), TrackerLocationMaxTowerSend - 1); neighbors >= 0; neighbors--) {
+        auto towersSize = jsonMemberSize([&](JSONWriter& out) {writeTowers(out, neighbors);});
+        if (towersSize <= size) {
+            writeTowers(writer, neighbors);
+            return towersSize;
+        }
     }
 
-    return writer.dataSize() - written;
+    return 0;
 }
 
-void TrackerLocation::wifi_cb(WiFiAccessPoint* wap, TrackerLocation* context) {
-    if (context->wpsList.size() < TrackerLocationMaxWpsCollect)
-        context->wpsList.append(*wap);
+static void writeAccessPoint(JSONWriter& writer, const WiFiAccessPoint& ap) {
+    char bssid[sizeof("00:11:22:33:44:55")];
+    snprintf(bssid, sizeof(bssid), "%02x:%02x:%02x:%02x:%02x:%02x",
+        ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5]);
+    writer.beginObject();
+    writer.name("bssid").value(bssid);
+    writer.name("ch").value(ap.channel);
+    writer.name("str").value(ap.rssi);
+    writer.endObject();
 }
 
 size_t TrackerLocation::buildWpsInfo(JSONBufferWriter& writer, size_t size) {
@@ -745,51 +910,223 @@ size_t TrackerLocation::buildWpsInfo(JSONBufferWriter& writer, size_t size) {
         return 0;
     }
 
+    // Access points come strongest first, send as many as fit
+    WiFiAccessPoint wpsList[TRACKER_WIFI_MAX_ACCESS_POINTS];
+    auto wpsSize = TrackerWifi::instance().getAccessPoints(wpsList, ARRAY_SIZE(wpsList));
+
+    auto wpsBytes = jsonMemberSize([](JSONWriter& out) {out.name("wps").beginArray().endArray();});
+    size_t wpsCount = 0;
+    for (; wpsCount < wpsSize; wpsCount++) {
+        auto apBytes = jsonElementSize([&](JSONWriter& out) {writeAccessPoint(out, wpsList[wpsCount]);});
+        // The first element has no separator
+        if (!wpsCount) {
+            apBytes--;
+        }
+        if (wpsBytes + apBytes > size) {
+            break;
+        }
+        wpsBytes += apBytes;
+    }
+
+    if (!wpsCount) {
+        return 0;
+    }
+
+    writer.name("wps").beginArray();
+    for (size_t i = 0; i < wpsCount; i++) {
+        writeAccessPoint(writer, wpsList[i]);
+    }
+    writer.endArray();
+
+    return wpsBytes;
+}
+
+// Compact location fields, all little-endian varints
+//   uint8    flags (bit0: accuracy and motion fields follow)
+//   uvarint  epoch time in seconds
+//   svarint  latitude, longitude in 1e-7 degrees
+//   svarint  altitude in centimeters
+//   uvarint  heading in 0.01 degrees, speed in cm/s, horizontal accuracy in cm,
+//            HDOP in tenths, vertical accuracy in cm, VDOP in tenths
+// The bytes are zero padded to a multiple of four and written as Z85 text under "z".  A point
+// with every field typically takes 28 bytes, about 40 characters of JSON against about 170
+// for the JSON encoding.
+static uint64_t unsignedFixed(float value, float scale) {
+    return (value > 0.0f) ? (uint64_t)lroundf(value * scale) : 0;
+}
+
+void TrackerLocation::buildCompactLocation(JSONBufferWriter& writer, const LocationPoint& cur_loc, bool full) {
+    uint8_t buffer[64];
+    char text[z85Length(sizeof(buffer)) + 1];
+
+    CompactWriter compact(buffer, sizeof(buffer));
+    compact.u8(full ? 0x01 : 0x00)
+        .uvarint((uint64_t)cur_loc.epochTime)
+        .svarint(llround(cur_loc.latitude * 10000000.0))
+        .svarint(llround(cur_loc.longitude * 10000000.0));
+    if (full) {
+        compact.svarint(lroundf(cur_loc.altitude * 100.0f))
+            .uvarint(unsignedFixed(cur_loc.heading, 100.0f))
+            .uvarint(unsignedFixed(cur_loc.speed, 100.0f))
+            .uvarint(unsignedFixed(cur_loc.horizontalAccuracy, 100.0f))
+            .uvarint(unsignedFixed(cur_loc.horizontalDop, 10.0f))
+            .uvarint(unsignedFixed(cur_loc.verticalAccuracy, 100.0f))
+            .uvarint(unsignedFixed(cur_loc.verticalDop, 10.0f));
+    }
+
+    auto length = z85Encode(buffer, compact.length(), text);
+    writer.name("z").value(text, length);
+}
+
+// Number of characters needed to print an integer
+static size_t intLength(int32_t value) {
+    size_t length = (value < 0) ? 2 : 1;
+    uint32_t magnitude = (value < 0) ? -(uint32_t)value : (uint32_t)value;
+    while (magnitude >= 10) {
+        magnitude /= 10;
+        length++;
+    }
+    return length;
+}
+
+// Synchronized Euclidean distance, in meters, between a crumb and the position interpolated
+// at its time on the segment joining its neighbours
+static float crumbSed(const LocationCrumb& prev, const LocationCrumb& crumb, const LocationCrumb& next) {
+    float ratio = (next.epoch > prev.epoch) ?
+        (float)(crumb.epoch - prev.epoch) / (float)(next.epoch - prev.epoch) : 0.0f;
+
+    // Offsets from the previous crumb are taken in integers first, a float holding an absolute
+    // coordinate only resolves about 10 millionths of a degree
+    float crumbLat = (float)(crumb.latitude - prev.latitude);
+    float crumbLon = (float)(crumb.longitude - prev.longitude);
+    float lat = (float)(next.latitude - prev.latitude) * ratio;
+    float lon = (float)(next.longitude - prev.longitude) * ratio;
+
+    // Millionths of a degree to meters, longitude shrinks with the cosine of the latitude
+    constexpr float MetersPerMicroDegree = 0.11132f;
+    float dy = (crumbLat - lat) * MetersPerMicroDegree;
+    float dx = (crumbLon - lon) * MetersPerMicroDegree * cosf(crumb.latitude * (float)M_PI / 180000000.0f);
+    return sqrtf(dx * dx + dy * dy);
+}
+
+void TrackerLocation::updateCrumbPriority(size_t index) {
+    auto& crumb = _crumbs[index];
+    if ((index == 0) || (index + 1 >= _crumbCount)) {
+        // The ends of the buffered track are always kept
+        crumb.priority = INFINITY;
+        return;
+    }
+    crumb.priority = crumb.error + crumbSed(_crumbs[index - 1], crumb, _crumbs[index + 1]);
+}
+
+void TrackerLocation::removeCrumb(size_t index) {
+    // SQUISH-E: the neighbours inherit the error of the removed crumb so that the bound on the
+    // distance between the simplified and the original track holds across removals
+    float removed = _crumbs[index].priority;
+    _crumbs[index - 1].error = std::max(_crumbs[index - 1].error, removed);
+    _crumbs[index + 1].error = std::max(_crumbs[index + 1].error, removed);
+
+    memmove(&_crumbs[index], &_crumbs[index + 1], (_crumbCount - index - 1) * sizeof(LocationCrumb));
+    _crumbCount--;
+
+    updateCrumbPriority(index - 1);
+    updateCrumbPriority(index);
+}
+
+size_t TrackerLocation::lowestCrumb() const {
+    size_t lowest = 0;
+    for (size_t i = 1; i + 1 < _crumbCount; i++) {
+        if (!lowest || (_crumbs[i].priority < _crumbs[lowest].priority)) {
+            lowest = i;
+        }
+    }
+    return lowest;
+}
+
+void TrackerLocation::addCrumb(const LocationPoint& cur_loc) {
+    if (_crumbCount == TrackerLocationMaxCrumbs) {
+        // Out of room while publishes are not getting through, give up the crumb that least
+        // changes the shape of the track
+        removeCrumb(lowestCrumb());
+    }
+
+    auto& crumb = _crumbs[_crumbCount++];
+    crumb.epoch = (uint32_t)cur_loc.epochTime;
+    crumb.latitude = (int32_t)lround(cur_loc.latitude * 1000000.0);
+    crumb.longitude = (int32_t)lround(cur_loc.longitude * 1000000.0);
+    crumb.error = 0.0f;
+    _lastCrumbEpoch = crumb.epoch;
+
+    updateCrumbPriority(_crumbCount - 1);
+    if (_crumbCount >= 2) {
+        updateCrumbPriority(_crumbCount - 2);
+    }
+
+    // Drop crumbs that stay within the error bound of the simplified track
+    if (_config_state_loop_safe.crumb_error) {
+        float bound = (float)_config_state_loop_safe.crumb_error;
+        for (auto lowest = lowestCrumb(); lowest && (_crumbs[lowest].priority <= bound); lowest = lowestCrumb()) {
+            removeCrumb(lowest);
+        }
+    }
+}
+
+// Breadcrumbs are published as one flat integer array.  The first crumb is absolute (epoch
+// seconds, latitude and longitude in millionths of a degree) and every following crumb is the
+// difference from the one before it.
+size_t TrackerLocation::buildCrumbs(JSONBufferWriter& writer, size_t size) {
     size_t written = writer.dataSize();
+    // "crumbs":[] plus a separating comma
+    size_t used = 12;
+    if (size <= used) {
+        return 0;
+    }
 
-    do {
-        // This is a work-around to determine how much data is left in the publish message to
-        // allow the WPS object to fill up as much information as possible before closing the
-        // JSON message.
-        if (ObjectEstimateWpsHeaderSize >= size) {
-            // There is no use on continuing
-            break;
+    writer.name("crumbs").beginArray();
+    size_t count = 0;
+    const LocationCrumb* last = nullptr;
+    for (; count < _crumbCount; count++) {
+        auto& crumb = _crumbs[count];
+        int32_t values[3];
+        if (last) {
+            values[0] = (int32_t)(crumb.epoch - last->epoch);
+            values[1] = crumb.latitude - last->latitude;
+            values[2] = crumb.longitude - last->longitude;
+        }
+        else {
+            values[0] = (int32_t)crumb.epoch;
+            values[1] = crumb.latitude;
+            values[2] = crumb.longitude;
         }
 
-        size_t wpsCount = (size - ObjectEstimateWpsHeaderSize) / ObjectEstimateWpsDataSize;
-        if (wpsCount == 0) {
-            // There is no use on continuing
+        size_t length = 3; // commas
+        for (auto value : values) {
+            length += intLength(value);
+        }
+        if (used + length > size) {
             break;
         }
+        used += length;
 
-        wpsList.clear();
-
-        // Power on and immediately scan for access points then power off
-        WiFi.on();
-        delay(WifiPowerOnSec * 1000);
-        (void)WiFi.scan(wifi_cb, this);
-        delay(WifiPowerScanSec * 1000);
-        WiFi.off();
-
-        // NOTE: Any sorting of WiFi access points should be performed here
-        if (!wpsList.isEmpty()) {
-            writer.name("wps").beginArray();
-            int wifiCount = wpsCount;
-            for (auto ap: wpsList) {
-                if (wifiCount-- <= 0) {
-                    break;
-                }
-                String bssid = String::format("%02x:%02x:%02x:%02x:%02x:%02x",
-                    ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5]);
-                writer.beginObject();
-                writer.name("bssid").value(bssid);
-                writer.name("ch").value(ap.channel);
-                writer.name("str").value(ap.rssi);
-                writer.endObject();
-            }
-            writer.endArray();
+        if (!last) {
+            writer.value((unsigned int)crumb.epoch);
         }
-    } while (false);
+        else {
+            writer.value((int)values[0]);
+        }
+        writer.value((int)values[1]);
+        writer.value((int)values[2]);
+        last = &crumb;
+    }
+    writer.endArray();
+
+    // Crumbs that did not fit stay for the next publish
+    _crumbCount -= count;
+    memmove(&_crumbs[0], &_crumbs[count], _crumbCount * sizeof(LocationCrumb));
+    if (_crumbCount) {
+        _crumbs[0].error = 0.0f;
+        updateCrumbPriority(0);
+    }
 
     return writer.dataSize() - written;
 }
@@ -819,6 +1156,8 @@ GnssState TrackerLocation::loopLocation(LocationPoint& cur_loc) {
             break;
         }
 
+        ClockService::instance().discipline();
+
         if (!cur_loc.stable) {
             currentGnssState = GnssState::ON_LOCKED_UNSTABLE;
             break;
@@ -833,6 +1172,8 @@ GnssState TrackerLocation::loopLocation(LocationPoint& cur_loc) {
                 triggerLocPub(Trigger::NORMAL,"radius");
             }
         }
+
+        evaluateMotion(cur_loc);
     } while (false);
 
     // Detect GNSS locked changes
@@ -855,17 +1196,72 @@ GnssState TrackerLocation::loopLocation(LocationPoint& cur_loc) {
     return currentGnssState;
 }
 
+void TrackerLocation::setMotionOrigin(const LocationPoint& cur_loc) {
+    _motionOrigin.setOrigin(geoPoint(cur_loc.latitude, cur_loc.longitude));
+    _motionHeading = cur_loc.heading;
+    _motionHeadingValid = (cur_loc.speed * 3.6f >= (float)_config_state.adapt_speed);
+    _motionValid = true;
+    _motionPending = false;
+}
+
+// Publish by distance travelled and by turns rather than by time alone, so that a fast
+// straight road is sampled every adapt_dist meters and a slow winding one at each turn.
+// Both are triggers and so still limited by interval_min.
+void TrackerLocation::evaluateMotion(const LocationPoint& cur_loc) {
+    auto& config = _config_state_loop_safe;
+    if (!_motionValid || _motionPending) {
+        return;
+    }
+
+    if (config.adapt_distance &&
+        !_motionOrigin.isWithin(geoPoint(cur_loc.latitude, cur_loc.longitude), (float)config.adapt_distance)) {
+        _motionPending = true;
+        triggerLocPub(Trigger::NORMAL, "distance");
+        return;
+    }
+
+    if (!config.adapt_turn || (cur_loc.speed * 3.6f < (float)config.adapt_speed)) {
+        return;
+    }
+
+    // The heading published while slow was noise, take the first one at speed instead
+    if (!_motionHeadingValid) {
+        _motionHeading = cur_loc.heading;
+        _motionHeadingValid = true;
+        return;
+    }
+
+    float turn = fabsf(fmodf(cur_loc.heading - _motionHeading + 540.0f, 360.0f) - 180.0f);
+    if (turn > (float)config.adapt_turn) {
+        _motionPending = true;
+        triggerLocPub(Trigger::NORMAL, "turn");
+    }
+}
+
+// Scratch space for sizing the output of location generation callbacks
+static char stageBuffer[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+
+size_t TrackerLocation::remainingPublishSize() {
+    auto& writer = CloudService::instance().writer();
+    size_t used = writer.dataSize() + 1 /* null */ + CloudService::instance().estimatedEndCommandSize();
+    return (used < writer.bufferSize()) ? writer.bufferSize() - used : 0;
+}
+
 void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
     bool locked = (_config_state.gnss) ? cur_loc.locked : false;
 
     if(locked) {
         LocationService::instance().setWayPoint(cur_loc.latitude, cur_loc.longitude);
+        setMotionOrigin(cur_loc);
     }
 
     CloudService &cloud_service = CloudService::instance();
     cloud_service.beginCommand("loc");
     cloud_service.writer().name("loc").beginObject();
-    if (locked) {
+    if (locked && (_config_state.encoding == (int32_t)LocationEncoding::COMPACT)) {
+        buildCompactLocation(cloud_service.writer(), cur_loc, !_config_state.min_publish);
+    }
+    else if (locked) {
         cloud_service.writer().name("lck").value(1);
         cloud_service.writer().name("time").value((unsigned int) cur_loc.epochTime);
         cloud_service.writer().name("lat").value(cur_loc.latitude, 8);
@@ -885,39 +1281,83 @@ void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
         cloud_service.writer().name("lck").value(0);
     }
 
-    for(auto cb : locGenCallbacks) {
-        cb(cloud_service.writer(), cur_loc);
+    // Everything from here on is sized exactly before it is written.  The triggers are always
+    // sent so their room is held back from the generation callbacks, which come next by
+    // priority, then breadcrumbs, towers and access points take what is left.
+    std::lock_guard<RecursiveMutex> lg(mutex);
+    auto writeTriggers = [&](JSONWriter& writer) {
+        // Errors are handled separately from normal triggers so that the error doesn't cause the
+        // minimum publish times to be invoked as other normal triggers would
+        if (error || _pendingTriggers) {
+            writer.name("trig").beginArray();
+            if (error) {
+                writer.value("err");
+            }
+            bool repeated = false;
+            for (size_t i = 0; i < _triggerCount; i++) {
+                if (_pendingTriggers & (1ULL << i)) {
+                    writer.value(_triggers[i].name);
+                    repeated = repeated || (_triggers[i].count > 1);
+                }
+            }
+            writer.endArray();
+
+            // Triggers that fired more than once are coalesced and counted
+            if (repeated) {
+                writer.name("trig_cnt").beginObject();
+                for (size_t i = 0; i < _triggerCount; i++) {
+                    if ((_pendingTriggers & (1ULL << i)) && (_triggers[i].count > 1)) {
+                        writer.name(_triggers[i].name).value((unsigned int)_triggers[i].count);
+                    }
+                }
+                writer.endObject();
+            }
+        }
+    };
+    size_t triggersSize = jsonMemberSize(writeTriggers);
+
+    JSONMemberStage stage(stageBuffer, sizeof(stageBuffer));
+    for (int i = 0; i < locGenCallbacks.size(); i++) {
+        auto size = stage.capture([&](JSONWriter& writer) {locGenCallbacks[i](writer, cur_loc);});
+        if (!size) {
+            continue;
+        }
+        if (size + 1 /* } */ + triggersSize > remainingPublishSize()) {
+            Log.warn("location generation callback %d deferred, %u bytes do not fit", i, size);
+            continue;
+        }
+        stage.append(cloud_service.writer());
+        if (locGenCommits[i]) {
+            locGenCommits[i]();
+        }
     }
 
     cloud_service.writer().endObject();
 
-    // Errors are handled separately from normal triggers so that the error doesn't cause the
-    // minimum publish times to be invoked as other normal triggers would
-    if (error || !_pending_triggers.isEmpty()) {
-        std::lock_guard<RecursiveMutex> lg(mutex);
-        cloud_service.writer().name("trig").beginArray();
-        if (error) {
-            cloud_service.writer().value("err");
-        }
-        for (auto trigger : _pending_triggers) {
-            cloud_service.writer().value(trigger);
+    writeTriggers(cloud_service.writer());
+    for (size_t i = 0; i < _triggerCount; i++) {
+        auto& trigger = _triggers[i];
+        if ((_pendingTriggers & (1ULL << i)) && (trigger.count > 1)) {
+            Log.trace("trigger %s x%u over %lu s", trigger.name, trigger.count,
+                trigger.lastSec - trigger.firstSec);
         }
-        _pending_triggers.clear();
-        cloud_service.writer().endArray();
+    }
+    _pendingTriggers = 0;
+
+    if (_crumbCount) {
+        buildCrumbs(cloud_service.writer(), remainingPublishSize());
     }
 
     if (_config_state_loop_safe.enhance_loc) {
         // Request a callback of the enhanced location when made available
-        if (_config_state_loop_safe.loc_cb) {
-            cloud_service.writer().name("loc_cb").value(true);
+        auto writeLocCb = [](JSONWriter& writer) {writer.name("loc_cb").value(true);};
+        if (_config_state_loop_safe.loc_cb && (jsonMemberSize(writeLocCb) <= remainingPublishSize())) {
+            writeLocCb(cloud_service.writer());
         }
 
-        size_t remainingSize = cloud_service.writer().bufferSize() - 1 /* null */
-            - cloud_service.writer().dataSize() - cloud_service.estimatedEndCommandSize();
-
         // Populate cellular tower information for publish
-        remainingSize -= buildTowerInfo(cloud_service.writer(), remainingSize);
-        remainingSize -= buildWpsInfo(cloud_service.writer(), remainingSize);
+        buildTowerInfo(cloud_service.writer(), remainingPublishSize());
+        buildWpsInfo(cloud_service.writer(), remainingPublishSize());
     }
 
     Log.info("%.*s", cloud_service.writer().dataSize(), cloud_service.writer().buffer());
@@ -960,16 +1400,28 @@ void TrackerLocation::loop() {
     if ((GnssState::ERROR == locationStatus) && (0 != getGnssCycle())) {
         locationStatus = GnssState::ON_UNLOCKED;
     }
-    // Only evaluate geofence if GNSS lock is stable
-    if (_config_state_loop_safe.gnss && _sleep.isFullWakeCycle() && _geofence.AnyGeofenceEnabled() && LocationService::instance().isLockStable()) {
-        // Update geofence data
-        PointData geofence_point;
-        geofence_point.lat = cur_loc.latitude;
-        geofence_point.lon = cur_loc.longitude;
-        geofence_point.hdop = cur_loc.horizontalDop;
 
-        _geofence.UpdateGeofencePoint(geofence_point);
-        _geofence.loop();
+    // Collect breadcrumbs between publishes and publish once enough have been collected
+    if (_config_state_loop_safe.crumb_interval && (GnssState::ON_LOCKED_STABLE == locationStatus) &&
+        ((uint32_t)cur_loc.epochTime - _lastCrumbEpoch >= (uint32_t)_config_state_loop_safe.crumb_interval)) {
+        addCrumb(cur_loc);
+        if (_crumbCount >= (size_t)_config_state_loop_safe.crumb_max) {
+            triggerLocPub(Trigger::NORMAL, "crumbs");
+        }
+    }
+    // Only evaluate geofence if GNSS lock is stable
+    if (_config_state_loop_safe.gnss && _sleep.isFullWakeCycle() && LocationService::instance().isLockStable()) {
+        if (_geofence.AnyGeofenceEnabled()) {
+            // Update geofence data
+            PointData geofence_point;
+            geofence_point.lat = cur_loc.latitude;
+            geofence_point.lon = cur_loc.longitude;
+            geofence_point.hdop = cur_loc.horizontalDop;
+
+            _geofence.UpdateGeofencePoint(geofence_point);
+            _geofence.loop();
+        }
+        GeofenceIndex::instance().update(cur_loc);
     }
 
     // Perform interval evaluation
@@ -981,6 +1433,20 @@ void TrackerLocation::loop() {
         enableNetwork();
     }
 
+    updateWpsCache();
+    if (PublishReason::NONE == publishReason.reason) {
+        _scansStarted = false;
+        _wpsCacheCheck = false;
+    }
+    else if (_config_state_loop_safe.enhance_loc) {
+        // Scan towers and access points as soon as a publish is pending so that the scans
+        // overlap with any wait for GNSS lock, and hold the publish until they complete
+        startEnhancedScans(cur_loc);
+        if (enhancedScansPending()) {
+            return;
+        }
+    }
+
     bool publishNow = false;
 
     //                                   : NONE      TIME        TRIG        IMM
@@ -1073,11 +1539,18 @@ void TrackerLocation::loop() {
     // Perform publish of location data if requested
     //
 
+    // Scans started for this publish are spent even when it cannot be sent
+    if (publishNow) {
+        _scansStarted = false;
+        _wpsCacheCheck = false;
+    }
+
     // then of any new publish
     if(publishNow && (Particle.connected() ||
             LocationPublish::instance().isStoreEnabled()))
     {
         Log.info("publishing now...");
+        PublishLatency::instance().begin(publishReason.reason);
         buildPublish(cur_loc, (0 == getGnssCycle()));
         pendingLocPubCallbacks = locPubCallbacks;
         locPubCallbacks.clear();
@@ -21,6 +21,7 @@
 #include "location_service.h"
 #include "motion_service.h"
 #include "tracker_sleep.h"
+#include "tracker_cellular.h"
 #include "Geofence.h"
 
 #define TRACKER_LOCATION_INTERVAL_MIN_DEFAULT_SEC (900)
@@ -28,6 +29,17 @@
 #define TRACKER_LOCATION_MIN_PUBLISH_DEFAULT (false)
 #define TRACKER_LOCATION_LOCK_TRIGGER (true)
 #define TRACKER_LOCATION_PROCESS_ACK (true)
+#define TRACKER_LOCATION_CRUMB_INTERVAL_DEFAULT_SEC (0)
+#define TRACKER_LOCATION_CRUMB_MAX_DEFAULT (20)
+#define TRACKER_LOCATION_CRUMB_ERROR_DEFAULT (0)
+#define TRACKER_LOCATION_ENCODING_DEFAULT (LocationEncoding::JSON)
+#define TRACKER_LOCATION_WPS_CACHE_DEFAULT_SEC (600)
+#define TRACKER_LOCATION_ADAPT_DISTANCE_DEFAULT (0)
+#define TRACKER_LOCATION_ADAPT_TURN_DEFAULT (0)
+#define TRACKER_LOCATION_ADAPT_SPEED_DEFAULT (10)
+
+// GNSS speed, in meters per second, below which the device is considered parked
+#define TRACKER_LOCATION_WPS_CACHE_MAX_SPEED (0.5f)
 
 // wait at most this many seconds for a locked GPS location to become stable
 // before publishing regardless
@@ -41,6 +53,16 @@ constexpr int TrackerLocationMaxWpsCollect = 20;
 constexpr int TrackerLocationMaxWpsSend = 5;
 constexpr int TrackerLocationMaxTowerSend = 3;
 constexpr int NUM_OF_GEOFENCE_ZONES = 4;
+constexpr int TrackerLocationMaxCrumbs = 64;
+
+// Distinct trigger names, one bit each in the pending mask
+constexpr size_t TrackerLocationMaxTriggers = 48;
+
+// Encodings of the location fields of a publish
+enum class LocationEncoding {
+    JSON = 0,       // lat, lon, alt, ... as JSON numbers
+    COMPACT = 1,    // varint and fixed-point fields wrapped in Z85 text under "z"
+};
 
 struct tracker_location_config_t {
     int32_t interval_min_seconds; // 0 = no min
@@ -53,6 +75,38 @@ struct tracker_location_config_t {
     bool wps;
     bool enhance_loc;
     bool loc_cb;
+    int32_t crumb_interval; // seconds between breadcrumbs, 0 = disabled
+    int32_t crumb_max; // breadcrumbs that trigger a publish
+    int32_t crumb_error; // meters the simplified track may deviate from the fixes, 0 = keep all
+    int32_t encoding; // LocationEncoding
+    int32_t wps_cache; // seconds the last WiFi scan is reused while parked, 0 = always scan
+    int32_t adapt_distance; // meters from the last published position that trigger a publish, 0 = disabled
+    int32_t adapt_turn; // degrees of heading change since the last publish that trigger a publish, 0 = disabled
+    int32_t adapt_speed; // km/h below which the heading is too noisy to detect turns
+};
+
+// Reuse of WiFi scan results while parked
+struct WpsCacheStats {
+    uint32_t hits;      // publishes that reused the last scan
+    uint32_t misses;    // publishes that powered on WiFi and scanned
+    uint32_t savedMs;   // WiFi on-time avoided by the hits in milliseconds
+};
+
+// Breadcrumb with coordinates in millionths of a degree
+struct LocationCrumb {
+    uint32_t epoch;
+    int32_t latitude;
+    int32_t longitude;
+    float error;        // largest error, in meters, inherited from removed neighbours
+    float priority;     // error if this crumb were removed, infinite for the ends
+};
+
+// Trigger name and how often it fired since the last publish
+struct PendingTrigger {
+    const char* name;   // registered on first use and kept, names must stay valid
+    uint16_t count;     // saturates
+    uint32_t firstSec;  // uptime of the first and latest occurrence
+    uint32_t lastSec;
 };
 
 enum class Trigger {
@@ -115,13 +169,26 @@ class TrackerLocation
         // register for callback during generation of location publish allowing
         // for insertion of custom fields into the output
         // these callbacks are persistent and not removed on generation
+        // callbacks are called in registration order and fields from a callback that do not
+        // fit in the remaining publish are dropped as a whole
+        // the optional commit callback is called once the fields are in the publish, state
+        // that is cleared there rather than in the generation callback is kept for the next
+        // publish when the fields are dropped
         int regLocGenCallback(
             std::function<void(JSONWriter&, LocationPoint &, const void *)>,
+            const void *context=nullptr,
+            std::function<void(const void *)> commit=nullptr);
+
+        template <typename T>
+        int regLocGenCallback(
+            void (T::*cb)(JSONWriter&, LocationPoint &, const void *),
+            T *instance,
             const void *context=nullptr);
 
         template <typename T>
         int regLocGenCallback(
             void (T::*cb)(JSONWriter&, LocationPoint &, const void *),
+            void (T::*commit)(const void *),
             T *instance,
             const void *context=nullptr);
 
@@ -171,6 +238,7 @@ class TrackerLocation
             return _geofence;
         }
         bool isProcessAckEnabled() {return _config_state.process_ack;}
+        void getWpsCacheStats(WpsCacheStats& stats) {stats = _wpsCacheStats;}
         int location_publish_cb(CloudServiceStatus status, JSONValue *, const char *req_event, const void *context);
         void issue_location_publish_callbacks(CloudServiceStatus status, JSONValue *, const char *req_event);
 
@@ -178,6 +246,9 @@ class TrackerLocation
         TrackerLocation() :
             _sleep(TrackerSleep::instance()),
             _geofence(NUM_OF_GEOFENCE_ZONES),
+            _triggers{},
+            _triggerCount(0),
+            _pendingTriggers(0),
             _loopSampleTick(0),
             _pending_immediate(false),
             _first_publish(true),
@@ -188,13 +259,30 @@ class TrackerLocation
             _pendingGeofence(false),
             _lastInterval(0),
             _publishAttempted(0),
+            _publishSequence(0),
             _monotonic_publish_sec(0),
             _newMonotonic(true),
             _firstLockSec(0),
             _gnssStartedSec(0),
             _lastGnssState(GnssState::OFF),
             _gnssRetryDefault(0),
-            _gnssCycleCurrent(0) {
+            _gnssCycleCurrent(0),
+            _scansStarted(false),
+            _scanStartedMs(0),
+            _wpsCacheCheck(false),
+            _wpsScanned(false),
+            _wpsCacheValid(false),
+            _wpsCacheMs(0),
+            _wpsCacheOnMs(0),
+            _wpsCacheMotion(0),
+            _wpsCacheCell{},
+            _wpsCacheStats{},
+            _crumbCount(0),
+            _lastCrumbEpoch(0),
+            _motionValid(false),
+            _motionHeadingValid(false),
+            _motionPending(false),
+            _motionHeading(0.0f) {
 
             _config_state = {
                 .interval_min_seconds = TRACKER_LOCATION_INTERVAL_MIN_DEFAULT_SEC,
@@ -207,6 +295,14 @@ class TrackerLocation
                 .wps = true,
                 .enhance_loc = true,
                 .loc_cb = false,
+                .crumb_interval = TRACKER_LOCATION_CRUMB_INTERVAL_DEFAULT_SEC,
+                .crumb_max = TRACKER_LOCATION_CRUMB_MAX_DEFAULT,
+                .crumb_error = TRACKER_LOCATION_CRUMB_ERROR_DEFAULT,
+                .encoding = (int32_t)TRACKER_LOCATION_ENCODING_DEFAULT,
+                .wps_cache = TRACKER_LOCATION_WPS_CACHE_DEFAULT_SEC,
+                .adapt_distance = TRACKER_LOCATION_ADAPT_DISTANCE_DEFAULT,
+                .adapt_turn = TRACKER_LOCATION_ADAPT_TURN_DEFAULT,
+                .adapt_speed = TRACKER_LOCATION_ADAPT_SPEED_DEFAULT,
             };
 
             _config_state_loop_safe = _config_state;
@@ -217,7 +313,9 @@ class TrackerLocation
 
         RecursiveMutex mutex;
 
-        Vector<const char *> _pending_triggers;
+        PendingTrigger _triggers[TrackerLocationMaxTriggers];
+        size_t _triggerCount;
+        uint64_t _pendingTriggers;
         system_tick_t _loopSampleTick;
         bool _pending_immediate;
         bool _first_publish;
@@ -247,10 +345,22 @@ class TrackerLocation
         void onGeofenceCallback(CallbackContext& context);
         EvaluationResults evaluatePublish(bool error);
         void buildPublish(LocationPoint& cur_loc, bool error = false);
+        size_t remainingPublishSize();
         GnssState loopLocation(LocationPoint& cur_loc);
+        void startEnhancedScans(const LocationPoint& cur_loc);
+        void startWpsScan();
+        void updateWpsCache();
+        bool enhancedScansPending();
         size_t buildTowerInfo(JSONBufferWriter& writer, size_t size);
-        static void wifi_cb(WiFiAccessPoint* wap, TrackerLocation* context);
         size_t buildWpsInfo(JSONBufferWriter& writer, size_t size);
+        void buildCompactLocation(JSONBufferWriter& writer, const LocationPoint& cur_loc, bool full);
+        void updateCrumbPriority(size_t index);
+        void removeCrumb(size_t index);
+        size_t lowestCrumb() const;
+        void addCrumb(const LocationPoint& cur_loc);
+        size_t buildCrumbs(JSONBufferWriter& writer, size_t size);
+        void setMotionOrigin(const LocationPoint& cur_loc);
+        void evaluateMotion(const LocationPoint& cur_loc);
 
         int buildEnhLocation(JSONValue& node, LocationPoint& point);
         int enhanced_cb(CloudServiceStatus status, JSONValue* root, const void* context);
@@ -273,6 +383,7 @@ class TrackerLocation
         uint32_t _last_location_publish_sec;
         int32_t _lastInterval;
         std::atomic<size_t> _publishAttempted;
+        uint32_t _publishSequence;      // context of the latest send, never 0
         uint32_t _monotonic_publish_sec;
         bool _newMonotonic;
         uint32_t _firstLockSec;
@@ -284,6 +395,7 @@ class TrackerLocation
         tracker_location_config_t _config_state, _config_state_shadow, _config_state_loop_safe;
 
         Vector<std::function<void(JSONWriter&, LocationPoint&)>> locGenCallbacks;
+        Vector<std::function<void()>> locGenCommits;    // empty where none was registered
         // publish callback for the next publish (not in flight)
         Vector<std::function<void(CloudServiceStatus status, JSONValue *, const char *)>> locPubCallbacks;
         // publish callbacks for the current/pending publish (in flight)
@@ -292,7 +404,26 @@ class TrackerLocation
         Vector<std::function<void(const LocationPoint&)>> enhancedLocCallbacks;
         os_queue_t _enhancedLocQueue;
 
-        Vector<WiFiAccessPoint> wpsList;
+        bool _scansStarted;
+        system_tick_t _scanStartedMs;
+        bool _wpsCacheCheck;            // hit depends on the serving cell of the running tower scan
+        bool _wpsScanned;               // a WiFi scan was started for the publish being prepared
+        bool _wpsCacheValid;
+        system_tick_t _wpsCacheMs;      // start of the cached scan
+        system_tick_t _wpsCacheOnMs;    // WiFi on-time of the cached scan
+        size_t _wpsCacheMotion;         // IMU motion events at the start of the cached scan
+        CellularServing _wpsCacheCell;  // serving cell at the end of the cached scan
+        WpsCacheStats _wpsCacheStats;
+
+        LocationCrumb _crumbs[TrackerLocationMaxCrumbs]; // oldest first
+        size_t _crumbCount;
+        uint32_t _lastCrumbEpoch;
+
+        GeoLocalFrame _motionOrigin;    // last published position
+        bool _motionValid;
+        bool _motionHeadingValid;       // heading of the last published position is above adapt_speed
+        bool _motionPending;            // distance or turn triggered since the last publish
+        float _motionHeading;
 };
 
 template <typename T>
@@ -304,6 +435,16 @@ int TrackerLocation::regLocGenCallback(
     return regLocGenCallback(std::bind(cb, instance, _1, _2, _3), context);
 }
 
+template <typename T>
+int TrackerLocation::regLocGenCallback(
+    void (T::*cb)(JSONWriter&, LocationPoint &, const void *),
+    void (T::*commit)(const void *),
+    T *instance,
+    const void *context)
+{
+    return regLocGenCallback(std::bind(cb, instance, _1, _2, _3), context, std::bind(commit, instance, _1));
+}
+
 template <typename T>
 int TrackerLocation::regLocPubCallback(
     int (T::*cb)(CloudServiceStatus status, JSONValue *, const char *, const void *context),
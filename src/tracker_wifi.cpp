@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+
+#include "tracker_wifi.h"
+
+TrackerWifi *TrackerWifi::_instance = nullptr;
+
+TrackerWifi::TrackerWifi() : _scanRequested(0), _scanCompleted(0), _thread(nullptr)
+{
+    os_queue_create(&_commandQueue, sizeof(TrackerWifiCommand), 1, nullptr);
+    _thread = new Thread("tracker_wifi", [this]() {TrackerWifi::thread_f();}, OS_THREAD_PRIORITY_DEFAULT);
+}
+
+int TrackerWifi::startScan() {
+    auto event = TrackerWifiCommand::Scan;
+    // Counted ahead of the command so that a fast completion is not missed, a full queue
+    // already holds a scan that has not started and so will cover this request
+    _scanRequested++;
+    CHECK_FALSE(os_queue_put(_commandQueue, &event, 0, nullptr), SYSTEM_ERROR_BUSY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+// Orders the heap with the weakest access point at the front
+static bool strongerRssi(const WiFiAccessPoint& a, const WiFiAccessPoint& b) {
+    return a.rssi > b.rssi;
+}
+
+void TrackerWifi::scan_cb(WiFiAccessPoint* wap, TrackerWifi* context) {
+    auto first = context->_accessPoints;
+    auto last = first + context->_accessPointsSize;
+
+    // The same BSSID may be reported on more than one channel, keep the strongest report
+    auto found = std::find_if(first, last, [wap](const WiFiAccessPoint& ap) {
+        return !memcmp(ap.bssid, wap->bssid, sizeof(ap.bssid));
+    });
+    if (found != last) {
+        if (wap->rssi > found->rssi) {
+            *found = *wap;
+            std::make_heap(first, last, strongerRssi);
+        }
+        return;
+    }
+
+    if (context->_accessPointsSize < ARRAY_SIZE(context->_accessPoints)) {
+        *last = *wap;
+        std::push_heap(first, ++last, strongerRssi);
+        context->_accessPointsSize++;
+    }
+    else if (wap->rssi > first->rssi) {
+        // Replace the weakest kept access point
+        std::pop_heap(first, last, strongerRssi);
+        *(last - 1) = *wap;
+        std::push_heap(first, last, strongerRssi);
+    }
+}
+
+TrackerWifiCommand TrackerWifi::waitOnEvent(system_tick_t timeout) {
+    TrackerWifiCommand event {TrackerWifiCommand::None};
+    auto ret = os_queue_take(_commandQueue, &event, timeout, nullptr);
+    if (ret) {
+        event = TrackerWifiCommand::None;
+    }
+
+    return event;
+}
+
+// a thread to power the WiFi module and scan in a non-blocking fashion
+void TrackerWifi::thread_f()
+{
+    auto loop = true;
+    while (loop) {
+        auto event = waitOnEvent(CONCURRENT_WAIT_FOREVER);
+
+        switch (event) {
+            case TrackerWifiCommand::None:
+                // Do nothing
+                break;
+
+            case TrackerWifiCommand::Exit:
+                // Get out of main loop and join
+                loop = false;
+                break;
+
+            case TrackerWifiCommand::Scan: {
+                uint32_t requested = _scanRequested;
+                _accessPointsSize = 0;
+
+                // Power on and immediately scan for access points then power off
+                auto onTime = millis();
+                WiFi.on();
+                delay(TRACKER_WIFI_POWER_ON_DELAY);
+                (void)WiFi.scan(scan_cb, this);
+                delay(TRACKER_WIFI_SCAN_SETTLE_DELAY);
+                WiFi.off();
+                _lastOnTime = millis() - onTime;
+
+                // Strongest first so that readers can take as many as they have room for
+                std::sort_heap(_accessPoints, _accessPoints + _accessPointsSize, strongerRssi);
+
+                // Simple copies for thread safety and to avoid very long holds on the mutex
+                WITH_LOCK(mutex) {
+                    _userAccessPointsSize = _accessPointsSize;
+                    for (size_t i = 0;i < _accessPointsSize;++i) {
+                        _userAccessPoints[i] = _accessPoints[i];
+                    }
+                }
+                _scanCompleted = requested;
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    // Kill the thread if we get here
+    _thread->cancel();
+}
+
+size_t TrackerWifi::getAccessPoints(WiFiAccessPoint* accessPoints, size_t count) {
+    size_t size = 0;
+    WITH_LOCK(mutex) {
+        size = std::min(count, _userAccessPointsSize);
+        for (size_t i = 0;i < size;++i) {
+            accessPoints[i] = _userAccessPoints[i];
+        }
+    }
+
+    return size;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Particle.h"
+
+// Time to wait for the WiFi module to power on before scanning
+constexpr system_tick_t TRACKER_WIFI_POWER_ON_DELAY {3000};
+
+// Time to wait for the scan to settle before powering the WiFi module off
+constexpr system_tick_t TRACKER_WIFI_SCAN_SETTLE_DELAY {1000};
+
+// Maximum amount of time, in milliseconds, that a power on and scan should take
+constexpr system_tick_t TRACKER_WIFI_SCAN_DELAY {TRACKER_WIFI_POWER_ON_DELAY + TRACKER_WIFI_SCAN_SETTLE_DELAY + 1000};
+
+// Only the strongest access points of a scan are kept
+constexpr size_t TRACKER_WIFI_MAX_ACCESS_POINTS {20};
+
+/**
+ * @brief Commands to instruct WiFi thread
+ *
+ */
+enum class TrackerWifiCommand {
+    None,                   /**< Do nothing */
+    Scan,                   /**< Power on, scan for access points and power off */
+    Exit,                   /**< Exit from thread */
+};
+
+/**
+ * @brief TrackerWifi class to scan for WiFi access points without blocking the application
+ *
+ */
+class TrackerWifi {
+public:
+    /**
+     * @brief Start scan for access points
+     *
+     * @retval SYSTEM_ERROR_NONE Success
+     * @retval SYSTEM_ERROR_BUSY Cannot start a new scan
+     */
+    int startScan();
+
+    /**
+     * @brief Check if the results of the last requested scan have not arrived yet
+     *
+     * @return true A scan started at or after the last request has not completed
+     * @return false Results of a scan started after the last request are available
+     */
+    bool isScanPending() const {
+        return _scanCompleted.load() != _scanRequested.load();
+    }
+
+    /**
+     * @brief Get the strongest access points found by the last scan
+     *
+     * @details Access points are ordered by decreasing signal strength and each BSSID appears
+     * once, with the strongest of its reports.
+     *
+     * @param[out] accessPoints Buffer for the access points
+     * @param count Number of access points the buffer can hold
+     * @return size_t Number of access points copied
+     */
+    size_t getAccessPoints(WiFiAccessPoint* accessPoints, size_t count);
+
+    /**
+     * @brief Get the time the WiFi module was powered for the last scan
+     *
+     * @return system_tick_t Milliseconds powered on, 0 before the first scan
+     */
+    system_tick_t getLastOnTime() const {
+        return _lastOnTime;
+    }
+
+    /**
+     * @brief Singleton class instance access for TrackerWifi
+     *
+     * @return TrackerWifi&
+     */
+    static TrackerWifi &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new TrackerWifi();
+        }
+        return *_instance;
+    }
+
+private:
+    TrackerWifi();
+
+    WiFiAccessPoint _accessPoints[TRACKER_WIFI_MAX_ACCESS_POINTS];
+    size_t _accessPointsSize {0};
+    WiFiAccessPoint _userAccessPoints[TRACKER_WIFI_MAX_ACCESS_POINTS];
+    size_t _userAccessPointsSize {0};
+    // Scans requested and the request count when the last completed scan started, a scan
+    // already running when more are requested does not satisfy them
+    std::atomic<uint32_t> _scanRequested;
+    std::atomic<uint32_t> _scanCompleted;
+    system_tick_t _lastOnTime {0};
+
+    RecursiveMutex mutex;
+    os_queue_t _commandQueue;
+    Thread * _thread;
+
+    static void scan_cb(WiFiAccessPoint* wap, TrackerWifi* context);
+    TrackerWifiCommand waitOnEvent(system_tick_t timeout);
+    void thread_f();
+
+    static TrackerWifi *_instance;
+};
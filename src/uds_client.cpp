@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "uds_client.h"
+#include "vehicle_profile.h"
+#include "tracker.h"
+
+UdsClient *UdsClient::_instance = nullptr;
+
+UdsClient::UdsClient() :
+    _dids(_config.did),
+    _values{},
+    _reload(true) {
+
+    _config.enable = false;
+    _config.tx = UDS_CLIENT_TX_ID_DEFAULT;
+    _config.rx = UDS_CLIENT_RX_ID_DEFAULT;
+    _config.extended = false;
+    for (auto& did : _config.did) {
+        did = {
+            .id = 0,
+            .period = UDS_CLIENT_PERIOD_DEFAULT_MS,
+            .width = 0,
+            .is_signed = false,
+            .scale = 1.0f,
+            .offset = 0.0f,
+            .tx = 0,
+            .rx = 0,
+        };
+    }
+}
+
+void UdsClient::init() {
+    static ConfigObject uds_desc("uds", {
+        ConfigBool("enable", &_config.enable),
+        ConfigInt("tx", &_config.tx, 0, 0x1FFFFFFF),
+        ConfigInt("rx", &_config.rx, 0, 0x1FFFFFFF),
+        ConfigBool("ext", &_config.extended),
+        ConfigObject("did1", {
+            ConfigInt("id", &_config.did[0].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[0].period, 100, 3600000),
+            ConfigInt("width", &_config.did[0].width, 0, 4),
+            ConfigBool("signed", &_config.did[0].is_signed),
+            ConfigFloat("scale", &_config.did[0].scale),
+            ConfigFloat("offset", &_config.did[0].offset),
+            ConfigInt("tx", &_config.did[0].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[0].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did2", {
+            ConfigInt("id", &_config.did[1].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[1].period, 100, 3600000),
+            ConfigInt("width", &_config.did[1].width, 0, 4),
+            ConfigBool("signed", &_config.did[1].is_signed),
+            ConfigFloat("scale", &_config.did[1].scale),
+            ConfigFloat("offset", &_config.did[1].offset),
+            ConfigInt("tx", &_config.did[1].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[1].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did3", {
+            ConfigInt("id", &_config.did[2].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[2].period, 100, 3600000),
+            ConfigInt("width", &_config.did[2].width, 0, 4),
+            ConfigBool("signed", &_config.did[2].is_signed),
+            ConfigFloat("scale", &_config.did[2].scale),
+            ConfigFloat("offset", &_config.did[2].offset),
+            ConfigInt("tx", &_config.did[2].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[2].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did4", {
+            ConfigInt("id", &_config.did[3].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[3].period, 100, 3600000),
+            ConfigInt("width", &_config.did[3].width, 0, 4),
+            ConfigBool("signed", &_config.did[3].is_signed),
+            ConfigFloat("scale", &_config.did[3].scale),
+            ConfigFloat("offset", &_config.did[3].offset),
+            ConfigInt("tx", &_config.did[3].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[3].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did5", {
+            ConfigInt("id", &_config.did[4].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[4].period, 100, 3600000),
+            ConfigInt("width", &_config.did[4].width, 0, 4),
+            ConfigBool("signed", &_config.did[4].is_signed),
+            ConfigFloat("scale", &_config.did[4].scale),
+            ConfigFloat("offset", &_config.did[4].offset),
+            ConfigInt("tx", &_config.did[4].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[4].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did6", {
+            ConfigInt("id", &_config.did[5].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[5].period, 100, 3600000),
+            ConfigInt("width", &_config.did[5].width, 0, 4),
+            ConfigBool("signed", &_config.did[5].is_signed),
+            ConfigFloat("scale", &_config.did[5].scale),
+            ConfigFloat("offset", &_config.did[5].offset),
+            ConfigInt("tx", &_config.did[5].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[5].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did7", {
+            ConfigInt("id", &_config.did[6].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[6].period, 100, 3600000),
+            ConfigInt("width", &_config.did[6].width, 0, 4),
+            ConfigBool("signed", &_config.did[6].is_signed),
+            ConfigFloat("scale", &_config.did[6].scale),
+            ConfigFloat("offset", &_config.did[6].offset),
+            ConfigInt("tx", &_config.did[6].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[6].rx, 0, 0x1FFFFFFF),
+        }),
+        ConfigObject("did8", {
+            ConfigInt("id", &_config.did[7].id, 0, 0xFFFF),
+            ConfigInt("period", &_config.did[7].period, 100, 3600000),
+            ConfigInt("width", &_config.did[7].width, 0, 4),
+            ConfigBool("signed", &_config.did[7].is_signed),
+            ConfigFloat("scale", &_config.did[7].scale),
+            ConfigFloat("offset", &_config.did[7].offset),
+            ConfigInt("tx", &_config.did[7].tx, 0, 0x1FFFFFFF),
+            ConfigInt("rx", &_config.did[7].rx, 0, 0x1FFFFFFF),
+        }),
+    },
+    nullptr,
+    std::bind(&UdsClient::exit_uds_config_cb, this, _1, _2, _3)
+    );
+    Tracker::instance().configService.registerModule(uds_desc);
+
+    Tracker::instance().location.regLocGenCallback(&UdsClient::loc_gen_cb, &UdsClient::loc_gen_commit_cb, this);
+}
+
+int UdsClient::exit_uds_config_cb(bool write, int status, const void *context) {
+    if (write && (status == SYSTEM_ERROR_NONE)) {
+        // Rebuild the schedule from the application loop
+        _reload = true;
+    }
+    return status;
+}
+
+void UdsClient::apply() {
+    auto& scheduler = CanScheduler::instance();
+    scheduler.remove(CanRequestType::UDS_DID);
+
+    for (auto& value : _values) {
+        value = {};
+    }
+
+    // A vehicle profile with its own DID table takes precedence over the configuration
+    auto& profile = VehicleProfile::instance().get();
+    size_t count = UDS_CLIENT_MAX_DIDS;
+    _dids = _config.did;
+    bool extended = _config.extended;
+    if (profile.didCount) {
+        count = profile.didCount;
+        _dids = profile.dids;
+        extended = profile.extended;
+    }
+    else if (!_config.enable) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        auto& did = _dids[i];
+        if (!did.id) {
+            continue;
+        }
+
+        CanRequest request {};
+        request.type = CanRequestType::UDS_DID;
+        request.txId = did.tx ? did.tx : _config.tx;
+        request.rxId = did.rx ? did.rx : _config.rx;
+        request.extended = extended;
+        request.id = (uint16_t)did.id;
+        request.period = did.period;
+        request.enabled = true;
+        request.callback = [this, i](const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp) {
+            onResponse(i, data, len, timestamp);
+        };
+
+        if (scheduler.add(request) < 0) {
+            Log.error("uds: no room to schedule did %04lx", did.id);
+        }
+    }
+}
+
+void UdsClient::onResponse(size_t slot, const uint8_t* data, size_t len, uint64_t timestamp) {
+    auto& did = _dids[slot];
+    auto& value = _values[slot];
+
+    size_t width = did.width ? did.width : std::min(len, (size_t)4);
+    if (!width || (len < width)) {
+        return;
+    }
+    size_t count = did.width ? std::min(len / width, UDS_CLIENT_MAX_ELEMENTS) : 1;
+
+    for (size_t n = 0; n < count; n++) {
+        uint32_t raw = 0;
+        for (size_t b = 0; b < width; b++) {
+            raw = (raw << 8) | data[n * width + b];
+        }
+
+        float element;
+        if (did.is_signed && (width < 4) && (raw & (1UL << (width * 8 - 1)))) {
+            element = (float)(int32_t)(raw | (0xFFFFFFFFUL << (width * 8)));
+        }
+        else if (did.is_signed) {
+            element = (float)(int32_t)raw;
+        }
+        else {
+            element = (float)raw;
+        }
+        value.values[n] = element * did.scale + did.offset;
+    }
+
+    value.count = count;
+    value.timestamp = timestamp;
+    value.valid = true;
+}
+
+void UdsClient::loop() {
+    if (_reload.exchange(false)) {
+        apply();
+    }
+}
+
+void UdsClient::loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context) {
+    bool any = false;
+    for (auto& value : _values) {
+        any |= value.valid;
+    }
+    if (!any) {
+        return;
+    }
+
+    uint64_t newest = 0;
+    writer.name("uds").beginObject();
+    for (size_t i = 0; i < UDS_CLIENT_MAX_DIDS; i++) {
+        auto& value = _values[i];
+        if (!value.valid) {
+            continue;
+        }
+        newest = std::max(newest, value.timestamp);
+
+        char key[5];
+        snprintf(key, sizeof(key), "%04x", (unsigned int)_dids[i].id);
+        writer.name(key);
+        if (_dids[i].width) {
+            writer.beginArray();
+            for (size_t n = 0; n < value.count; n++) {
+                writer.value(value.values[n]);
+            }
+            writer.endArray();
+        }
+        else {
+            writer.value(value.values[0]);
+        }
+    }
+    writer.endObject();
+
+    auto utc = ClockService::instance().toUtcUs(newest);
+    if (utc) {
+        writer.name("uds_ts").value((double)utc / 1000000.0, 3);
+    }
+}
+
+// Only publish values refreshed since the last publish that included them
+void UdsClient::loc_gen_commit_cb(const void *context) {
+    for (auto& value : _values) {
+        value.valid = false;
+    }
+}
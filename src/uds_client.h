@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "config_service.h"
+#include "location_service.h"
+#include "can_scheduler.h"
+#include "clock_service.h"
+
+// Number of configurable data identifiers
+constexpr size_t UDS_CLIENT_MAX_DIDS {8};
+
+// Largest number of elements decoded from an array valued DID (e.g. cell temperatures)
+constexpr size_t UDS_CLIENT_MAX_ELEMENTS {16};
+
+#define UDS_CLIENT_TX_ID_DEFAULT (0x7E0)
+#define UDS_CLIENT_RX_ID_DEFAULT (0x7E8)
+#define UDS_CLIENT_PERIOD_DEFAULT_MS (1000)
+
+/**
+ * @brief Configuration of a single data identifier
+ *
+ * @details The response is decoded as big-endian integers of width bytes.  A width of
+ * zero decodes the whole response, up to four bytes, as one value.  Each element is
+ * converted with value = raw * scale + offset.
+ */
+struct UdsDidConfig {
+    int32_t id;                     /**< Data identifier, 0 for unused */
+    int32_t period;                 /**< Request period in milliseconds */
+    int32_t width;                  /**< Bytes per element, 0 for a single value */
+    bool is_signed;                 /**< Elements are two's complement */
+    float scale;                    /**< Multiplier applied to the raw value */
+    float offset;                   /**< Offset added after scaling */
+    int32_t tx;                     /**< Request identifier, 0 for the module default */
+    int32_t rx;                     /**< Response identifier, 0 for the module default */
+};
+
+struct UdsConfig {
+    bool enable;
+    int32_t tx;
+    int32_t rx;
+    bool extended;
+    UdsDidConfig did[UDS_CLIENT_MAX_DIDS];
+};
+
+/**
+ * @brief UDS (ISO 14229) ReadDataByIdentifier client
+ *
+ * @details DIDs are described per vehicle in the "uds" configuration object, or by the DID
+ * table of the active vehicle profile, and polled through the CanScheduler alongside the
+ * OBD-II PIDs.  The latest decoded value of each DID
+ * is added to the location publish under "uds", keyed by the DID in hexadecimal, with the UTC
+ * reception time of the newest value under "uds_ts" once the clock is synced to GNSS.
+ */
+class UdsClient {
+public:
+    /**
+     * @brief Singleton class instance access for UdsClient
+     *
+     * @return UdsClient&
+     */
+    static UdsClient &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new UdsClient();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register configuration and location publish callbacks
+     *
+     */
+    void init();
+
+    /**
+     * @brief Apply configuration changes to the request schedule
+     *
+     */
+    void loop();
+
+    /**
+     * @brief Rebuild the request schedule, for example when the vehicle profile changes
+     *
+     */
+    void reload() {
+        _reload = true;
+    }
+
+private:
+    UdsClient();
+
+    struct DidValue {
+        bool valid;
+        size_t count;               // 1 for a single value, otherwise array elements
+        uint64_t timestamp;         // monotonic reception time in microseconds
+        float values[UDS_CLIENT_MAX_ELEMENTS];
+    };
+
+    void apply();
+    void onResponse(size_t slot, const uint8_t* data, size_t len, uint64_t timestamp);
+    int exit_uds_config_cb(bool write, int status, const void *context);
+    void loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context);
+    void loc_gen_commit_cb(const void *context);
+
+    UdsConfig _config;
+    const UdsDidConfig* _dids;      // table in use, from the configuration or the vehicle profile
+    DidValue _values[UDS_CLIENT_MAX_DIDS];
+    std::atomic<bool> _reload;
+
+    static UdsClient *_instance;
+};
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vehicle_integrator.h"
+
+// Accumulators hold twice the area under the curve (trapezoid sums skip the divide by 2)
+//   speed:     km/h * us * 2  ->  meters       = acc / (3600 * 1000 * 2)
+//   fuel rate: 0.05 L/h * us * 2  ->  mL       = acc * 0.05 / (3600 * 1000 * 2)
+//   MAF:       0.01 g/s * us * 2  ->  grams    = acc / (100 * 1000000 * 2)
+//              mL = grams * 1000 / (AFR * density)
+constexpr uint64_t SpeedAccPerMeter = 3600ULL * 1000 * 2;
+constexpr uint64_t FuelRateAccPerMl = 3600ULL * 1000 * 2 * 20;
+constexpr uint64_t MafAccPerMl = 20ULL * 1000 * VehicleStoichAfrX10 * VehicleFuelDensityGpl;
+
+VehicleIntegrator::VehicleIntegrator() :
+    _speed{},
+    _fuelRate{},
+    _maf{},
+    _window{},
+    _trip{} {
+
+}
+
+uint64_t VehicleIntegrator::trapezoid(Channel& channel, uint64_t timestamp, uint32_t raw) {
+    uint64_t area = 0;
+
+    if (channel.valid) {
+        // Samples stamped out of order are dropped rather than integrated backwards
+        if (timestamp <= channel.timestamp) {
+            return 0;
+        }
+        uint64_t dt = timestamp - channel.timestamp;
+        if (dt <= VehicleIntegratorMaxGapUs) {
+            area = (uint64_t)(channel.raw + raw) * dt;
+        }
+    }
+
+    channel.valid = true;
+    channel.timestamp = timestamp;
+    channel.raw = raw;
+
+    return area;
+}
+
+void VehicleIntegrator::stamp(uint64_t timestamp) {
+    for (auto acc : {&_window, &_trip}) {
+        if (!acc->firstUs) {
+            acc->firstUs = timestamp;
+        }
+        acc->lastUs = std::max(acc->lastUs, timestamp);
+    }
+}
+
+void VehicleIntegrator::addSpeed(uint64_t timestamp, uint32_t kph) {
+    auto area = trapezoid(_speed, timestamp, kph);
+    _window.speed += area;
+    _trip.speed += area;
+    stamp(timestamp);
+}
+
+void VehicleIntegrator::addFuelRate(uint64_t timestamp, uint32_t raw) {
+    auto area = trapezoid(_fuelRate, timestamp, raw);
+    _window.fuelRate += area;
+    _trip.fuelRate += area;
+    stamp(timestamp);
+}
+
+void VehicleIntegrator::addMaf(uint64_t timestamp, uint32_t raw) {
+    auto area = trapezoid(_maf, timestamp, raw);
+    _window.maf += area;
+    _trip.maf += area;
+    stamp(timestamp);
+}
+
+void VehicleIntegrator::interrupt() {
+    _speed.valid = false;
+    _fuelRate.valid = false;
+    _maf.valid = false;
+}
+
+VehicleTotals VehicleIntegrator::convert(const Accumulators& acc) {
+    VehicleTotals totals {};
+
+    totals.distanceM = (uint32_t)(acc.speed / SpeedAccPerMeter);
+    // Only one of the fuel PIDs is requested at any time so the two sums never overlap
+    totals.fuelMl = (uint32_t)(acc.fuelRate / FuelRateAccPerMl + acc.maf / MafAccPerMl);
+
+    if (acc.fuelRate) {
+        totals.fuelSource = VehicleFuelSource::FUEL_RATE;
+    }
+    else if (acc.maf) {
+        totals.fuelSource = VehicleFuelSource::MAF;
+    }
+    else {
+        totals.fuelSource = VehicleFuelSource::NONE;
+    }
+
+    totals.firstUs = acc.firstUs;
+    totals.lastUs = acc.lastUs;
+
+    return totals;
+}
+
+VehicleTotals VehicleIntegrator::getWindow() const {
+    return convert(_window);
+}
+
+void VehicleIntegrator::resetWindow() {
+    // Keep what convert() truncated so that it carries into the next window
+    Accumulators remainder {};
+    remainder.speed = _window.speed % SpeedAccPerMeter;
+    remainder.fuelRate = _window.fuelRate % FuelRateAccPerMl;
+    remainder.maf = _window.maf % MafAccPerMl;
+    _window = remainder;
+}
+
+VehicleTotals VehicleIntegrator::getTrip() const {
+    return convert(_trip);
+}
+
+void VehicleIntegrator::resetTrip() {
+    _trip = {};
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Samples further apart than this are not integrated across (request failed or vehicle off)
+constexpr uint64_t VehicleIntegratorMaxGapUs = 2000000; // microseconds
+
+// Stoichiometric air-fuel ratio, in tenths, used to derive fuel flow from mass air flow
+constexpr uint32_t VehicleStoichAfrX10 = 147; // gasoline, 14.7:1
+
+// Fuel density used to convert fuel mass to volume
+constexpr uint32_t VehicleFuelDensityGpl = 745; // gasoline, grams per liter
+
+/**
+ * @brief Source used for the fuel consumption figure
+ *
+ */
+enum class VehicleFuelSource {
+    NONE,                           /**< No fuel related samples integrated */
+    FUEL_RATE,                      /**< Engine fuel rate (PID 0x5E) */
+    MAF,                            /**< Mass air flow (PID 0x10) with stoichiometric conversion */
+};
+
+/**
+ * @brief Integrated totals over a window or a trip
+ *
+ */
+struct VehicleTotals {
+    uint32_t distanceM;             /**< Distance driven in meters */
+    uint32_t fuelMl;                /**< Fuel used in milliliters */
+    VehicleFuelSource fuelSource;   /**< Source of the fuel figure */
+    uint64_t firstUs;               /**< Monotonic time of the first sample, 0 for none */
+    uint64_t lastUs;                /**< Monotonic time of the last sample, 0 for none */
+};
+
+/**
+ * @brief Integrate distance and fuel from instantaneous OBD-II samples
+ *
+ * @details Each channel is integrated with the trapezoidal rule over the actual sample
+ * timestamps, the monotonic microsecond reception times from ClockService.  Accumulators hold raw sums of (v0 + v1) * dt in fixed-point so that no
+ * precision is lost between publishes; conversion to engineering units only happens when
+ * totals are read.
+ */
+class VehicleIntegrator {
+public:
+    VehicleIntegrator();
+
+    /**
+     * @brief Add a vehicle speed sample (PID 0x0D)
+     *
+     * @param timestamp Monotonic time, in microseconds, that the sample was received
+     * @param kph Vehicle speed in km/h
+     */
+    void addSpeed(uint64_t timestamp, uint32_t kph);
+
+    /**
+     * @brief Add an engine fuel rate sample (PID 0x5E)
+     *
+     * @param timestamp Monotonic time, in microseconds, that the sample was received
+     * @param raw Raw PID value, 0.05 L/h per bit
+     */
+    void addFuelRate(uint64_t timestamp, uint32_t raw);
+
+    /**
+     * @brief Add a mass air flow sample (PID 0x10)
+     *
+     * @param timestamp Monotonic time, in microseconds, that the sample was received
+     * @param raw Raw PID value, 0.01 g/s per bit
+     */
+    void addMaf(uint64_t timestamp, uint32_t raw);
+
+    /**
+     * @brief Stop integrating across the current samples, for example on ignition off
+     *
+     */
+    void interrupt();
+
+    /**
+     * @brief Get totals accumulated since the last window reset
+     *
+     * @return VehicleTotals
+     */
+    VehicleTotals getWindow() const;
+
+    /**
+     * @brief Reset the window totals
+     *
+     * @details Fractions of a meter or milliliter not yet reported are kept for the next
+     * window.
+     */
+    void resetWindow();
+
+    /**
+     * @brief Get totals accumulated since the last trip reset
+     *
+     * @return VehicleTotals
+     */
+    VehicleTotals getTrip() const;
+
+    /**
+     * @brief Reset the trip totals
+     *
+     */
+    void resetTrip();
+
+private:
+    struct Channel {
+        bool valid;
+        uint64_t timestamp;
+        uint32_t raw;
+    };
+
+    struct Accumulators {
+        uint64_t speed;             // sum of (kph0 + kph1) * us
+        uint64_t fuelRate;          // sum of (raw0 + raw1) * us, 0.05 L/h per bit
+        uint64_t maf;               // sum of (raw0 + raw1) * us, 0.01 g/s per bit
+        uint64_t firstUs;
+        uint64_t lastUs;
+    };
+
+    static uint64_t trapezoid(Channel& channel, uint64_t timestamp, uint32_t raw);
+    void stamp(uint64_t timestamp);
+    static VehicleTotals convert(const Accumulators& acc);
+
+    Channel _speed;
+    Channel _fuelRate;
+    Channel _maf;
+    Accumulators _window;
+    Accumulators _trip;
+};
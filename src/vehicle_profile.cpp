@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vehicle_profile.h"
+#include "tracker.h"
+#include "event_stream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define VEHICLE_PROFILE_ACTIVE_FILE (VEHICLE_PROFILE_DIR "/active")
+
+// OBD-II service 0x09 PID for the vehicle identification number
+constexpr uint16_t PidVehicleVin = 0x02;
+constexpr system_tick_t VinRequestPeriod = 5000; // milliseconds
+
+// Serialized sizes of each part of a profile
+constexpr size_t HeaderSize = 40;
+constexpr size_t PidEntrySize = 4;
+constexpr size_t DidEntrySize = 24;
+constexpr size_t SignalEntrySize = 24;
+constexpr size_t CrcSize = 4;
+constexpr size_t VinPrefixOffset = 24;
+constexpr size_t MaxProfileSize = HeaderSize +
+    VEHICLE_PROFILE_MAX_PIDS * PidEntrySize +
+    VEHICLE_PROFILE_MAX_DIDS * DidEntrySize +
+    VEHICLE_PROFILE_MAX_SIGNALS * SignalEntrySize +
+    CrcSize;
+
+// Largest decoded chunk accepted by the upload command
+constexpr size_t MaxUploadChunk = 512;
+
+// Shared by loading and uploading, both run from the application thread
+static uint8_t profile_buffer[MaxProfileSize];
+
+VehicleProfile *VehicleProfile::_instance = nullptr;
+
+namespace {
+
+class ProfileReader {
+public:
+    ProfileReader(const uint8_t* buffer, size_t size) : _buffer(buffer), _size(size), _pos(0) {}
+
+    bool ok(size_t count) const {
+        return (_pos + count) <= _size;
+    }
+
+    uint8_t u8() {
+        return _buffer[_pos++];
+    }
+
+    uint16_t u16() {
+        uint16_t value = _buffer[_pos] | (_buffer[_pos + 1] << 8);
+        _pos += 2;
+        return value;
+    }
+
+    uint32_t u32() {
+        uint32_t value = (uint32_t)_buffer[_pos] |
+            ((uint32_t)_buffer[_pos + 1] << 8) |
+            ((uint32_t)_buffer[_pos + 2] << 16) |
+            ((uint32_t)_buffer[_pos + 3] << 24);
+        _pos += 4;
+        return value;
+    }
+
+    float f32() {
+        uint32_t bits = u32();
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    void bytes(void* dest, size_t count) {
+        memcpy(dest, _buffer + _pos, count);
+        _pos += count;
+    }
+
+private:
+    const uint8_t* _buffer;
+    size_t _size;
+    size_t _pos;
+};
+
+int hexNibble(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+void profilePath(char* path, size_t size, unsigned int id, const char* extension) {
+    snprintf(path, size, VEHICLE_PROFILE_DIR "/%u.%s", id, extension);
+}
+
+} // namespace
+
+VehicleProfile::VehicleProfile() :
+    _config{.profile = 0},
+    _values{},
+    _vin{},
+    _vinRequest(-1),
+    _reload(false),
+    _vinReceived(false) {
+
+    setDefaults(_active);
+}
+
+void VehicleProfile::setDefaults(VehicleProfileData& data) {
+    data = {};
+    data.bitrate = 500000;
+    data.obdTx = CAN_SCHEDULER_OBD_FUNCTIONAL_ID;
+    data.obdRx = 0x7E8;
+    data.idleRpm = 1600;
+    data.idleSpeed = 10;
+}
+
+uint32_t VehicleProfile::crc32(const uint8_t* buffer, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= buffer[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+int VehicleProfile::parse(const uint8_t* buffer, size_t size, VehicleProfileData& data) {
+    CHECK_TRUE(size >= HeaderSize + CrcSize, SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    ProfileReader crcReader(buffer + size - CrcSize, CrcSize);
+    CHECK_TRUE(crcReader.u32() == crc32(buffer, size - CrcSize), SYSTEM_ERROR_BAD_DATA);
+
+    ProfileReader reader(buffer, size - CrcSize);
+    CHECK_TRUE(reader.u32() == VEHICLE_PROFILE_MAGIC, SYSTEM_ERROR_BAD_DATA);
+    CHECK_TRUE(reader.u16() == VEHICLE_PROFILE_VERSION, SYSTEM_ERROR_NOT_SUPPORTED);
+
+    setDefaults(data);
+    auto flags = reader.u16();
+    data.extended = flags & 0x01;
+    data.bitrate = reader.u32();
+    data.idleRpm = reader.u16();
+    data.idleSpeed = reader.u16();
+    data.obdTx = reader.u32();
+    data.obdRx = reader.u32();
+    auto prefixLen = std::min((size_t)reader.u8(), VEHICLE_PROFILE_VIN_PREFIX_LEN);
+    reader.bytes(data.vinPrefix, VEHICLE_PROFILE_VIN_PREFIX_LEN);
+    data.vinPrefix[prefixLen] = '\0';
+    data.pidCount = reader.u8();
+    data.didCount = reader.u8();
+    data.signalCount = reader.u8();
+    reader.u8();
+
+    CHECK_TRUE(data.pidCount <= VEHICLE_PROFILE_MAX_PIDS, SYSTEM_ERROR_TOO_LARGE);
+    CHECK_TRUE(data.didCount <= VEHICLE_PROFILE_MAX_DIDS, SYSTEM_ERROR_TOO_LARGE);
+    CHECK_TRUE(data.signalCount <= VEHICLE_PROFILE_MAX_SIGNALS, SYSTEM_ERROR_TOO_LARGE);
+    CHECK_TRUE(reader.ok(data.pidCount * PidEntrySize +
+        data.didCount * DidEntrySize +
+        data.signalCount * SignalEntrySize), SYSTEM_ERROR_BAD_DATA);
+
+    for (size_t i = 0; i < data.pidCount; i++) {
+        auto& pid = data.pids[i];
+        pid.pid = reader.u8();
+        reader.u8();
+        pid.period = reader.u16();
+    }
+
+    for (size_t i = 0; i < data.didCount; i++) {
+        auto& did = data.dids[i];
+        did.id = reader.u16();
+        did.period = std::max((int32_t)reader.u16(), (int32_t)100);
+        did.tx = reader.u32();
+        did.rx = reader.u32();
+        did.width = std::min(reader.u8(), (uint8_t)4);
+        did.is_signed = reader.u8() & 0x01;
+        reader.u16();
+        did.scale = reader.f32();
+        did.offset = reader.f32();
+    }
+
+    for (size_t i = 0; i < data.signalCount; i++) {
+        VehicleProfileSignal signal {};
+        signal.canId = reader.u32();
+        signal.startBit = reader.u16();
+        signal.length = reader.u8();
+        auto signalFlags = reader.u8();
+        signal.is_signed = signalFlags & 0x01;
+        signal.bigEndian = signalFlags & 0x02;
+        signal.extended = signalFlags & 0x04;
+        signal.event = signalFlags & 0x08;
+        signal.critical = signalFlags & 0x10;
+        signal.scale = reader.f32();
+        signal.offset = reader.f32();
+        reader.bytes(signal.name, VEHICLE_PROFILE_SIGNAL_NAME_LEN);
+        signal.name[VEHICLE_PROFILE_SIGNAL_NAME_LEN] = '\0';
+
+        CHECK_TRUE((signal.length >= 1) && (signal.length <= 32), SYSTEM_ERROR_BAD_DATA);
+        CHECK_TRUE(signal.startBit + signal.length <= 64, SYSTEM_ERROR_BAD_DATA);
+
+        // Insert in CAN id order so that frames can be matched with a binary search
+        size_t pos = i;
+        while ((pos > 0) && (data.signals[pos - 1].canId > signal.canId)) {
+            data.signals[pos] = data.signals[pos - 1];
+            pos--;
+        }
+        data.signals[pos] = signal;
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int VehicleProfile::load(uint16_t id) {
+    char path[32];
+    profilePath(path, sizeof(path), id, "vpf");
+
+    int fd = open(path, O_RDONLY);
+    CHECK_TRUE(fd >= 0, SYSTEM_ERROR_NOT_FOUND);
+    int size = read(fd, profile_buffer, sizeof(profile_buffer));
+    close(fd);
+    CHECK_TRUE(size > 0, SYSTEM_ERROR_IO);
+
+    int ret = parse(profile_buffer, size, _scratch);
+    if (ret) {
+        Log.error("vehicle profile %u invalid: %d", id, ret);
+        return ret;
+    }
+    _scratch.id = id;
+    activate(_scratch);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int VehicleProfile::findByVin(const char* vin) {
+    DIR* dir = opendir(VEHICLE_PROFILE_DIR);
+    CHECK_TRUE(dir, SYSTEM_ERROR_NOT_FOUND);
+
+    int found = SYSTEM_ERROR_NOT_FOUND;
+    struct dirent* entry;
+    while ((found < 0) && (entry = readdir(dir))) {
+        unsigned int id = 0;
+        char extension[4] = {};
+        if ((sscanf(entry->d_name, "%u.%3s", &id, extension) != 2) || strcmp(extension, "vpf") || !id) {
+            continue;
+        }
+
+        // Only the header is needed to match, the full file is validated when loaded
+        char path[32];
+        profilePath(path, sizeof(path), id, "vpf");
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        uint8_t header[HeaderSize];
+        int size = read(fd, header, sizeof(header));
+        close(fd);
+        if (size != (int)sizeof(header)) {
+            continue;
+        }
+
+        ProfileReader reader(header, sizeof(header));
+        if (reader.u32() != VEHICLE_PROFILE_MAGIC) {
+            continue;
+        }
+        auto prefixLen = std::min((size_t)header[VinPrefixOffset], VEHICLE_PROFILE_VIN_PREFIX_LEN);
+        if (prefixLen && !strncmp((const char*)header + VinPrefixOffset + 1, vin, prefixLen)) {
+            found = id;
+        }
+    }
+    closedir(dir);
+
+    return found;
+}
+
+void VehicleProfile::activate(const VehicleProfileData& data) {
+    _active = data;
+    for (auto& value : _values) {
+        value = {};
+    }
+
+    // Remember the profile so that the right bitrate is used from the next boot
+    int fd = open(VEHICLE_PROFILE_ACTIVE_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd >= 0) {
+        uint16_t id = _active.id;
+        write(fd, &id, sizeof(id));
+        close(fd);
+    }
+
+    Log.info("vehicle profile %u active", _active.id);
+
+    scheduleVin();
+    UdsClient::instance().reload();
+    for (auto& callback : _changeCallbacks) {
+        callback(_active);
+    }
+}
+
+void VehicleProfile::scheduleVin() {
+    auto& scheduler = CanScheduler::instance();
+    scheduler.remove(CanRequestType::OBD_VEHICLE_INFO);
+
+    CanRequest request {};
+    request.type = CanRequestType::OBD_VEHICLE_INFO;
+    request.txId = _active.obdTx;
+    request.rxId = _active.obdRx;
+    request.extended = _active.extended;
+    request.id = PidVehicleVin;
+    request.period = VinRequestPeriod;
+    request.enabled = (_config.profile == 0) && !_vinReceived;
+    request.callback = [this](const CanRequest& request, const uint8_t* data, size_t len, uint64_t timestamp) {
+        onVin(data, len);
+    };
+    _vinRequest = scheduler.add(request);
+}
+
+void VehicleProfile::requestVin() {
+    _vinReceived = false;
+    CanScheduler::instance().setEnabled(_vinRequest, _config.profile == 0);
+}
+
+void VehicleProfile::onVin(const uint8_t* data, size_t len) {
+    // Response is the number of data items followed by the VIN, some ECUs pad the front
+    if (len < VEHICLE_PROFILE_VIN_LEN) {
+        return;
+    }
+    memcpy(_vin, data + len - VEHICLE_PROFILE_VIN_LEN, VEHICLE_PROFILE_VIN_LEN);
+    _vin[VEHICLE_PROFILE_VIN_LEN] = '\0';
+    _vinReceived = true;
+    CanScheduler::instance().setEnabled(_vinRequest, false);
+
+    Log.info("vehicle VIN %s", _vin);
+
+    if (_config.profile == 0) {
+        int id = findByVin(_vin);
+        if ((id > 0) && (id != _active.id)) {
+            load(id);
+        }
+    }
+}
+
+void VehicleProfile::init() {
+    mkdir(VEHICLE_PROFILE_DIR, 0777);
+
+    static ConfigObject vehicle_desc("vehicle", {
+        ConfigInt("profile", &_config.profile, 0, 65535),
+    },
+    nullptr,
+    std::bind(&VehicleProfile::exit_vehicle_config_cb, this, _1, _2, _3)
+    );
+    Tracker::instance().configService.registerModule(vehicle_desc);
+
+    CloudService::instance().regCommandCallback("vehicle_profile", &VehicleProfile::profile_cmd_cb, this);
+    Tracker::instance().location.regLocGenCallback(&VehicleProfile::loc_gen_cb, &VehicleProfile::loc_gen_commit_cb, this);
+
+    uint16_t id = _config.profile;
+    if (!id) {
+        int fd = open(VEHICLE_PROFILE_ACTIVE_FILE, O_RDONLY);
+        if (fd >= 0) {
+            read(fd, &id, sizeof(id));
+            close(fd);
+        }
+    }
+
+    if (!id || load(id)) {
+        scheduleVin();
+    }
+}
+
+int VehicleProfile::exit_vehicle_config_cb(bool write, int status, const void *context) {
+    if (write && (status == SYSTEM_ERROR_NONE)) {
+        _reload = true;
+    }
+    return status;
+}
+
+void VehicleProfile::loop() {
+    if (!_reload.exchange(false)) {
+        return;
+    }
+
+    if (_config.profile) {
+        if (_config.profile != _active.id) {
+            load(_config.profile);
+        }
+        CanScheduler::instance().setEnabled(_vinRequest, false);
+    }
+    else if (_vinReceived) {
+        int id = findByVin(_vin);
+        if ((id > 0) && (id != _active.id)) {
+            load(id);
+        }
+    }
+    else {
+        requestVin();
+    }
+}
+
+bool VehicleProfile::onFrame(uint32_t id, bool extended, const uint8_t* data, uint8_t len, uint64_t timestamp) {
+    // Binary search for the first signal carried by this CAN id
+    size_t low = 0;
+    size_t high = _active.signalCount;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (_active.signals[mid].canId < id) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    if ((low >= _active.signalCount) || (_active.signals[low].canId != id)) {
+        return false;
+    }
+
+    uint64_t littleWord = 0;
+    uint64_t bigWord = 0;
+    for (size_t i = 0; i < 8; i++) {
+        uint8_t byte = (i < len) ? data[i] : 0;
+        littleWord |= (uint64_t)byte << (i * 8);
+        bigWord = (bigWord << 8) | byte;
+    }
+
+    bool decoded = false;
+    for (size_t i = low; (i < _active.signalCount) && (_active.signals[i].canId == id); i++) {
+        auto& signal = _active.signals[i];
+        if (signal.extended != extended) {
+            continue;
+        }
+
+        uint64_t mask = (1ULL << signal.length) - 1;
+        uint64_t raw = signal.bigEndian ?
+            (bigWord >> (64 - signal.startBit - signal.length)) & mask :
+            (littleWord >> signal.startBit) & mask;
+
+        float value;
+        if (signal.is_signed && (raw & (1ULL << (signal.length - 1)))) {
+            value = (float)((int64_t)raw - (int64_t)(1ULL << signal.length));
+        }
+        else {
+            value = (float)raw;
+        }
+
+        value = value * signal.scale + signal.offset;
+        if (signal.event && (!_values[i].decoded || (value != _values[i].value))) {
+            EventStream::instance().post(signal.name, value, timestamp, signal.critical);
+        }
+
+        _values[i].value = value;
+        _values[i].timestamp = timestamp;
+        _values[i].decoded = true;
+        _values[i].valid = true;
+        decoded = true;
+    }
+
+    return decoded;
+}
+
+int VehicleProfile::profile_cmd_cb(CloudServiceStatus status, JSONValue *root, const void *context) {
+    int id = 0;
+    int offset = 0;
+    bool last = false;
+    bool erase = false;
+    JSONString data;
+
+    JSONObjectIterator item(*root);
+    while (item.next()) {
+        if (item.name() == "id") {
+            id = item.value().toInt();
+        }
+        else if (item.name() == "offset") {
+            offset = item.value().toInt();
+        }
+        else if (item.name() == "data") {
+            data = item.value().toString();
+        }
+        else if (item.name() == "last") {
+            last = item.value().toBool();
+        }
+        else if (item.name() == "delete") {
+            erase = item.value().toBool();
+        }
+    }
+
+    CHECK_TRUE((id > 0) && (id <= 65535), SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    char path[32];
+    char tempPath[32];
+    profilePath(path, sizeof(path), id, "vpf");
+    profilePath(tempPath, sizeof(tempPath), id, "tmp");
+
+    if (erase) {
+        unlink(path);
+        return SYSTEM_ERROR_NONE;
+    }
+
+    size_t chunk = data.size() / 2;
+    CHECK_TRUE(((data.size() % 2) == 0) && (chunk <= MaxUploadChunk), SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE((offset >= 0) && ((size_t)offset + chunk <= MaxProfileSize), SYSTEM_ERROR_TOO_LARGE);
+
+    for (size_t i = 0; i < chunk; i++) {
+        int high = hexNibble(data.data()[i * 2]);
+        int low = hexNibble(data.data()[i * 2 + 1]);
+        CHECK_TRUE((high >= 0) && (low >= 0), SYSTEM_ERROR_INVALID_ARGUMENT);
+        profile_buffer[i] = (high << 4) | low;
+    }
+
+    int fd = open(tempPath, O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC));
+    CHECK_TRUE(fd >= 0, SYSTEM_ERROR_IO);
+    lseek(fd, offset, SEEK_SET);
+    int written = write(fd, profile_buffer, chunk);
+    close(fd);
+    CHECK_TRUE(written == (int)chunk, SYSTEM_ERROR_IO);
+
+    if (!last) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // Validate the complete file before replacing the stored profile
+    fd = open(tempPath, O_RDONLY);
+    CHECK_TRUE(fd >= 0, SYSTEM_ERROR_IO);
+    int size = read(fd, profile_buffer, sizeof(profile_buffer));
+    close(fd);
+
+    int ret = (size > 0) ? parse(profile_buffer, size, _scratch) : SYSTEM_ERROR_IO;
+    if (ret) {
+        Log.error("vehicle profile %d upload invalid: %d", id, ret);
+        unlink(tempPath);
+        return ret;
+    }
+
+    unlink(path);
+    CHECK_FALSE(rename(tempPath, path), SYSTEM_ERROR_IO);
+    Log.info("vehicle profile %d stored", id);
+
+    // Reload so that an updated profile takes effect immediately
+    if ((_config.profile == id) || (_active.id == id)) {
+        load(id);
+    }
+    else if (!_config.profile && _vinReceived && (findByVin(_vin) == id)) {
+        load(id);
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void VehicleProfile::loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context) {
+    if (!_active.id) {
+        return;
+    }
+
+    writer.name("vprof").value((unsigned int)_active.id);
+
+    bool any = false;
+    for (size_t i = 0; i < _active.signalCount; i++) {
+        any |= _values[i].valid;
+    }
+    if (!any) {
+        return;
+    }
+
+    uint64_t newest = 0;
+    writer.name("sig").beginObject();
+    for (size_t i = 0; i < _active.signalCount; i++) {
+        if (_values[i].valid) {
+            writer.name(_active.signals[i].name).value(_values[i].value);
+            newest = std::max(newest, _values[i].timestamp);
+        }
+    }
+    writer.endObject();
+
+    auto utc = ClockService::instance().toUtcUs(newest);
+    if (utc) {
+        writer.name("sig_ts").value((double)utc / 1000000.0, 3);
+    }
+}
+
+// Signals are only published again once refreshed, after the publish that included them
+void VehicleProfile::loc_gen_commit_cb(const void *context) {
+    for (size_t i = 0; i < _active.signalCount; i++) {
+        _values[i].valid = false;
+    }
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "cloud_service.h"
+#include "location_service.h"
+#include "can_scheduler.h"
+#include "uds_client.h"
+#include "clock_service.h"
+
+#define VEHICLE_PROFILE_DIR "/usr/vehicle"
+
+// Maximum entries of each table in a profile
+constexpr size_t VEHICLE_PROFILE_MAX_PIDS {8};
+constexpr size_t VEHICLE_PROFILE_MAX_DIDS {UDS_CLIENT_MAX_DIDS};
+constexpr size_t VEHICLE_PROFILE_MAX_SIGNALS {32};
+
+// Length of signal names, not null terminated in the file when all bytes are used
+constexpr size_t VEHICLE_PROFILE_SIGNAL_NAME_LEN {8};
+
+// Length of the VIN prefix (WMI and VDS) used to match a profile
+constexpr size_t VEHICLE_PROFILE_VIN_PREFIX_LEN {11};
+
+constexpr size_t VEHICLE_PROFILE_VIN_LEN {17};
+
+/*
+ * Vehicle profile file format, all values little-endian
+ *
+ *   header    uint32 magic "VPF1", uint16 version, uint16 flags (bit0: 29-bit OBD identifiers),
+ *             uint32 bitrate, uint16 idle rpm, uint16 idle speed (km/h),
+ *             uint32 OBD request id, uint32 OBD response id,
+ *             uint8 VIN prefix length, char VIN prefix[11],
+ *             uint8 pid count, uint8 did count, uint8 signal count, uint8 reserved
+ *   pids      uint8 pid, uint8 reserved, uint16 period (ms)
+ *   dids      uint16 did, uint16 period (ms), uint32 tx id, uint32 rx id, uint8 width,
+ *             uint8 flags (bit0: signed), uint16 reserved, float scale, float offset
+ *   signals   uint32 CAN id, uint16 start bit, uint8 length, uint8 flags (bit0: signed,
+ *             bit1: big-endian, bit2: 29-bit id, bit3: event on change, bit4: critical event),
+ *             float scale, float offset, char name[8]
+ *   trailer   uint32 CRC-32 of everything before it
+ *
+ * Little-endian signals start at bit startBit counted from the least significant bit of
+ * byte 0.  Big-endian signals start at bit startBit counted from the most significant bit
+ * of byte 0 and run towards byte 7.  Signals flagged as events are also posted to the
+ * EventStream whenever their value changes.
+ */
+constexpr uint32_t VEHICLE_PROFILE_MAGIC {0x31465056}; // "VPF1"
+constexpr uint16_t VEHICLE_PROFILE_VERSION {1};
+
+struct VehicleProfilePid {
+    uint8_t pid;
+    system_tick_t period;
+};
+
+struct VehicleProfileSignal {
+    uint32_t canId;
+    bool extended;
+    uint16_t startBit;
+    uint8_t length;
+    bool is_signed;
+    bool bigEndian;
+    bool event;                     // post to the event stream on change
+    bool critical;                  // publish the event without waiting for the interval
+    float scale;
+    float offset;
+    char name[VEHICLE_PROFILE_SIGNAL_NAME_LEN + 1];
+};
+
+/**
+ * @brief Decoder tables for one vehicle model
+ *
+ */
+struct VehicleProfileData {
+    uint16_t id;                    /**< Profile identifier, 0 when using built in defaults */
+    uint32_t bitrate;               /**< CAN bitrate in bits per second */
+    bool extended;                  /**< OBD-II uses 29-bit identifiers */
+    uint32_t obdTx;                 /**< OBD-II request identifier */
+    uint32_t obdRx;                 /**< OBD-II response identifier */
+    uint16_t idleRpm;               /**< Engine idle threshold */
+    uint16_t idleSpeed;             /**< Vehicle idle threshold in km/h */
+    char vinPrefix[VEHICLE_PROFILE_VIN_PREFIX_LEN + 1];
+    size_t pidCount;
+    VehicleProfilePid pids[VEHICLE_PROFILE_MAX_PIDS];
+    size_t didCount;
+    UdsDidConfig dids[VEHICLE_PROFILE_MAX_DIDS];
+    size_t signalCount;
+    VehicleProfileSignal signals[VEHICLE_PROFILE_MAX_SIGNALS]; // sorted by CAN id
+};
+
+struct VehicleProfileConfig {
+    int32_t profile;                // 0 = select by VIN
+};
+
+/**
+ * @brief Per-vehicle profiles stored in the filesystem
+ *
+ * @details Profiles are uploaded with the "vehicle_profile" cloud command and stored as
+ * /usr/vehicle/<id>.vpf.  The active profile is chosen by the "vehicle" configuration or,
+ * when that is 0, by matching the VIN read over OBD-II against the VIN prefix of each stored
+ * profile.  Files are parsed once into fixed tables so decoding costs nothing per sample;
+ * broadcast signals are looked up by binary search on the CAN id.
+ */
+class VehicleProfile {
+public:
+    /**
+     * @brief Singleton class instance access for VehicleProfile
+     *
+     * @return VehicleProfile&
+     */
+    static VehicleProfile &instance()
+    {
+        if(!_instance)
+        {
+            _instance = new VehicleProfile();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register configuration and commands and load the last active profile
+     *
+     */
+    void init();
+
+    /**
+     * @brief Handle profile selection changes
+     *
+     */
+    void loop();
+
+    /**
+     * @brief Get the active profile
+     *
+     * @return const VehicleProfileData&
+     */
+    const VehicleProfileData& get() const {
+        return _active;
+    }
+
+    /**
+     * @brief Register a callback for when a different profile becomes active
+     *
+     * @param cb Callback function
+     */
+    void regChangeCallback(std::function<void(const VehicleProfileData&)> cb) {
+        _changeCallbacks.append(cb);
+    }
+
+    /**
+     * @brief Read the VIN again, for example after the ignition is switched on
+     *
+     */
+    void requestVin();
+
+    /**
+     * @brief Decode broadcast signals from a received frame
+     *
+     * @param id CAN identifier without flag bits
+     * @param extended Frame uses a 29-bit identifier
+     * @param data Frame data
+     * @param len Frame data length
+     * @param timestamp Monotonic time, in microseconds, the frame was received
+     * @return true Frame carried at least one signal
+     * @return false Frame is not described by the profile
+     */
+    bool onFrame(uint32_t id, bool extended, const uint8_t* data, uint8_t len, uint64_t timestamp);
+
+private:
+    VehicleProfile();
+
+    struct SignalValue {
+        bool valid;                 // refreshed since the last publish
+        bool decoded;               // value holds a decoded sample
+        float value;
+        uint64_t timestamp;
+    };
+
+    static void setDefaults(VehicleProfileData& data);
+    static int parse(const uint8_t* buffer, size_t size, VehicleProfileData& data);
+    static uint32_t crc32(const uint8_t* buffer, size_t size);
+
+    int load(uint16_t id);
+    int findByVin(const char* vin);
+    void activate(const VehicleProfileData& data);
+    void scheduleVin();
+    void onVin(const uint8_t* data, size_t len);
+
+    int exit_vehicle_config_cb(bool write, int status, const void *context);
+    int profile_cmd_cb(CloudServiceStatus status, JSONValue *root, const void *context);
+    void loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context);
+    void loc_gen_commit_cb(const void *context);
+
+    VehicleProfileConfig _config;
+    VehicleProfileData _active;
+    VehicleProfileData _scratch;
+    SignalValue _values[VEHICLE_PROFILE_MAX_SIGNALS];
+    char _vin[VEHICLE_PROFILE_VIN_LEN + 1];
+    int _vinRequest;
+    std::atomic<bool> _reload;
+    bool _vinReceived;
+    Vector<std::function<void(const VehicleProfileData&)>> _changeCallbacks;
+
+    static VehicleProfile *_instance;
+};